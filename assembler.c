@@ -1,15 +1,35 @@
 #define _POSIX_C_SOURCE 200809L
 #include "assembler.h"
 #include "cpu.h"
+#include "linker.h"
+#include "symbols.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NAME_CHUNK_SIZE 4096
+#define MIN_OUTPUT_CAPACITY 4096
+#define MIN_LABEL_SLOTS 64
+#define PEEPHOLE_SCAN 64        // Instructions followed looking for a read
+#define PEEPHOLE_BRANCHES 4     // Conditional branches followed on the way
+
+// Block of interned label names; labels point into it, so it never moves
+struct NameChunk {
+    NameChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
 
 // Initialize assembler
 void assembler_init(Assembler *as) {
     memset(as, 0, sizeof(Assembler));
-    as->output = malloc(MEMORY_SIZE);
+    as->output = NULL;
     as->output_size = 0;
     as->current_address = 0;
     as->line_number = 0;
@@ -21,31 +41,145 @@ void assembler_free(Assembler *as) {
         free(as->output);
         as->output = NULL;
     }
+    as->output_size = 0;
+    as->output_capacity = 0;
+    while (as->names) {
+        NameChunk *next = as->names->next;
+        free(as->names);
+        as->names = next;
+    }
+    free(as->labels);
+    free(as->label_slots);
+    free(as->fixups);
+    free(as->insn_offsets);
+    as->insn_offsets = NULL;
+    as->insn_count = 0;
+    as->insn_capacity = 0;
+    as->labels = NULL;
+    as->label_slots = NULL;
+    as->fixups = NULL;
+    as->fixup_count = 0;
+    as->fixup_capacity = 0;
+    as->label_count = 0;
+    as->label_capacity = 0;
+    as->slot_mask = 0;
 }
 
-// Find label by name
-int find_label(Assembler *as, const char *name) {
-    for (int i = 0; i < as->label_count; i++) {
-        if (strcmp(as->labels[i].name, name) == 0) {
-            return i;
+// FNV-1a
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+// Copy name into the chunks; NULL when out of memory
+static const char *intern_name(Assembler *as, const char *name) {
+    size_t length = strlen(name) + 1;
+    NameChunk *chunk = as->names;
+    if (!chunk || chunk->size - chunk->used < length) {
+        size_t size = length > NAME_CHUNK_SIZE ? length : NAME_CHUNK_SIZE;
+        chunk = malloc(sizeof(NameChunk) + size);
+        if (!chunk) {
+            return NULL;
         }
+        chunk->next = as->names;
+        chunk->used = 0;
+        chunk->size = size;
+        as->names = chunk;
     }
-    return -1;
+    char *copy = chunk->data + chunk->used;
+    memcpy(copy, name, length);
+    chunk->used += length;
+    return copy;
+}
+
+// Slot for name: the one holding it, or the empty slot that ends its probe
+static uint32_t label_slot(const Assembler *as, const char *name, uint32_t hash) {
+    uint32_t slot = hash & as->slot_mask;
+    for (;;) {
+        int index = as->label_slots[slot];
+        if (index < 0 || (as->labels[index].hash == hash &&
+                          strcmp(as->labels[index].name, name) == 0)) {
+            return slot;
+        }
+        slot = (slot + 1) & as->slot_mask;
+    }
+}
+
+// Rebuild the index with twice the slots (kept at most half full)
+static bool grow_label_slots(Assembler *as) {
+    uint32_t count = as->slot_mask ? (as->slot_mask + 1) * 2 : MIN_LABEL_SLOTS;
+    int *slots = malloc(count * sizeof(int));
+    if (!slots) {
+        return false;
+    }
+    memset(slots, 0xFF, count * sizeof(int));
+    free(as->label_slots);
+    as->label_slots = slots;
+    as->slot_mask = count - 1;
+    for (int i = 0; i < as->label_count; i++) {
+        as->label_slots[label_slot(as, as->labels[i].name, as->labels[i].hash)] = i;
+    }
+    return true;
 }
 
-// Add label
-void add_label(Assembler *as, const char *name, uint16_t address) {
-    if (as->label_count >= MAX_LABELS) {
-        fprintf(stderr, "Error: Too many labels\n");
-        return;
+// Find label by name
+int find_label(const Assembler *as, const char *name) {
+    if (as->label_count == 0) {
+        return -1;
+    }
+    return as->label_slots[label_slot(as, name, hash_name(name))];
+}
+
+// Add label; false if it is already defined or memory runs out
+bool add_label(Assembler *as, const char *name, uint16_t address) {
+    if ((uint32_t)(as->label_count + 1) * 2 > as->slot_mask + 1 && !grow_label_slots(as)) {
+        fprintf(stderr, "Error: Out of memory for labels\n");
+        return false;
+    }
+    uint32_t hash = hash_name(name);
+    uint32_t slot = label_slot(as, name, hash);
+    if (as->label_slots[slot] >= 0) {
+        fprintf(stderr, "Error line %d: Duplicate label '%s'\n", as->line_number, name);
+        return false;
+    }
+    if (as->label_count == as->label_capacity) {
+        int capacity = as->label_capacity ? as->label_capacity * 2 : MIN_LABEL_SLOTS / 2;
+        Label *grown = realloc(as->labels, capacity * sizeof(Label));
+        if (!grown) {
+            fprintf(stderr, "Error: Out of memory for labels\n");
+            return false;
+        }
+        as->labels = grown;
+        as->label_capacity = capacity;
+    }
+    Label *label = &as->labels[as->label_count];
+    label->name = intern_name(as, name);
+    if (!label->name) {
+        fprintf(stderr, "Error: Out of memory for labels\n");
+        return false;
     }
-    strncpy(as->labels[as->label_count].name, name, MAX_TOKEN_LENGTH - 1);
-    as->labels[as->label_count].address = address;
-    as->label_count++;
+    label->hash = hash;
+    label->address = address;
+    as->label_slots[slot] = as->label_count++;
+    return true;
 }
 
-// Emit byte to output
+// Emit byte to output, growing it as needed. Running out of memory sets
+// output_failed and drops the byte; assembler_assemble reports it.
 void emit_byte(Assembler *as, uint8_t byte) {
+    if (as->output_size == as->output_capacity) {
+        size_t capacity = as->output_capacity ? as->output_capacity * 2 : MIN_OUTPUT_CAPACITY;
+        uint8_t *grown = as->output_failed ? NULL : realloc(as->output, capacity);
+        if (!grown) {
+            as->output_failed = true;
+            return;
+        }
+        as->output = grown;
+        as->output_capacity = capacity;
+    }
     as->output[as->output_size++] = byte;
     as->current_address++;
 }
@@ -61,9 +195,29 @@ uint8_t encode_instruction(uint8_t opcode, uint8_t mode) {
     return (opcode << 2) | (mode & 0x03);
 }
 
+// Value of a label operand. A label not defined yet reads as 0 and is
+// returned in *label for the caller to record as a fixup; in an object, or
+// with the peephole pass, every label is, since the labels move. False if
+// the reference lies past 64 KB, where label values cannot reach.
+static bool label_operand(Assembler *as, const char *name, uint16_t *value, const char **label) {
+    if (as->output_size >= MEMORY_SIZE) {
+        fprintf(stderr, "Error line %d: Reference to label '%s' past 64 KB\n",
+                as->line_number, name);
+        return false;
+    }
+    int label_idx = find_label(as, name);
+    if (label_idx >= 0 && !as->relocatable && !as->optimize) {
+        *value = as->labels[label_idx].address;
+        return true;
+    }
+    *label = name;
+    *value = label_idx >= 0 ? as->labels[label_idx].address : 0;
+    return true;
+}
+
 // Parse addressing mode and operand
-bool parse_operand(Assembler *as, char *operand, uint8_t *mode, 
-                   uint16_t *value, bool first_pass) {
+bool parse_operand(Assembler *as, char *operand, uint8_t *mode,
+                   uint16_t *value, const char **label) {
     // Remove whitespace
     while (*operand && isspace(*operand)) operand++;
     
@@ -79,20 +233,8 @@ bool parse_operand(Assembler *as, char *operand, uint8_t *mode,
         operand++;
         if (isdigit(*operand) || *operand == '-') {
             *value = strtol(operand, NULL, 0);
-        } else {
-            // Label reference
-            if (first_pass) {
-                *value = 0;
-            } else {
-                int label_idx = find_label(as, operand);
-                if (label_idx >= 0) {
-                    *value = as->labels[label_idx].address;
-                } else {
-                    fprintf(stderr, "Error line %d: Undefined label '%s'\n", 
-                            as->line_number, operand);
-                    return false;
-                }
-            }
+        } else if (!label_operand(as, operand, value, label)) {
+            return false;
         }
         return true;
     }
@@ -121,96 +263,178 @@ bool parse_operand(Assembler *as, char *operand, uint8_t *mode,
     *mode = MODE_DIRECT;
     if (isdigit(*operand) || *operand == '-') {
         *value = strtol(operand, NULL, 0);
-    } else {
-        // Label reference
-        if (first_pass) {
-            *value = 0;
-        } else {
-            int label_idx = find_label(as, operand);
-            if (label_idx >= 0) {
-                *value = as->labels[label_idx].address;
-            } else {
-                fprintf(stderr, "Error line %d: Undefined label '%s'\n", 
-                        as->line_number, operand);
-                return false;
-            }
-        }
+    } else if (!label_operand(as, operand, value, label)) {
+        return false;
     }
     return true;
 }
 
-// Get opcode from mnemonic
+// Mnemonic lookup: a perfect hash of the first two characters, the last
+// one and the length indexes a table of opcode + 1 (0 for no mnemonic). The
+// compiler places the entries, and -Woverride-init (in -Wextra) reports a
+// collision if a new mnemonic needs different multipliers.
+#define MNEMONIC_HASH(c0, c1, last, length) (((c0) * 2 + (c1) * 13 + (last) * 8 + (length)) & 63)
+#define MNEMONIC(op, c0, c1, last, length) [MNEMONIC_HASH(c0, c1, last, length)] = (op) + 1
+
+static const uint8_t mnemonic_table[64] = {
+    MNEMONIC(OP_NOP, 'N', 'O', 'P', 3),   MNEMONIC(OP_LOAD, 'L', 'O', 'D', 4),
+    MNEMONIC(OP_STORE, 'S', 'T', 'E', 5), MNEMONIC(OP_MOV, 'M', 'O', 'V', 3),
+    MNEMONIC(OP_PUSH, 'P', 'U', 'H', 4),  MNEMONIC(OP_POP, 'P', 'O', 'P', 3),
+    MNEMONIC(OP_ADD, 'A', 'D', 'D', 3),   MNEMONIC(OP_SUB, 'S', 'U', 'B', 3),
+    MNEMONIC(OP_INC, 'I', 'N', 'C', 3),   MNEMONIC(OP_DEC, 'D', 'E', 'C', 3),
+    MNEMONIC(OP_MUL, 'M', 'U', 'L', 3),   MNEMONIC(OP_DIV, 'D', 'I', 'V', 3),
+    MNEMONIC(OP_AND, 'A', 'N', 'D', 3),   MNEMONIC(OP_OR, 'O', 'R', 'R', 2),
+    MNEMONIC(OP_XOR, 'X', 'O', 'R', 3),   MNEMONIC(OP_NOT, 'N', 'O', 'T', 3),
+    MNEMONIC(OP_SHL, 'S', 'H', 'L', 3),   MNEMONIC(OP_SHR, 'S', 'H', 'R', 3),
+    MNEMONIC(OP_CMP, 'C', 'M', 'P', 3),   MNEMONIC(OP_TEST, 'T', 'E', 'T', 4),
+    MNEMONIC(OP_JMP, 'J', 'M', 'P', 3),   MNEMONIC(OP_JZ, 'J', 'Z', 'Z', 2),
+    MNEMONIC(OP_JNZ, 'J', 'N', 'Z', 3),   MNEMONIC(OP_JC, 'J', 'C', 'C', 2),
+    MNEMONIC(OP_JNC, 'J', 'N', 'C', 3),   MNEMONIC(OP_CALL, 'C', 'A', 'L', 4),
+    MNEMONIC(OP_RET, 'R', 'E', 'T', 3),   MNEMONIC(OP_HALT, 'H', 'A', 'T', 4),
+    MNEMONIC(OP_IN, 'I', 'N', 'N', 2),    MNEMONIC(OP_OUT, 'O', 'U', 'T', 3),
+    MNEMONIC(OP_IRET, 'I', 'R', 'T', 4),  MNEMONIC(OP_EI, 'E', 'I', 'I', 2),
+    MNEMONIC(OP_DI, 'D', 'I', 'I', 2),    MNEMONIC(OP_WAIT, 'W', 'A', 'T', 4),
+};
+
+// Get opcode from mnemonic (upper case); -1 if unknown
 int get_opcode(const char *mnemonic) {
-    if (strcmp(mnemonic, "NOP") == 0) return OP_NOP;
-    if (strcmp(mnemonic, "LOAD") == 0) return OP_LOAD;
-    if (strcmp(mnemonic, "STORE") == 0) return OP_STORE;
-    if (strcmp(mnemonic, "MOV") == 0) return OP_MOV;
-    if (strcmp(mnemonic, "PUSH") == 0) return OP_PUSH;
-    if (strcmp(mnemonic, "POP") == 0) return OP_POP;
-    if (strcmp(mnemonic, "ADD") == 0) return OP_ADD;
-    if (strcmp(mnemonic, "SUB") == 0) return OP_SUB;
-    if (strcmp(mnemonic, "INC") == 0) return OP_INC;
-    if (strcmp(mnemonic, "DEC") == 0) return OP_DEC;
-    if (strcmp(mnemonic, "MUL") == 0) return OP_MUL;
-    if (strcmp(mnemonic, "DIV") == 0) return OP_DIV;
-    if (strcmp(mnemonic, "AND") == 0) return OP_AND;
-    if (strcmp(mnemonic, "OR") == 0) return OP_OR;
-    if (strcmp(mnemonic, "XOR") == 0) return OP_XOR;
-    if (strcmp(mnemonic, "NOT") == 0) return OP_NOT;
-    if (strcmp(mnemonic, "SHL") == 0) return OP_SHL;
-    if (strcmp(mnemonic, "SHR") == 0) return OP_SHR;
-    if (strcmp(mnemonic, "CMP") == 0) return OP_CMP;
-    if (strcmp(mnemonic, "TEST") == 0) return OP_TEST;
-    if (strcmp(mnemonic, "JMP") == 0) return OP_JMP;
-    if (strcmp(mnemonic, "JZ") == 0) return OP_JZ;
-    if (strcmp(mnemonic, "JNZ") == 0) return OP_JNZ;
-    if (strcmp(mnemonic, "JC") == 0) return OP_JC;
-    if (strcmp(mnemonic, "JNC") == 0) return OP_JNC;
-    if (strcmp(mnemonic, "CALL") == 0) return OP_CALL;
-    if (strcmp(mnemonic, "RET") == 0) return OP_RET;
-    if (strcmp(mnemonic, "HALT") == 0) return OP_HALT;
-    if (strcmp(mnemonic, "IN") == 0) return OP_IN;
-    if (strcmp(mnemonic, "OUT") == 0) return OP_OUT;
-    return -1;
+    size_t length = strlen(mnemonic);
+    if (length < 2) {
+        return -1;
+    }
+    const unsigned char *m = (const unsigned char *)mnemonic;
+    int entry = mnemonic_table[MNEMONIC_HASH(m[0], m[1], m[length - 1], length)];
+    if (entry == 0 || strcmp(get_opcode_name(entry - 1), mnemonic) != 0) {
+        return -1;
+    }
+    return entry - 1;
 }
 
-// Parse a single line
-bool parse_line(Assembler *as, char *line, bool first_pass) {
+// Instructions the CPU decodes as a single byte when written without an operand
+static bool is_operandless(int opcode) {
+    return opcode == OP_NOP || opcode == OP_HALT || opcode == OP_RET ||
+           opcode == OP_NOT || opcode == OP_POP ||
+           (opcode >= OP_IRET && opcode <= OP_WAIT);
+}
+
+// Remember that the word at offset is the address of a label defined later
+static bool add_fixup(Assembler *as, const char *name, size_t offset) {
+    if (as->fixup_count == as->fixup_capacity) {
+        int capacity = as->fixup_capacity ? as->fixup_capacity * 2 : 64;
+        Fixup *grown = realloc(as->fixups, capacity * sizeof(Fixup));
+        if (!grown) {
+            fprintf(stderr, "Error: Out of memory for label references\n");
+            return false;
+        }
+        as->fixups = grown;
+        as->fixup_capacity = capacity;
+    }
+    Fixup *fixup = &as->fixups[as->fixup_count++];
+    fixup->name = name;
+    fixup->offset = offset;
+    fixup->line_number = as->line_number;
+    return true;
+}
+
+// Remember where an instruction starts, for the peephole pass
+static bool add_insn_offset(Assembler *as) {
+    if (as->insn_count == as->insn_capacity) {
+        int capacity = as->insn_capacity ? as->insn_capacity * 2 : 256;
+        size_t *grown = realloc(as->insn_offsets, capacity * sizeof(size_t));
+        if (!grown) {
+            fprintf(stderr, "Error: Out of memory for instructions\n");
+            return false;
+        }
+        as->insn_offsets = grown;
+        as->insn_capacity = capacity;
+    }
+    as->insn_offsets[as->insn_count++] = as->output_size;
+    return true;
+}
+
+// Patch forward references once every label is known. In an object, labels
+// that are still undefined are imports for the linker to resolve.
+static bool resolve_fixups(Assembler *as) {
+    bool ok = true;
+    for (int i = 0; i < as->fixup_count; i++) {
+        Fixup *fixup = &as->fixups[i];
+        int label_idx = find_label(as, fixup->name);
+        if (label_idx < 0 && as->relocatable) {
+            // Names must outlive the source: the object is written after it
+            fixup->name = intern_name(as, fixup->name);
+            if (!fixup->name) {
+                fprintf(stderr, "Error: Out of memory for labels\n");
+                return false;
+            }
+            continue;
+        }
+        if (label_idx < 0) {
+            fprintf(stderr, "Error line %d: Undefined label '%s'\n",
+                    fixup->line_number, fixup->name);
+            ok = false;
+            continue;
+        }
+        fixup->name = as->labels[label_idx].name;
+        uint16_t address = as->labels[label_idx].address;
+        as->output[fixup->offset] = address & 0xFF;
+        as->output[fixup->offset + 1] = address >> 8;
+    }
+    return ok;
+}
+
+// Parse a single line and emit its code. The line is tokenized in place.
+bool parse_line(Assembler *as, char *line) {
     // Remove comments
     char *comment = strchr(line, ';');
     if (comment) *comment = '\0';
     
     // Skip empty lines
-    char *ptr = line;
-    while (*ptr && isspace(*ptr)) ptr++;
-    if (*ptr == '\0') return true;
+    while (*line && isspace((unsigned char)*line)) line++;
+    if (*line == '\0') return true;
     
     // Check for label
     char *colon = strchr(line, ':');
     if (colon) {
         *colon = '\0';
-        char label[MAX_TOKEN_LENGTH];
-        sscanf(line, "%s", label);
-        
-        if (first_pass) {
-            add_label(as, label, as->current_address);
+        char *end = line;
+        while (*end && !isspace((unsigned char)*end)) end++;
+        *end = '\0';
+        if (*line == '\0') {
+            fprintf(stderr, "Error line %d: Missing label name\n", as->line_number);
+            return false;
+        }
+        if (as->output_size >= MEMORY_SIZE) {
+            fprintf(stderr, "Error line %d: Label '%s' at 0x%zX is past 64 KB\n",
+                    as->line_number, line, as->output_size);
+            return false;
+        }
+        if (!add_label(as, line, as->current_address)) {
+            return false;
         }
         
         // Move past label
         line = colon + 1;
-        while (*line && isspace(*line)) line++;
+        while (*line && isspace((unsigned char)*line)) line++;
         if (*line == '\0') return true;
     }
     
-    // Parse mnemonic
-    char mnemonic[MAX_TOKEN_LENGTH];
-    char operand_str[MAX_LINE_LENGTH];
-    operand_str[0] = '\0';
-    
-    sscanf(line, "%s %[^\n]", mnemonic, operand_str);
-    
-    // Convert to uppercase
-    for (char *p = mnemonic; *p; p++) *p = toupper(*p);
+    // Mnemonic, upper-cased in place, then the operand text
+    char *mnemonic = line;
+    char *operand_str = line;
+    while (*operand_str && !isspace((unsigned char)*operand_str)) {
+        *operand_str = toupper((unsigned char)*operand_str);
+        operand_str++;
+    }
+    if (*operand_str) {
+        *operand_str++ = '\0';
+    }
+    while (*operand_str && isspace((unsigned char)*operand_str)) operand_str++;
+
+    // Drop blanks left before a stripped comment
+    char *operand_end = operand_str + strlen(operand_str);
+    while (operand_end > operand_str && isspace((unsigned char)operand_end[-1])) {
+        *--operand_end = '\0';
+    }
     
     int opcode = get_opcode(mnemonic);
     if (opcode < 0) {
@@ -222,138 +446,591 @@ bool parse_line(Assembler *as, char *line, bool first_pass) {
     // Parse operand
     uint8_t mode = MODE_IMMEDIATE;
     uint16_t value = 0;
+    const char *label = NULL;
     
     if (operand_str[0] != '\0') {
-        if (!parse_operand(as, operand_str, &mode, &value, first_pass)) {
+        if (!parse_operand(as, operand_str, &mode, &value, &label)) {
             return false;
         }
     }
-    
-    // Emit instruction (only in second pass)
-    if (!first_pass) {
-        emit_byte(as, encode_instruction(opcode, mode));
-        
-        // Emit operand based on mode
-        if (mode == MODE_IMMEDIATE || mode == MODE_DIRECT) {
-            emit_word(as, value);
-        } else if (mode == MODE_REGISTER || mode == MODE_INDIRECT) {
-            emit_byte(as, value);
+
+    // Jump and call targets are addresses: a bare label or number encodes
+    // as an immediate target, as in JMP+IMM (memory-indirect needs [reg])
+    if (opcode >= OP_JMP && opcode <= OP_CALL && mode == MODE_DIRECT) {
+        mode = MODE_IMMEDIATE;
+    }
+
+    // MOV src dest: the destination register follows the source
+    int dest_reg = -1;
+    if (opcode == OP_MOV && mode == MODE_REGISTER) {
+        char *dest = operand_str;
+        while (*dest && isspace((unsigned char)*dest)) dest++;
+        dest++;
+        while (*dest && (isspace((unsigned char)*dest) || *dest == ',')) dest++;
+        if (*dest < 'A' || *dest > 'D' || (dest[1] != '\0' && !isspace((unsigned char)dest[1]))) {
+            fprintf(stderr, "Error line %d: MOV needs a destination register\n",
+                    as->line_number);
+            return false;
         }
-    } else {
-        // Calculate instruction size for first pass
-        as->current_address += 1; // instruction byte
-        if (mode == MODE_IMMEDIATE || mode == MODE_DIRECT) {
-            as->current_address += 2;
-        } else if (mode == MODE_REGISTER || mode == MODE_INDIRECT) {
-            as->current_address += 1;
+        dest_reg = *dest - 'A';
+    }
+    
+    // Emit instruction
+    if (as->optimize && !add_insn_offset(as)) {
+        return false;
+    }
+    if (operand_str[0] == '\0' && is_operandless(opcode)) {
+        emit_byte(as, encode_instruction(opcode, MODE_IMMEDIATE));
+        return true;
+    }
+    emit_byte(as, encode_instruction(opcode, mode));
+    
+    // Emit operand based on mode
+    if (mode == MODE_IMMEDIATE || mode == MODE_DIRECT) {
+        if (label && !add_fixup(as, label, as->output_size)) {
+            return false;
         }
+        emit_word(as, value);
+    } else if (mode == MODE_REGISTER || mode == MODE_INDIRECT) {
+        emit_byte(as, value);
+    }
+    if (dest_reg >= 0) {
+        emit_byte(as, dest_reg);
     }
     
     return true;
 }
 
-// First pass: collect labels
-bool assembler_first_pass(Assembler *as, const char *source) {
-    as->current_address = 0;
-    as->line_number = 0;
-    
-    char *source_copy = strdup(source);
-    char *line = strtok(source_copy, "\n");
-    
-    while (line) {
-        as->line_number++;
-        if (!parse_line(as, line, true)) {
-            free(source_copy);
+// Peephole optimizer. It runs on the assembled code once every label is
+// known: the recorded instruction starts split the code, labels mark where
+// control can enter from elsewhere, and every label operand is a fixup, so
+// after instructions are removed or rewritten the labels move and the
+// fixups are patched again. Numeric jump and call targets at an
+// instruction start are treated the same way. Rewrites keep B, C, D and the Z and N flags
+// exact; A and the carry and overflow flags may differ only where every
+// path writes them again before reading them.
+
+#define USE_A 1
+#define USE_CARRY 2  // C and O, which only ADD, SUB and CMP write
+
+typedef struct {
+    size_t offset;       // In the code before optimizing
+    uint16_t operand;
+    uint8_t opcode;
+    uint8_t mode;
+    uint8_t dest;        // MOV destination register
+    uint8_t length;
+    bool entry;          // A label points here
+    bool relocated;      // The operand is a label reference
+    bool rewritten;      // Now a register-mode instruction of 2 bytes
+    bool removed;
+    int target;          // Index of the branch target; -1 if not known
+} PeepInsn;
+
+// Instruction starting at offset; -1 if none does
+static int insn_at(const PeepInsn *insns, int count, size_t offset) {
+    int low = 0;
+    int high = count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (insns[mid].offset == offset) {
+            return mid;
+        }
+        if (insns[mid].offset < offset) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return -1;
+}
+
+static int next_insn(const PeepInsn *insns, int count, int index) {
+    do {
+        index++;
+    } while (index < count && insns[index].removed);
+    return index;
+}
+
+// Which of A and the carry flags an instruction reads and which it overwrites
+static void peephole_effects(const PeepInsn *insn, int *reads, int *writes) {
+    bool register_a = (insn->mode == MODE_REGISTER || insn->mode == MODE_INDIRECT) &&
+                      insn->operand == 0;
+    *reads = USE_A;
+    *writes = 0;
+    switch (insn->opcode) {
+        case OP_NOP: case OP_EI: case OP_DI: case OP_WAIT:
+        case OP_JMP: case OP_JZ: case OP_JNZ: case OP_CALL:
+        case OP_RET: case OP_IRET:
+            *reads = register_a ? USE_A : 0;
+            break;
+        case OP_JC: case OP_JNC:
+            *reads = USE_CARRY | (register_a ? USE_A : 0);
+            break;
+        case OP_LOAD: case OP_IN:
+            *reads = register_a ? USE_A : 0;
+            *writes = USE_A;
+            break;
+        case OP_POP:
+            *reads = 0;
+            *writes = USE_A;
+            break;
+        case OP_MOV:
+            *reads = insn->mode == MODE_REGISTER && insn->operand == 0 ? USE_A : 0;
+            *writes = insn->mode == MODE_REGISTER && insn->dest == 0 ? USE_A : 0;
+            break;
+        case OP_PUSH:
+            *reads = register_a ? USE_A : 0;
+            break;
+        case OP_INC: case OP_DEC:
+            *reads = insn->mode != MODE_REGISTER || insn->operand == 0 ? USE_A : 0;
+            break;
+        case OP_ADD: case OP_SUB: case OP_CMP:
+            *writes = USE_CARRY;
+            break;
+        case OP_HALT:
+            *reads = USE_A | USE_CARRY;  // The final registers and FLAGS are the result
+            break;
+        default:
+            break;  // Reads A: the other ALU ops, STORE, OUT
+    }
+}
+
+// Whether anything in what may be read, following control flow from index
+static bool is_live(const PeepInsn *insns, int count, int index, int what, int branches) {
+    for (int steps = 0; index < count && steps < PEEPHOLE_SCAN; steps++) {
+        const PeepInsn *insn = &insns[index];
+        if (insn->removed) {
+            index++;
+            continue;
+        }
+        int reads, writes;
+        peephole_effects(insn, &reads, &writes);
+        if (reads & what) {
+            return true;
+        }
+        what &= ~writes;
+        if (what == 0 || insn->opcode == OP_HALT) {
             return false;
         }
-        line = strtok(NULL, "\n");
+        if (insn->opcode == OP_JMP) {
+            if (insn->target < 0) {
+                return true;
+            }
+            index = insn->target;
+            continue;
+        }
+        if (insn->opcode >= OP_JZ && insn->opcode <= OP_JNC &&
+            (insn->target < 0 || branches == 0 ||
+             is_live(insns, count, insn->target, what, branches - 1))) {
+            return true;
+        }
+        if (insn->opcode >= OP_CALL) {
+            return true;  // Calls, returns and unknown code
+        }
+        index++;
     }
-    
-    free(source_copy);
     return true;
 }
 
-// Second pass: generate code
-bool assembler_second_pass(Assembler *as, const char *source) {
+// Whether an instruction leaves Z and N as CMP #0 would set them
+static bool sets_zn_from_a(const PeepInsn *insn) {
+    switch (insn->opcode) {
+        case OP_LOAD: case OP_POP: case OP_IN: case OP_ADD: case OP_SUB:
+        case OP_MUL: case OP_AND: case OP_OR: case OP_XOR: case OP_NOT:
+        case OP_SHL: case OP_SHR:
+            return true;
+        case OP_INC: case OP_DEC:
+            return insn->mode != MODE_REGISTER || insn->operand == 0;
+        case OP_MOV:
+            return insn->mode == MODE_REGISTER && (insn->operand == 0 || insn->dest == 0);
+        default:
+            return false;  // DIV by zero leaves the flags alone
+    }
+}
+
+static void rewrite_insn(PeepInsn *insn, uint8_t opcode, uint8_t reg) {
+    insn->opcode = opcode;
+    insn->mode = MODE_REGISTER;
+    insn->operand = reg;
+    insn->length = 2;
+    insn->relocated = false;
+    insn->rewritten = true;
+}
+
+// One pass over the instructions; false when nothing changed
+static bool peephole_pass(PeepInsn *insns, int count, PeepholeStats *stats) {
+    bool changed = false;
+    int previous = -1;
+    for (int i = next_insn(insns, count, -1); i < count; previous = i, i = next_insn(insns, count, i)) {
+        PeepInsn *insn = &insns[i];
+        int j = next_insn(insns, count, i);
+        int k = j < count ? next_insn(insns, count, j) : count;
+
+        // LOAD r / ADD|SUB #1 / MOV A r -> INC|DEC r, then LOAD r if A is read
+        if (insn->opcode == OP_LOAD && insn->mode == MODE_REGISTER && insn->operand != 0 &&
+            k < count && !insns[j].entry && !insns[k].entry &&
+            (insns[j].opcode == OP_ADD || insns[j].opcode == OP_SUB) &&
+            insns[j].mode == MODE_IMMEDIATE && insns[j].operand == 1 && !insns[j].relocated &&
+            insns[k].opcode == OP_MOV && insns[k].mode == MODE_REGISTER &&
+            insns[k].operand == 0 && insns[k].dest == insn->operand &&
+            !is_live(insns, count, k + 1, USE_CARRY, PEEPHOLE_BRANCHES)) {
+            uint8_t reg = insn->operand;
+            rewrite_insn(insn, insns[j].opcode == OP_ADD ? OP_INC : OP_DEC, reg);
+            insns[j].removed = true;
+            if (is_live(insns, count, k + 1, USE_A, PEEPHOLE_BRANCHES)) {
+                rewrite_insn(&insns[k], OP_LOAD, reg);
+                stats->instructions_saved++;
+            } else {
+                insns[k].removed = true;
+                stats->instructions_saved += 2;
+            }
+            if (insns[j].opcode == OP_ADD) {
+                stats->increments++;
+            } else {
+                stats->decrements++;
+            }
+            changed = true;
+            continue;
+        }
+
+        // MOV A r / LOAD r, or MOV r A / LOAD r: A and Z/N already hold r
+        if (insn->opcode == OP_MOV && insn->mode == MODE_REGISTER &&
+            (insn->operand == 0) != (insn->dest == 0) && j < count && !insns[j].entry &&
+            insns[j].opcode == OP_LOAD && insns[j].mode == MODE_REGISTER &&
+            insns[j].operand == (insn->operand == 0 ? insn->dest : insn->operand)) {
+            insns[j].removed = true;
+            stats->redundant_loads++;
+            stats->instructions_saved++;
+            changed = true;
+            continue;
+        }
+
+        // CMP #0 after Z and N were set from A: only C and O can differ
+        if (insn->opcode == OP_CMP && insn->mode == MODE_IMMEDIATE && insn->operand == 0 &&
+            !insn->relocated && !insn->entry && previous >= 0 &&
+            sets_zn_from_a(&insns[previous]) &&
+            !is_live(insns, count, i + 1, USE_CARRY, PEEPHOLE_BRANCHES)) {
+            insn->removed = true;
+            stats->redundant_compares++;
+            stats->instructions_saved++;
+            changed = true;
+            i = previous;  // Keep previous: the removed CMP is not an instruction any more
+        }
+    }
+    return changed;
+}
+
+// Run the peephole optimizer over the assembled code. Banked images over
+// 64 KB are left alone, since their addresses no longer match offsets.
+static bool optimize_code(Assembler *as) {
+    int count = as->insn_count;
+    if (count == 0 || as->output_size > MEMORY_SIZE) {
+        return true;
+    }
+    PeepInsn *insns = calloc(count, sizeof(PeepInsn));
+    size_t *new_offsets = malloc((count + 1) * sizeof(size_t));
+    uint8_t *code = malloc(as->output_size);
+    if (!insns || !new_offsets || !code) {
+        fprintf(stderr, "Error: Out of memory for the peephole pass\n");
+        free(insns);
+        free(new_offsets);
+        free(code);
+        return false;
+    }
+
+    // Decode the instructions back from the code
+    for (int i = 0, f = 0; i < count; i++) {
+        PeepInsn *insn = &insns[i];
+        const uint8_t *bytes = as->output + as->insn_offsets[i];
+        insn->offset = as->insn_offsets[i];
+        insn->length = (i + 1 < count ? as->insn_offsets[i + 1] : as->output_size) - insn->offset;
+        insn->opcode = bytes[0] >> 2;
+        insn->mode = bytes[0] & 3;
+        insn->target = -1;
+        if (insn->length >= 3 && (insn->mode == MODE_IMMEDIATE || insn->mode == MODE_DIRECT)) {
+            insn->operand = bytes[1] | (bytes[2] << 8);
+        } else if (insn->length >= 2) {
+            insn->operand = bytes[1];
+            insn->dest = insn->length >= 3 ? bytes[2] : 0;
+        }
+        for (; f < as->fixup_count && as->fixups[f].offset < insn->offset + insn->length; f++) {
+            insn->relocated = true;
+        }
+    }
+    for (int i = 0; i < as->label_count; i++) {
+        int index = insn_at(insns, count, as->labels[i].address);
+        if (index >= 0) {
+            insns[index].entry = true;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        PeepInsn *insn = &insns[i];
+        bool imported = as->relocatable && insn->relocated && insn->operand == 0;
+        if (insn->opcode >= OP_JMP && insn->opcode <= OP_CALL && insn->mode == MODE_IMMEDIATE &&
+            insn->length == 3 && !imported) {
+            insn->target = insn_at(insns, count, insn->operand);
+            // A numeric target enters the code like a label and moves with it
+            if (!insn->relocated && insn->target >= 0) {
+                insns[insn->target].entry = true;
+            }
+        }
+    }
+
+    while (peephole_pass(insns, count, &as->peephole)) {
+    }
+
+    // Lay the code out again, then move the labels and repatch the fixups
+    size_t size = 0;
+    for (int i = 0; i < count; i++) {
+        const PeepInsn *insn = &insns[i];
+        new_offsets[i] = size;
+        if (insn->removed) {
+            continue;
+        }
+        if (insn->rewritten) {
+            code[size] = encode_instruction(insn->opcode, insn->mode);
+            code[size + 1] = insn->operand;
+        } else {
+            memcpy(code + size, as->output + insn->offset, insn->length);
+        }
+        size += insn->length;
+    }
+    new_offsets[count] = size;
+    for (int i = 0; i < count; i++) {
+        const PeepInsn *insn = &insns[i];
+        if (!insn->removed && !insn->relocated && insn->target >= 0) {
+            code[new_offsets[i] + 1] = new_offsets[insn->target] & 0xFF;
+            code[new_offsets[i] + 2] = new_offsets[insn->target] >> 8;
+        }
+    }
+    for (int i = 0; i < as->label_count; i++) {
+        Label *label = &as->labels[i];
+        int index = label->address == as->output_size ? count
+                                                       : insn_at(insns, count, label->address);
+        if (index >= 0) {
+            label->address = new_offsets[index];
+        }
+    }
+    for (int i = 0, f = 0; i < count; i++) {
+        for (; f < as->fixup_count && as->fixups[f].offset < insns[i].offset + insns[i].length; f++) {
+            Fixup *fixup = &as->fixups[f];
+            fixup->offset = new_offsets[i] + (fixup->offset - insns[i].offset);
+            int label_idx = find_label(as, fixup->name);
+            if (label_idx >= 0) {
+                code[fixup->offset] = as->labels[label_idx].address & 0xFF;
+                code[fixup->offset + 1] = as->labels[label_idx].address >> 8;
+            }
+        }
+    }
+
+    as->peephole.bytes_saved += as->output_size - size;
+    free(as->output);
+    as->output = code;
+    as->output_size = size;
+    as->output_capacity = as->output_size;
+    as->current_address = size;
+    free(insns);
+    free(new_offsets);
+    return true;
+}
+
+// Assemble length bytes of source in a single pass. Lines are tokenized in
+// place, so the buffer must be writable and is modified (it need not be
+// NUL-terminated); references to labels defined further down are emitted
+// as 0 and patched from the fixup list at the end.
+bool assembler_assemble(Assembler *as, char *source, size_t length) {
     as->current_address = 0;
     as->output_size = 0;
+    as->output_failed = false;
     as->line_number = 0;
-    
-    char *source_copy = strdup(source);
-    char *line = strtok(source_copy, "\n");
-    
-    while (line) {
+    as->fixup_count = 0;
+    as->insn_count = 0;
+    memset(&as->peephole, 0, sizeof(as->peephole));
+
+    char *end = source + length;
+    char *last = NULL;  // Copy of a final line without a newline to overwrite
+    bool ok = true;
+    for (char *line = source; ok && line < end; ) {
+        char *next = memchr(line, '\n', end - line);
+        if (next) {
+            *next++ = '\0';
+        } else {
+            last = malloc(end - line + 1);
+            if (!last) {
+                fprintf(stderr, "Error: Out of memory for source line\n");
+                return false;
+            }
+            memcpy(last, line, end - line);
+            last[end - line] = '\0';
+            line = last;
+            next = end;
+        }
         as->line_number++;
-        if (!parse_line(as, line, false)) {
-            free(source_copy);
-            return false;
+        ok = parse_line(as, line);
+        line = next;
+    }
+    if (ok && as->output_failed) {
+        fprintf(stderr, "Error: Out of memory for output (%zu bytes)\n", as->output_size);
+        ok = false;
+    }
+    ok = ok && resolve_fixups(as);
+    ok = ok && (!as->optimize || optimize_code(as));
+    free(last);  // Fixups may name labels on the last line
+    return ok;
+}
+
+// Map a source file privately: tokenizing writes into copy-on-write pages
+// and never reaches the file. Empty files map to NULL with length 0.
+static char *map_source(const char *path, size_t *length) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open input file '%s'\n", path);
+        return MAP_FAILED;
+    }
+    struct stat st;
+    char *source = MAP_FAILED;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: '%s' is not a regular file\n", path);
+    } else if (st.st_size == 0) {
+        source = NULL;
+    } else {
+        source = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (source == MAP_FAILED) {
+            fprintf(stderr, "Error: Cannot map input file '%s'\n", path);
+        } else {
+            posix_madvise(source, st.st_size, POSIX_MADV_SEQUENTIAL);
         }
-        line = strtok(NULL, "\n");
     }
-    
-    free(source_copy);
+    close(fd);
+    *length = source == MAP_FAILED ? 0 : (size_t)st.st_size;
+    return source;
+}
+
+// Label order for the symbol map: by address, then as defined
+static int compare_labels(const void *a, const void *b) {
+    const Label *x = *(const Label *const *)a;
+    const Label *y = *(const Label *const *)b;
+    if (x->address != y->address) {
+        return x->address < y->address ? -1 : 1;
+    }
+    return (x > y) - (x < y);
+}
+
+// Write the label table as a symbol map, one "<address> <label>" line each
+bool write_symbol_map(const Assembler *as, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot create symbol map '%s'\n", path);
+        return false;
+    }
+    const Label **sorted = malloc((as->label_count + 1) * sizeof(sorted[0]));
+    if (!sorted) {
+        fprintf(stderr, "Error: Out of memory for symbol map\n");
+        fclose(out);
+        return false;
+    }
+    for (int i = 0; i < as->label_count; i++) {
+        sorted[i] = &as->labels[i];
+    }
+    qsort(sorted, as->label_count, sizeof(sorted[0]), compare_labels);
+    for (int i = 0; i < as->label_count; i++) {
+        fprintf(out, "%04X %s\n", sorted[i]->address, sorted[i]->name);
+    }
+    free(sorted);
+    fclose(out);
     return true;
 }
 
-// Assemble file
-bool assemble_file(const char *input_file, const char *output_file) {
-    FILE *f = fopen(input_file, "r");
-    if (!f) {
-        fprintf(stderr, "Error: Cannot open input file '%s'\n", input_file);
+// Suffix for a count in a report line
+static const char *plural(size_t count) {
+    return count == 1 ? "" : "s";
+}
+
+// Assemble file into a program image, or a relocatable object for `link`,
+// optionally through the peephole optimizer
+bool assemble_file(const char *input_file, const char *output_file, bool object, bool optimize) {
+    size_t size;
+    char *source = map_source(input_file, &size);
+    if (source == MAP_FAILED) {
         return false;
     }
     
-    // Read source file
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    char *source = malloc(size + 1);
-    fread(source, 1, size, f);
-    source[size] = '\0';
-    fclose(f);
-    
     // Initialize assembler
     Assembler as;
     assembler_init(&as);
+    as.relocatable = object;
+    as.optimize = optimize;
     
     printf("Assembling '%s'...\n", input_file);
     
-    // First pass
-    if (!assembler_first_pass(&as, source)) {
-        fprintf(stderr, "Assembly failed during first pass\n");
-        free(source);
+    bool ok = assembler_assemble(&as, source, size);
+    if (size > 0) {
+        munmap(source, size);
+    }
+    if (!ok) {
         assembler_free(&as);
         return false;
     }
     
-    printf("First pass complete. Found %d labels.\n", as.label_count);
-    
-    // Second pass
-    if (!assembler_second_pass(&as, source)) {
-        fprintf(stderr, "Assembly failed during second pass\n");
-        free(source);
+    if (object || optimize) {
+        printf("Found %d labels, %d label references. Generated %zu bytes.\n",
+               as.label_count, as.fixup_count, as.output_size);
+    } else {
+        printf("Found %d labels, resolved %d forward references. Generated %zu bytes.\n",
+               as.label_count, as.fixup_count, as.output_size);
+    }
+    if (optimize && as.output_size > MEMORY_SIZE) {
+        printf("Note: images over 64 KB are not optimized\n");
+    } else if (optimize) {
+        const PeepholeStats *stats = &as.peephole;
+        printf("Peephole: %d redundant load%s, %d redundant compare%s, %d increment%s, "
+               "%d decrement%s; saved %d instruction%s, %zu byte%s\n",
+               stats->redundant_loads, plural(stats->redundant_loads),
+               stats->redundant_compares, plural(stats->redundant_compares),
+               stats->increments, plural(stats->increments),
+               stats->decrements, plural(stats->decrements),
+               stats->instructions_saved, plural(stats->instructions_saved),
+               stats->bytes_saved, plural(stats->bytes_saved));
+    }
+
+    if (object) {
+        bool written = write_object(&as, output_file);
+        if (written) {
+            printf("Object written to '%s'\n", output_file);
+        }
         assembler_free(&as);
-        return false;
+        return written;
+    }
+
+    if (as.output_size > MEMORY_SIZE) {
+        printf("Note: the image spans %zu banks of 64 KB; labels are only allowed in the first\n",
+               (as.output_size + MEMORY_SIZE - 1) / MEMORY_SIZE);
     }
-    
-    printf("Second pass complete. Generated %d bytes.\n", as.output_size);
     
     // Write output file
     FILE *out = fopen(output_file, "wb");
     if (!out) {
         fprintf(stderr, "Error: Cannot create output file '%s'\n", output_file);
-        free(source);
         assembler_free(&as);
         return false;
     }
     
-    fwrite(as.output, 1, as.output_size, out);
-    fclose(out);
+    bool written = fwrite(as.output, 1, as.output_size, out) == as.output_size;
+    if (fclose(out) != 0 || !written) {
+        fprintf(stderr, "Error: Cannot write output file '%s'\n", output_file);
+        assembler_free(&as);
+        return false;
+    }
     
     printf("Output written to '%s'\n", output_file);
+
+    char symbol_path[1024];
+    symbol_map_path(output_file, symbol_path, sizeof(symbol_path));
+    if (strcmp(symbol_path, output_file) != 0 && write_symbol_map(&as, symbol_path)) {
+        printf("Symbols written to '%s'\n", symbol_path);
+    }
     
-    free(source);
     assembler_free(&as);
     return true;
 }
@@ -3,38 +3,74 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
-#define MAX_LABELS 256
 #define MAX_LINE_LENGTH 256
 #define MAX_TOKEN_LENGTH 64
 
-// Label structure
+// Label structure; the name is interned in the assembler's name chunks
 typedef struct {
-    char name[MAX_TOKEN_LENGTH];
+    const char *name;
+    uint32_t hash;
     uint16_t address;
 } Label;
 
+typedef struct NameChunk NameChunk;
+
+// Operand word waiting for a label defined further down (or, when
+// assembling an object, any label operand: each becomes a relocation)
+typedef struct {
+    const char *name;         // Into the source, then the label's interned name
+    size_t offset;            // Output offset of the word to patch
+    int line_number;
+} Fixup;
+
+// What the peephole pass removed or rewrote
+typedef struct {
+    int redundant_loads;      // LOAD r right after MOV A r or MOV r A
+    int redundant_compares;   // CMP #0 after an instruction that set Z and N from A
+    int increments;           // LOAD r / ADD #1 / MOV A r folded into INC r
+    int decrements;           // LOAD r / SUB #1 / MOV A r folded into DEC r
+    int instructions_saved;
+    size_t bytes_saved;
+} PeepholeStats;
+
 // Assembler state
 typedef struct {
-    Label labels[MAX_LABELS];
+    Label *labels;            // In definition order
     int label_count;
-    uint8_t *output;
-    uint16_t output_size;
+    int label_capacity;
+    int *label_slots;         // Open-addressing index into labels; -1 when empty
+    uint32_t slot_mask;       // Slot count - 1 (a power of two), 0 before the first label
+    NameChunk *names;         // Interned label names
+    Fixup *fixups;
+    int fixup_count;
+    int fixup_capacity;
+    uint8_t *output;          // Grows as code is emitted
+    size_t output_size;       // May pass 64 KB for banked images; labels stay below it
+    size_t output_capacity;
+    bool output_failed;       // Growing the output ran out of memory
     uint16_t current_address;
     int line_number;
+    bool relocatable;         // Object output: undefined labels are imports
+    bool optimize;            // Run the peephole pass on the assembled code
+    size_t *insn_offsets;     // Start of each instruction, recorded when optimizing
+    int insn_count;
+    int insn_capacity;
+    PeepholeStats peephole;
 } Assembler;
 
 // Function declarations
-bool assemble_file(const char *input_file, const char *output_file);
+bool assemble_file(const char *input_file, const char *output_file, bool object, bool optimize);
 void assembler_init(Assembler *as);
 void assembler_free(Assembler *as);
-bool assembler_first_pass(Assembler *as, const char *source);
-bool assembler_second_pass(Assembler *as, const char *source);
-int find_label(Assembler *as, const char *name);
-void add_label(Assembler *as, const char *name, uint16_t address);
+bool assembler_assemble(Assembler *as, char *source, size_t length);
+int find_label(const Assembler *as, const char *name);
+bool add_label(Assembler *as, const char *name, uint16_t address);
 void emit_byte(Assembler *as, uint8_t byte);
 void emit_word(Assembler *as, uint16_t word);
 uint8_t encode_instruction(uint8_t opcode, uint8_t mode);
-bool parse_line(Assembler *as, char *line, bool first_pass);
+bool parse_line(Assembler *as, char *line);
+bool write_symbol_map(const Assembler *as, const char *path);
 
 #endif // ASSEMBLER_H
@@ -0,0 +1,272 @@
+#define _POSIX_C_SOURCE 200809L
+#include "batch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Batch runner: many independent programs, one CPU per run, on a pool of
+// worker threads.
+//
+// Jobs are split into one contiguous range per worker. A worker takes jobs
+// from its own range and, once that is empty, steals single jobs from the
+// other ranges, so uneven run times still keep every core busy. Each run
+// gets a private console device, so nothing is shared between threads
+// except the range counters.
+
+// Set batch defaults: interpreter, no fusion, one thread per core
+void batch_options_init(BatchOptions *options) {
+    options->engine = CPU_ENGINE_INTERP;
+    options->fusion = false;
+    options->max_cycles = BATCH_DEFAULT_MAX_CYCLES;
+    options->threads = 0;
+    options->clock_hz = 0;
+}
+
+static char *copy_string(const char *s) {
+    char *copy = malloc(strlen(s) + 1);
+    if (copy) {
+        strcpy(copy, s);
+    }
+    return copy;
+}
+
+// Manifest: one job per line, "<program.bin> [input-file]"; '#' starts a comment
+bool batch_load_manifest(const char *path, BatchJob **jobs, int *count) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open manifest '%s'\n", path);
+        return false;
+    }
+
+    int capacity = 64;
+    *jobs = malloc(capacity * sizeof(BatchJob));
+    *count = 0;
+    char line[1024];
+    while (*jobs && fgets(line, sizeof(line), f)) {
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *program = strtok(line, " \t\r\n");
+        if (!program) {
+            continue;
+        }
+        char *input = strtok(NULL, " \t\r\n");
+
+        if (*count == capacity) {
+            capacity *= 2;
+            BatchJob *grown = realloc(*jobs, capacity * sizeof(BatchJob));
+            if (!grown) {
+                break;
+            }
+            *jobs = grown;
+        }
+        BatchJob *job = &(*jobs)[(*count)++];
+        job->program_path = copy_string(program);
+        job->input_path = input ? copy_string(input) : NULL;
+    }
+    fclose(f);
+    return *jobs != NULL;
+}
+
+void batch_free_jobs(BatchJob *jobs, int count) {
+    for (int i = 0; i < count; i++) {
+        free(jobs[i].program_path);
+        free(jobs[i].input_path);
+    }
+    free(jobs);
+}
+
+static void run_job(CPU *cpu, const BatchJob *job, const BatchOptions *options,
+                    BatchResult *result) {
+    memset(result, 0, sizeof(BatchResult));
+
+    size_t size = 0;
+    const char *error;
+    uint8_t *program = cpu_read_program(job->program_path, &size, &error);
+    if (!program) {
+        snprintf(result->error, sizeof(result->error), "'%s' %s", job->program_path, error);
+        return;
+    }
+    InputTape tape;
+    input_tape_init(&tape, NULL, 0, true);
+    if (job->input_path && !input_tape_open_file(&tape, job->input_path)) {
+        snprintf(result->error, sizeof(result->error), "cannot open '%s'", job->input_path);
+        free(program);
+        return;
+    }
+
+    ConsoleOutput output;
+    console_output_init(&output, CONSOLE_CAPTURE, true);
+    cpu_init(cpu);
+    cpu->quiet = true;
+    cpu_set_engine(cpu, options->engine);
+    cpu_set_fusion(cpu, options->fusion);
+    if (options->clock_hz > 0) {
+        cpu_set_timer(cpu, TIMER_VIRTUAL, options->clock_hz);
+    }
+    cpu_map_input_tape(cpu, &tape);
+    cpu_map_console_output(cpu, &output);
+    cpu_load_program(cpu, program, size, 0);
+
+    result->exit_reason = cpu_run_for(cpu, options->max_cycles);
+    cpu_sync_flags(cpu);
+    result->regs = cpu->regs;
+    result->cycles = cpu->cycles;
+    result->output = output.capture;
+    result->output_len = output.capture_len;
+    result->ok = true;
+
+    cpu_free(cpu);
+    free(program);
+    input_tape_free(&tape);
+}
+
+// Next unclaimed job in one worker's range
+typedef struct {
+    atomic_int next;
+    int end;
+} WorkRange;
+
+typedef struct {
+    const BatchJob *jobs;
+    BatchResult *results;
+    const BatchOptions *options;
+    WorkRange *ranges;
+    int workers;
+} BatchShared;
+
+typedef struct {
+    BatchShared *shared;
+    int id;
+    pthread_t thread;
+} BatchWorker;
+
+static void *batch_worker(void *arg) {
+    BatchWorker *worker = arg;
+    BatchShared *shared = worker->shared;
+    CPU *cpu = malloc(sizeof(CPU));
+    if (!cpu) {
+        return NULL;
+    }
+
+    // Own range first, then steal from the others in turn
+    for (int i = 0; i < shared->workers; i++) {
+        WorkRange *range = &shared->ranges[(worker->id + i) % shared->workers];
+        int job;
+        while ((job = atomic_fetch_add(&range->next, 1)) < range->end) {
+            run_job(cpu, &shared->jobs[job], shared->options, &shared->results[job]);
+        }
+    }
+    free(cpu);
+    return NULL;
+}
+
+// Run every job; results[i] belongs to jobs[i]
+bool batch_run(const BatchJob *jobs, int count, const BatchOptions *options, BatchResult *results) {
+    int workers = options->threads;
+    if (workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 0 ? (int)cores : 1;
+    }
+    if (workers > count) {
+        workers = count > 0 ? count : 1;
+    }
+
+    WorkRange *ranges = calloc(workers, sizeof(WorkRange));
+    BatchWorker *pool = calloc(workers, sizeof(BatchWorker));
+    if (!ranges || !pool) {
+        free(ranges);
+        free(pool);
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        results[i].ok = false;
+        snprintf(results[i].error, sizeof(results[i].error), "not run");
+        results[i].output = NULL;
+    }
+
+    BatchShared shared = { jobs, results, options, ranges, workers };
+    for (int w = 0; w < workers; w++) {
+        atomic_init(&ranges[w].next, (int)((long long)count * w / workers));
+        ranges[w].end = (int)((long long)count * (w + 1) / workers);
+    }
+
+    int started = 0;
+    for (int w = 0; w < workers; w++) {
+        pool[w].shared = &shared;
+        pool[w].id = w;
+        if (pthread_create(&pool[w].thread, NULL, batch_worker, &pool[w]) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        // No threads available: work through everything here
+        BatchWorker self = { &shared, 0, pthread_self() };
+        batch_worker(&self);
+    }
+    for (int w = 0; w < started; w++) {
+        pthread_join(pool[w].thread, NULL);
+    }
+
+    free(ranges);
+    free(pool);
+    return true;
+}
+
+static void json_string(FILE *out, const char *s, size_t length) {
+    fputc('"', out);
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c == '\n') {
+            fputs("\\n", out);
+        } else if (c == '\t') {
+            fputs("\\t", out);
+        } else if (c < 0x20 || c >= 0x7F) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// One JSON object per line, in job order
+void batch_write_jsonl(FILE *out, const BatchJob *jobs, const BatchResult *results, int count) {
+    for (int i = 0; i < count; i++) {
+        const BatchJob *job = &jobs[i];
+        const BatchResult *r = &results[i];
+        fprintf(out, "{\"index\":%d,\"program\":", i);
+        json_string(out, job->program_path, strlen(job->program_path));
+        if (job->input_path) {
+            fputs(",\"input\":", out);
+            json_string(out, job->input_path, strlen(job->input_path));
+        }
+        if (!r->ok) {
+            fputs(",\"error\":", out);
+            json_string(out, r->error, strlen(r->error));
+            fputs("}\n", out);
+            continue;
+        }
+        fputs(",\"exit\":", out);
+        const char *reason = cpu_exit_reason_name(r->exit_reason);
+        json_string(out, reason, strlen(reason));
+        fprintf(out, ",\"cycles\":%llu,\"pc\":%u,\"sp\":%u,\"a\":%u,\"b\":%u,\"c\":%u,\"d\":%u,\"flags\":%u,\"output\":",
+                (unsigned long long)r->cycles, r->regs.PC, r->regs.SP, r->regs.A,
+                r->regs.B, r->regs.C, r->regs.D, r->regs.FLAGS);
+        json_string(out, r->output ? r->output : "", r->output_len);
+        fputs("}\n", out);
+    }
+}
+
+void batch_free_results(BatchResult *results, int count) {
+    for (int i = 0; i < count; i++) {
+        free(results[i].output);
+        results[i].output = NULL;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+#define BATCH_DEFAULT_MAX_CYCLES 1000000000ULL
+
+// One guest run: a program image and an optional console input tape
+typedef struct {
+    char *program_path;
+    char *input_path;     // NULL: console reads see end of input
+} BatchJob;
+
+typedef struct {
+    CpuEngine engine;
+    bool fusion;
+    uint64_t max_cycles;  // Per-run cycle budget
+    int threads;          // Worker threads; 0 = one per online core
+    uint64_t clock_hz;    // Virtual timer clock; 0 = wall-clock timer
+} BatchOptions;
+
+typedef struct {
+    bool ok;              // false: the job could not be started (see error)
+    char error[128];
+    Registers regs;
+    uint64_t cycles;
+    CpuExitReason exit_reason;
+    char *output;         // Bytes the guest wrote to the console
+    size_t output_len;
+} BatchResult;
+
+// Function declarations
+void batch_options_init(BatchOptions *options);
+bool batch_load_manifest(const char *path, BatchJob **jobs, int *count);
+void batch_free_jobs(BatchJob *jobs, int count);
+bool batch_run(const BatchJob *jobs, int count, const BatchOptions *options, BatchResult *results);
+void batch_write_jsonl(FILE *out, const BatchJob *jobs, const BatchResult *results, int count);
+void batch_free_results(BatchResult *results, int count);
+
+#endif // BATCH_H
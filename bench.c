@@ -0,0 +1,433 @@
+#define _POSIX_C_SOURCE 200809L
+#include "cpu.h"
+#include "assembler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+
+// Benchmark suite for the emulator core (make bench).
+//
+// Guest programs of three kinds run on each selected engine:
+//  - opcode: 16 copies of one instruction in a DEC D / JNZ loop
+//  - mode: the same for LOAD, STORE and ADD in each addressing mode
+//  - kernel: .asm files from the command line (bench/*.asm), assembled in
+//    memory and run from reset to HALT
+// Every program is rerun from a fresh CPU until --min-time has elapsed;
+// only cpu_run_for is timed. The idle-loop skip is off and the timer is
+// virtual, so every run executes the same instructions. One JSON object
+// per result goes to stdout; progress and errors go to stderr.
+
+#define BENCH_UNROLL 16
+#define BENCH_ITERATIONS 20000         // Loop passes per microbenchmark run
+#define BENCH_MAX_CYCLES 100000000ULL  // A kernel that runs longer is broken
+#define BENCH_DATA_ADDR 0x8000         // B points here; C = 1; D = passes left
+#define MAX_BENCH_PROGRAMS 128
+
+typedef struct {
+    char name[64];        // "ADD #imm", "LOAD [B]", or the .asm file's base name
+    const char *group;    // "opcode", "mode" or "kernel"
+    uint8_t *image;
+    uint16_t size;
+} BenchProgram;
+
+typedef struct {
+    CpuEngine engines[3];
+    int engine_count;
+    double min_time;      // Seconds of guest execution per result
+    bool fusion;
+    bool lazy_flags;
+    CycleCostModel costs;
+    const char *filter;   // Only programs whose name contains this
+} BenchOptions;
+
+typedef struct {
+    uint64_t runs;
+    uint64_t instructions;
+    uint64_t cycles;      // Guest cycles under the cost model
+    double seconds;
+    uint64_t tsc;         // Time-stamp counter ticks, 0 without one
+    Registers regs;       // After the last run
+    CpuExitReason exit_reason;
+} BenchResult;
+
+// Where an operand of a microbenchmark copy points
+typedef enum {
+    TARGET_NONE,          // Operand bytes as given
+    TARGET_NEXT,          // The instruction after this copy
+    TARGET_RET,           // A RET after the loop's HALT
+} BenchTarget;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t read_tsc(void) {
+#ifdef BENCH_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20 || c >= 0x7F) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static BenchProgram *add_program(BenchProgram *programs, int *count, const char *name,
+                                 const char *group, const uint8_t *image, uint16_t size) {
+    if (*count == MAX_BENCH_PROGRAMS) {
+        fprintf(stderr, "Error: Too many benchmark programs\n");
+        return NULL;
+    }
+    BenchProgram *program = &programs[*count];
+    program->image = malloc(size);
+    if (!program->image) {
+        return NULL;
+    }
+    memcpy(program->image, image, size);
+    program->size = size;
+    snprintf(program->name, sizeof(program->name), "%s", name);
+    program->group = group;
+    (*count)++;
+    return program;
+}
+
+// Build a microbenchmark: BENCH_UNROLL copies of code (length bytes) inside
+// a loop of BENCH_ITERATIONS passes
+static bool add_microbench(BenchProgram *programs, int *count, const char *name, const char *group,
+                           const uint8_t *code, int length, BenchTarget target) {
+    uint8_t program[512];
+    int pos = 0;
+    program[pos++] = encode_instruction(OP_LOAD, MODE_IMMEDIATE);  // B = data pointer
+    program[pos++] = BENCH_DATA_ADDR & 0xFF;
+    program[pos++] = BENCH_DATA_ADDR >> 8;
+    program[pos++] = encode_instruction(OP_MOV, MODE_REGISTER);
+    program[pos++] = 0x00;
+    program[pos++] = 0x01;
+    program[pos++] = encode_instruction(OP_LOAD, MODE_IMMEDIATE);  // C = 1
+    program[pos++] = 0x01;
+    program[pos++] = 0x00;
+    program[pos++] = encode_instruction(OP_MOV, MODE_REGISTER);
+    program[pos++] = 0x00;
+    program[pos++] = 0x02;
+    program[pos++] = encode_instruction(OP_LOAD, MODE_IMMEDIATE);  // D = passes
+    program[pos++] = BENCH_ITERATIONS & 0xFF;
+    program[pos++] = BENCH_ITERATIONS >> 8;
+    program[pos++] = encode_instruction(OP_MOV, MODE_REGISTER);
+    program[pos++] = 0x00;
+    program[pos++] = 0x03;
+    uint16_t loop = pos;
+    uint16_t ret = loop + BENCH_UNROLL * length + 6;  // After DEC D, JNZ and HALT
+    for (int n = 0; n < BENCH_UNROLL; n++) {
+        memcpy(&program[pos], code, length);
+        uint16_t address = target == TARGET_NEXT ? pos + length : ret;
+        if (target != TARGET_NONE) {
+            program[pos + 1] = address & 0xFF;
+            program[pos + 2] = address >> 8;
+        }
+        pos += length;
+    }
+    program[pos++] = encode_instruction(OP_DEC, MODE_REGISTER);
+    program[pos++] = 0x03;
+    program[pos++] = encode_instruction(OP_JNZ, MODE_IMMEDIATE);
+    program[pos++] = loop & 0xFF;
+    program[pos++] = loop >> 8;
+    program[pos++] = encode_instruction(OP_HALT, MODE_IMMEDIATE);
+    program[pos++] = encode_instruction(OP_RET, MODE_IMMEDIATE);
+    return add_program(programs, count, name, group, program, pos) != NULL;
+}
+
+static bool add_microbenches(BenchProgram *programs, int *count) {
+    const uint8_t imm = MODE_IMMEDIATE;
+    const uint8_t dir = MODE_DIRECT;
+    const uint8_t reg = MODE_REGISTER;
+    const uint8_t ind = MODE_INDIRECT;
+    const struct {
+        const char *name;
+        const char *group;
+        uint8_t code[6];  // One copy: one instruction, or a pair that leaves the stack as it was
+        uint8_t length;
+        BenchTarget target;
+    } cases[] = {
+        { "NOP",         "opcode", { encode_instruction(OP_NOP, imm) }, 1, TARGET_NONE },
+        { "MOV B C",     "opcode", { encode_instruction(OP_MOV, reg), 0x01, 0x02 }, 3, TARGET_NONE },
+        { "PUSH/POP",    "opcode", { encode_instruction(OP_PUSH, imm), 0x01, 0x00,
+                                     encode_instruction(OP_POP, imm) }, 4, TARGET_NONE },
+        { "ADD #imm",    "opcode", { encode_instruction(OP_ADD, imm), 0x01, 0x00 }, 3, TARGET_NONE },
+        { "SUB #imm",    "opcode", { encode_instruction(OP_SUB, imm), 0x01, 0x00 }, 3, TARGET_NONE },
+        { "INC B",       "opcode", { encode_instruction(OP_INC, reg), 0x01 }, 2, TARGET_NONE },
+        { "DEC B",       "opcode", { encode_instruction(OP_DEC, reg), 0x01 }, 2, TARGET_NONE },
+        { "MUL #imm",    "opcode", { encode_instruction(OP_MUL, imm), 0x03, 0x00 }, 3, TARGET_NONE },
+        { "DIV #imm",    "opcode", { encode_instruction(OP_DIV, imm), 0x03, 0x00 }, 3, TARGET_NONE },
+        { "AND #imm",    "opcode", { encode_instruction(OP_AND, imm), 0xFF, 0x7F }, 3, TARGET_NONE },
+        { "OR #imm",     "opcode", { encode_instruction(OP_OR, imm), 0x01, 0x00 }, 3, TARGET_NONE },
+        { "XOR #imm",    "opcode", { encode_instruction(OP_XOR, imm), 0x55, 0x00 }, 3, TARGET_NONE },
+        { "NOT",         "opcode", { encode_instruction(OP_NOT, imm) }, 1, TARGET_NONE },
+        { "SHL #imm",    "opcode", { encode_instruction(OP_SHL, imm), 0x01, 0x00 }, 3, TARGET_NONE },
+        { "SHR #imm",    "opcode", { encode_instruction(OP_SHR, imm), 0x01, 0x00 }, 3, TARGET_NONE },
+        { "CMP #imm",    "opcode", { encode_instruction(OP_CMP, imm), 0x05, 0x00 }, 3, TARGET_NONE },
+        { "TEST #imm",   "opcode", { encode_instruction(OP_TEST, imm), 0x01, 0x00 }, 3, TARGET_NONE },
+        { "JMP #next",   "opcode", { encode_instruction(OP_JMP, imm) }, 3, TARGET_NEXT },
+        { "JZ #next",    "opcode", { encode_instruction(OP_JZ, imm) }, 3, TARGET_NEXT },
+        { "JNZ #next",   "opcode", { encode_instruction(OP_JNZ, imm) }, 3, TARGET_NEXT },
+        { "CALL/RET",    "opcode", { encode_instruction(OP_CALL, imm) }, 3, TARGET_RET },
+        { "IN #status",  "opcode", { encode_instruction(OP_IN, imm), 0x05, 0x00 }, 3, TARGET_NONE },
+        { "OUT",         "opcode", { encode_instruction(OP_OUT, imm), 0x01, 0x00 }, 3, TARGET_NONE },
+        { "LOAD #imm",   "mode",   { encode_instruction(OP_LOAD, imm), 0x00, 0x80 }, 3, TARGET_NONE },
+        { "LOAD direct", "mode",   { encode_instruction(OP_LOAD, dir), 0x00, 0x80 }, 3, TARGET_NONE },
+        { "LOAD B",      "mode",   { encode_instruction(OP_LOAD, reg), 0x01 }, 2, TARGET_NONE },
+        { "LOAD [B]",    "mode",   { encode_instruction(OP_LOAD, ind), 0x01 }, 2, TARGET_NONE },
+        { "STORE direct","mode",   { encode_instruction(OP_STORE, dir), 0x00, 0x80 }, 3, TARGET_NONE },
+        { "STORE [B]",   "mode",   { encode_instruction(OP_STORE, ind), 0x01 }, 2, TARGET_NONE },
+        { "ADD direct",  "mode",   { encode_instruction(OP_ADD, dir), 0x00, 0x80 }, 3, TARGET_NONE },
+        { "ADD [B]",     "mode",   { encode_instruction(OP_ADD, ind), 0x01 }, 2, TARGET_NONE },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!add_microbench(programs, count, cases[i].name, cases[i].group, cases[i].code,
+                            cases[i].length, cases[i].target)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Assemble a kernel in memory; its name is the file's base name
+static bool add_kernel(BenchProgram *programs, int *count, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", path);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *source = malloc(size + 1);
+    if (!source || fread(source, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "Error: Cannot read file '%s'\n", path);
+        free(source);
+        fclose(f);
+        return false;
+    }
+    source[size] = '\0';
+    fclose(f);
+
+    Assembler as;
+    assembler_init(&as);
+    bool ok = assembler_assemble(&as, source, size);
+    if (!ok || as.output_size > MEMORY_SIZE) {
+        fprintf(stderr, "Error: Cannot assemble '%s' into memory\n", path);
+        ok = false;
+    } else {
+        const char *base = strrchr(path, '/');
+        base = base ? base + 1 : path;
+        const char *dot = strrchr(base, '.');
+        char name[64];
+        snprintf(name, sizeof(name), "%.*s", dot ? (int)(dot - base) : (int)strlen(base), base);
+        ok = add_program(programs, count, name, "kernel", as.output, as.output_size) != NULL;
+    }
+    assembler_free(&as);
+    free(source);
+    return ok;
+}
+
+// Run program from reset until HALT (or the cycle limit), timing only the run
+static void run_once(CPU *cpu, const BenchProgram *program, CpuEngine engine,
+                     const BenchOptions *options, int console_fd, BenchResult *result) {
+    InputTape tape;
+    input_tape_init(&tape, NULL, 0, true);
+    ConsoleOutput output;
+    console_output_init(&output, console_fd, true);
+    cpu_init(cpu);
+    cpu->quiet = true;
+    cpu_set_engine(cpu, engine);
+    cpu_set_fusion(cpu, options->fusion);
+    cpu_set_lazy_flags(cpu, options->lazy_flags);
+    cpu_set_idle_skip(cpu, false);
+    cpu_set_cycle_costs(cpu, &options->costs);
+    cpu_set_timer(cpu, TIMER_VIRTUAL, CPU_DEFAULT_CLOCK_HZ);
+    cpu_map_console_output(cpu, &output);
+    cpu_map_input_tape(cpu, &tape);
+    cpu_load_program(cpu, program->image, program->size, 0);
+
+    double start = now_seconds();
+    uint64_t tsc_start = read_tsc();
+    result->exit_reason = cpu_run_for(cpu, BENCH_MAX_CYCLES);
+    uint64_t tsc_end = read_tsc();
+    double end = now_seconds();
+
+    cpu_sync_flags(cpu);
+    result->regs = cpu->regs;
+    result->runs++;
+    result->instructions += cpu->instructions;
+    result->cycles += cpu->cycles;
+    result->seconds += end - start;
+    result->tsc += tsc_end - tsc_start;
+    cpu_free(cpu);
+    input_tape_free(&tape);
+    console_output_free(&output);
+}
+
+static void write_result(FILE *out, const BenchProgram *program, CpuEngine engine,
+                         const BenchResult *result) {
+    double insns = (double)result->instructions;
+    fputs("{\"name\":", out);
+    json_string(out, program->name);
+    fputs(",\"group\":", out);
+    json_string(out, program->group);
+    fprintf(out, ",\"engine\":\"%s\",\"runs\":%llu,\"instructions\":%llu,\"cycles\":%llu,"
+            "\"seconds\":%.6f,\"mips\":%.2f,\"ns_per_insn\":%.3f,\"host_cycles_per_insn\":",
+            cpu_engine_name(engine), (unsigned long long)result->runs,
+            (unsigned long long)result->instructions, (unsigned long long)result->cycles,
+            result->seconds,
+            result->seconds > 0 ? insns / result->seconds / 1e6 : 0,
+            insns > 0 ? result->seconds * 1e9 / insns : 0);
+    if (result->tsc > 0 && insns > 0) {
+        fprintf(out, "%.2f", result->tsc / insns);
+    } else {
+        fputs("null", out);
+    }
+    fputs("}\n", out);
+    fflush(out);
+}
+
+// Run every program on every engine; false if a run failed or engines disagree
+static bool run_benchmarks(const BenchProgram *programs, int count, const BenchOptions *options) {
+    int console_fd = open("/dev/null", O_WRONLY);
+    if (console_fd < 0) {
+        fprintf(stderr, "Error: Cannot open /dev/null\n");
+        return false;
+    }
+    CPU *cpu = malloc(sizeof(CPU));
+    if (!cpu) {
+        close(console_fd);
+        return false;
+    }
+
+    bool ok = true;
+    for (int p = 0; p < count; p++) {
+        const BenchProgram *program = &programs[p];
+        if (options->filter && !strstr(program->name, options->filter)) {
+            continue;
+        }
+        Registers reference;
+        memset(&reference, 0, sizeof(reference));
+        for (int e = 0; e < options->engine_count; e++) {
+            CpuEngine engine = options->engines[e];
+            fprintf(stderr, "%-8s %-14s %s\n", program->group, program->name,
+                    cpu_engine_name(engine));
+            BenchResult result;
+            memset(&result, 0, sizeof(result));
+            do {
+                run_once(cpu, program, engine, options, console_fd, &result);
+            } while (result.exit_reason == CPU_EXIT_HALTED && result.seconds < options->min_time);
+
+            if (result.exit_reason != CPU_EXIT_HALTED) {
+                fprintf(stderr, "Error: %s on %s: %s\n", program->name, cpu_engine_name(engine),
+                        cpu_exit_reason_name(result.exit_reason));
+                ok = false;
+                continue;
+            }
+            // Every engine must finish with the first one's registers
+            if (e == 0) {
+                reference = result.regs;
+            } else if (memcmp(&reference, &result.regs, sizeof(Registers)) != 0) {
+                fprintf(stderr, "Error: %s on %s: registers differ from %s\n", program->name,
+                        cpu_engine_name(engine), cpu_engine_name(options->engines[0]));
+                ok = false;
+            }
+            write_result(stdout, program, engine, &result);
+        }
+    }
+    free(cpu);
+    close(console_fd);
+    return ok;
+}
+
+static void print_usage(const char *prog_name) {
+    printf("Usage: %s [--engine interp|threaded|jit]... [--min-time SECONDS] [--fuse]\n", prog_name);
+    printf("          [--lazy-flags] [--costs FILE] [--filter NAME] [kernel.asm ...]\n");
+    printf("Times per-opcode and addressing-mode microbenchmarks and the given .asm kernels\n");
+    printf("on each engine (default: all), one JSON line per result on stdout.\n");
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options;
+    memset(&options, 0, sizeof(options));
+    options.min_time = 0.2;
+    cycle_costs_default(&options.costs);
+    static BenchProgram programs[MAX_BENCH_PROGRAMS];
+    int count = 0;
+    if (!add_microbenches(programs, &count)) {
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            CpuEngine engine;
+            if (strcmp(name, "interp") == 0) {
+                engine = CPU_ENGINE_INTERP;
+            } else if (strcmp(name, "threaded") == 0) {
+                engine = CPU_ENGINE_THREADED;
+            } else if (strcmp(name, "jit") == 0) {
+                engine = CPU_ENGINE_JIT;
+            } else {
+                printf("Unknown engine: %s\n", name);
+                return 1;
+            }
+            if (options.engine_count < 3) {
+                options.engines[options.engine_count++] = engine;
+            }
+        } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            options.min_time = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--fuse") == 0) {
+            options.fusion = true;
+        } else if (strcmp(argv[i], "--lazy-flags") == 0) {
+            options.lazy_flags = true;
+        } else if (strcmp(argv[i], "--costs") == 0 && i + 1 < argc) {
+            if (!cycle_costs_load(&options.costs, argv[++i])) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (argv[i][0] == '-') {
+            print_usage(argv[0]);
+            return 1;
+        } else if (!add_kernel(programs, &count, argv[i])) {
+            return 1;
+        }
+    }
+    if (options.engine_count == 0) {
+        options.engines[0] = CPU_ENGINE_INTERP;
+        options.engines[1] = CPU_ENGINE_THREADED;
+        options.engines[2] = CPU_ENGINE_JIT;
+        options.engine_count = 3;
+    }
+
+    bool ok = run_benchmarks(programs, count, &options);
+    for (int i = 0; i < count; i++) {
+        free(programs[i].image);
+    }
+    return ok ? 0 : 1;
+}
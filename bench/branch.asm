@@ -0,0 +1,39 @@
+; Collatz step counts for every start value 1-255, 8 times over
+; Branch-heavy: a data-dependent odd / even branch every few instructions
+
+start:
+    LOAD #8
+    STORE 0x3000        ; Repeats left
+repeat:
+    LOAD #0
+    MOV A C             ; C = total steps
+    LOAD #255
+    MOV A D             ; D = start value
+next_start:
+    LOAD D
+    MOV A B             ; B = n
+collatz:
+    LOAD B
+    CMP #1
+    JZ reached_one
+    INC C
+    TEST #1
+    JNZ odd
+    SHR #1              ; Even: n / 2
+    MOV A B
+    JMP collatz
+odd:
+    MUL #3              ; Odd: 3n + 1
+    ADD #1
+    MOV A B
+    JMP collatz
+reached_one:
+    DEC D
+    JNZ next_start
+    LOAD 0x3000
+    SUB #1
+    STORE 0x3000
+    JNZ repeat
+
+    LOAD C              ; A = steps for one repeat
+    HALT
@@ -0,0 +1,49 @@
+; Fletcher-style checksum over 8 KB of pseudo-random words, 16 passes
+; Streaming loads: one indirect load and four ALU operations per word
+
+start:
+    ; Fill 0x4000-0x5FFF from a 16-bit LCG
+    LOAD #0x4000
+    MOV A B             ; B = word pointer
+    LOAD #4096
+    MOV A D             ; D = words left
+    LOAD #4321
+    MOV A C             ; C = LCG state
+fill:
+    LOAD C
+    MUL #25173
+    ADD #13849
+    MOV A C
+    STORE [B]
+    INC B
+    INC B
+    DEC D
+    JNZ fill
+
+    LOAD #16
+    STORE 0x3000        ; Passes left
+pass:
+    LOAD #0x4000
+    MOV A B
+    LOAD #0
+    MOV A C             ; C = sum of words
+    MOV A D             ; D = sum of sums
+sum_loop:
+    LOAD [B]
+    ADD C
+    MOV A C
+    ADD D
+    MOV A D
+    INC B
+    INC B
+    LOAD B
+    CMP #0x6000
+    JNZ sum_loop
+    LOAD 0x3000
+    SUB #1
+    STORE 0x3000
+    JNZ pass
+
+    LOAD D              ; A = checksum
+    XOR C
+    HALT
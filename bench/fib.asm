@@ -0,0 +1,26 @@
+; Recursive Fibonacci: fib(22) = 17711 in B
+; Call-heavy: about 57,000 CALL / RET pairs with two stack slots each
+
+start:
+    LOAD #22
+    CALL fib
+    HALT
+
+; fib(n): n in A, result in B (clobbers A)
+fib:
+    CMP #2
+    JC fib_base         ; n < 2: fib(n) = n
+    SUB #1
+    PUSH A              ; Save n - 1
+    CALL fib            ; B = fib(n - 1)
+    POP                 ; A = n - 1
+    PUSH B              ; Save fib(n - 1)
+    SUB #1
+    CALL fib            ; B = fib(n - 2)
+    POP                 ; A = fib(n - 1)
+    ADD B
+    MOV A B
+    RET
+fib_base:
+    MOV A B
+    RET
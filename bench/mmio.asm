@@ -0,0 +1,16 @@
+; Device polling: every instruction in the loop body is an I/O access
+; Console status and input, console output, timer and interrupt controller
+
+start:
+    LOAD #40000
+    MOV A D             ; D = passes left
+poll:
+    IN #5               ; Console input status
+    IN #0               ; Console input byte
+    OUT #1              ; Echo it
+    LOAD 0xFF03         ; Timer
+    LOAD 0xFF09         ; Pending interrupts (none enabled)
+    STORE 0xFF08        ; Enable nothing, clear nothing
+    DEC D
+    JNZ poll
+    HALT
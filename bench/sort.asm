@@ -0,0 +1,53 @@
+; Bubble sort of 256 pseudo-random words at 0x4000
+; Memory-heavy: indirect loads and stores with a data-dependent swap
+
+start:
+    ; Fill the array from a 16-bit LCG
+    LOAD #0x4000
+    MOV A B             ; B = element pointer
+    LOAD #256
+    MOV A D             ; D = elements left
+    LOAD #12345
+    MOV A C             ; C = LCG state
+fill:
+    LOAD C
+    MUL #25173
+    ADD #13849
+    MOV A C
+    STORE [B]
+    INC B
+    INC B
+    DEC D
+    JNZ fill
+
+    LOAD #255
+    MOV A D             ; D = pairs compared this pass
+outer:
+    LOAD #0x4000
+    MOV A B
+    LOAD D              ; End pointer: 0x4000 + 2 * D
+    SHL #1
+    ADD #0x4000
+    STORE 0x3000
+inner:
+    LOAD [B]
+    MOV A C             ; C = array[i]
+    INC B
+    INC B
+    LOAD [B]            ; A = array[i + 1]
+    CMP C
+    JNC in_order        ; array[i + 1] >= array[i]
+    DEC B               ; Swap the pair
+    DEC B
+    STORE [B]
+    INC B
+    INC B
+    LOAD C
+    STORE [B]
+in_order:
+    LOAD B
+    CMP 0x3000
+    JNZ inner
+    DEC D
+    JNZ outer
+    HALT
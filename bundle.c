@@ -0,0 +1,505 @@
+#include "bundle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Lockstep execution of one program over many register/memory states.
+//
+// Each step picks the lowest PC among the running lanes. When the
+// instruction there only touches registers, it runs once for every lane at
+// that PC as vector operations over the lane arrays, with stopped lanes and
+// lanes elsewhere masked out. Otherwise each lane at that PC runs one
+// instruction through cpu_step on its own CPU. Lowest-PC-first holds back
+// lanes that jumped ahead at a branch until the others reach them, so the
+// bundle returns to whole-bundle vectors at the join point. A lane looping
+// below the others would hold them back forever, so after BUNDLE_FAIR_STEPS
+// split steps every running lane takes one scalar step regardless of its PC.
+
+static uint16_t *lane_array16(int padded) {
+    uint16_t *array = aligned_alloc(32, padded * sizeof(uint16_t));
+    if (array) {
+        memset(array, 0, padded * sizeof(uint16_t));
+    }
+    return array;
+}
+
+bool bundle_init(CpuBundle *bundle, int lanes) {
+    memset(bundle, 0, sizeof(CpuBundle));
+    if (lanes < 1 || lanes > BUNDLE_MAX_LANES) {
+        fprintf(stderr, "Error: Bundle needs 1-%d lanes\n", BUNDLE_MAX_LANES);
+        return false;
+    }
+    bundle->lanes = lanes;
+    bundle->padded = (lanes + BUNDLE_VECTOR_LANES - 1) & ~(BUNDLE_VECTOR_LANES - 1);
+
+    bool ok = (bundle->pc = lane_array16(bundle->padded)) != NULL;
+    ok = ok && (bundle->sp = lane_array16(bundle->padded)) != NULL;
+    for (int r = 0; r < 4; r++) {
+        ok = ok && (bundle->reg[r] = lane_array16(bundle->padded)) != NULL;
+    }
+    ok = ok && (bundle->flags = lane_array16(bundle->padded)) != NULL;
+    ok = ok && (bundle->active = lane_array16(bundle->padded)) != NULL;
+    ok = ok && (bundle->cycles = calloc(bundle->padded, sizeof(uint64_t))) != NULL;
+    ok = ok && (bundle->cpus = calloc(lanes, sizeof(CPU *))) != NULL;
+    ok = ok && (bundle->cache = calloc(DECODE_CACHE_SIZE, sizeof(BundleInsn))) != NULL;
+    for (int lane = 0; ok && lane < lanes; lane++) {
+        CPU *cpu = malloc(sizeof(CPU));
+        if (!cpu) {
+            ok = false;
+            break;
+        }
+        cpu_init(cpu);
+        cpu->quiet = true;
+        bundle->cpus[lane] = cpu;
+        bundle->sp[lane] = STACK_START;
+        bundle->active[lane] = 0xFFFF;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Out of memory for %d-lane bundle\n", lanes);
+        bundle_free(bundle);
+        return false;
+    }
+    return true;
+}
+
+void bundle_free(CpuBundle *bundle) {
+    if (bundle->cpus) {
+        for (int lane = 0; lane < bundle->lanes; lane++) {
+            if (bundle->cpus[lane]) {
+                cpu_free(bundle->cpus[lane]);
+                free(bundle->cpus[lane]);
+            }
+        }
+    }
+    free(bundle->pc);
+    free(bundle->sp);
+    for (int r = 0; r < 4; r++) {
+        free(bundle->reg[r]);
+    }
+    free(bundle->flags);
+    free(bundle->active);
+    free(bundle->cycles);
+    free(bundle->cpus);
+    free(bundle->cache);
+    memset(bundle, 0, sizeof(CpuBundle));
+}
+
+// A running lane that interrupts can reach; these keep the bundle scalar
+static bool lane_irq(const CpuBundle *bundle, int lane) {
+    const CPU *cpu = bundle->cpus[lane];
+    return bundle->active[lane] && (cpu->irq.enable != 0 || cpu->waiting);
+}
+
+// Load the same image into every lane and restart all lanes at start_addr
+void bundle_load_program(CpuBundle *bundle, const uint8_t *program, size_t size, uint16_t start_addr) {
+    for (int lane = 0; lane < bundle->lanes; lane++) {
+        cpu_load_program(bundle->cpus[lane], program, size, start_addr);
+        bundle->pc[lane] = start_addr;
+        bundle->flags[lane] &= ~FLAG_HALT;
+        bundle->active[lane] = 0xFFFF;
+    }
+    bundle->split_steps = 0;
+    bundle->irq_lanes = 0;
+    for (int lane = 0; lane < bundle->lanes; lane++) {
+        bundle->irq_lanes += lane_irq(bundle, lane);
+    }
+    bundle_invalidate(bundle);
+}
+
+// Drop shared decodes; call after writing lane memory directly
+void bundle_invalidate(CpuBundle *bundle) {
+    memset(bundle->cache, 0, DECODE_CACHE_SIZE * sizeof(BundleInsn));
+}
+
+// Lane CPU for memory and device access. Its registers are only current
+// inside scalar steps; use bundle_get_regs / bundle_set_regs instead.
+CPU *bundle_lane_cpu(CpuBundle *bundle, int lane) {
+    return bundle->cpus[lane];
+}
+
+// Seed a lane; it runs unless FLAG_HALT is set
+void bundle_set_regs(CpuBundle *bundle, int lane, const Registers *regs) {
+    bundle->pc[lane] = regs->PC;
+    bundle->sp[lane] = regs->SP;
+    bundle->reg[0][lane] = regs->A;
+    bundle->reg[1][lane] = regs->B;
+    bundle->reg[2][lane] = regs->C;
+    bundle->reg[3][lane] = regs->D;
+    bundle->flags[lane] = regs->FLAGS;
+    bundle->irq_lanes -= lane_irq(bundle, lane);
+    bundle->active[lane] = (regs->FLAGS & FLAG_HALT) ? 0 : 0xFFFF;
+    bundle->irq_lanes += lane_irq(bundle, lane);
+}
+
+void bundle_get_regs(const CpuBundle *bundle, int lane, Registers *regs) {
+    regs->PC = bundle->pc[lane];
+    regs->SP = bundle->sp[lane];
+    regs->A = bundle->reg[0][lane];
+    regs->B = bundle->reg[1][lane];
+    regs->C = bundle->reg[2][lane];
+    regs->D = bundle->reg[3][lane];
+    regs->FLAGS = (uint8_t)bundle->flags[lane];
+}
+
+// One instruction for one lane, with the reference core's semantics
+static void scalar_step(CpuBundle *bundle, int lane) {
+    CPU *cpu = bundle->cpus[lane];
+    uint64_t code_writes = cpu->code_writes;
+    Registers regs;
+    bundle_get_regs(bundle, lane, &regs);
+    cpu->regs = regs;
+    cpu->cycles = bundle->cycles[lane];
+    cpu->running = true;
+
+    bool irq_before = cpu->irq.enable != 0 || cpu->waiting;
+    if (irq_before) {
+        // Interrupts and WAIT are handled between instructions as cpu_run_for would
+        cpu_service_interrupts(cpu, UINT64_MAX);
+        if (cpu->running && !cpu->waiting) {
+            cpu_step(cpu);
+        }
+    } else {
+        cpu_step(cpu);
+    }
+
+    bundle->pc[lane] = cpu->regs.PC;
+    bundle->sp[lane] = cpu->regs.SP;
+    bundle->reg[0][lane] = cpu->regs.A;
+    bundle->reg[1][lane] = cpu->regs.B;
+    bundle->reg[2][lane] = cpu->regs.C;
+    bundle->reg[3][lane] = cpu->regs.D;
+    bundle->flags[lane] = cpu->regs.FLAGS;
+    bundle->cycles[lane] = cpu->cycles;
+    if (!cpu->running) {
+        bundle->active[lane] = 0;
+    }
+    // A stopped lane is never stepped again, so it no longer counts
+    bundle->irq_lanes += lane_irq(bundle, lane) - irq_before;
+    // The lane wrote over code the bundle decoded
+    if (cpu->code_writes != code_writes) {
+        bundle_invalidate(bundle);
+    }
+}
+
+#if defined(__GNUC__)
+
+// 16-bit lanes per vector: a 256-bit AVX2 register when the compiler may use
+// one (-mavx2), otherwise a 128-bit SSE2 register
+#if defined(__AVX2__)
+#define VEC_LANES 16
+#else
+#define VEC_LANES 8
+#endif
+typedef uint16_t vec16 __attribute__((vector_size(VEC_LANES * sizeof(uint16_t))));
+
+// Lane arrays are 32-byte aligned and padded, so whole vectors never straddle the end
+static inline vec16 vload(const uint16_t *p) {
+    return *(const vec16 *)p;
+}
+
+static inline void vstore(uint16_t *p, vec16 v) {
+    *(vec16 *)p = v;
+}
+
+static inline vec16 vsplat(uint16_t x) {
+    vec16 v = { 0 };
+    return v + x;
+}
+
+// Per lane: mask ? a : b (mask lanes are all-ones or zero)
+static inline vec16 vselect(vec16 mask, vec16 a, vec16 b) {
+    return (a & mask) | (b & ~mask);
+}
+
+// Vector equivalent of update_flags
+static inline vec16 vflags_zn(vec16 flags, vec16 result) {
+    return (flags & vsplat((uint16_t)~(FLAG_ZERO | FLAG_NEGATIVE))) |
+           ((vec16)(result == 0) & vsplat(FLAG_ZERO)) |
+           ((result >> 15) * FLAG_NEGATIVE);
+}
+
+// C from carry (a lane mask), O from bit 15 of sign_bits
+static inline vec16 vflags_carry_overflow(vec16 flags, vec16 carry, vec16 sign_bits) {
+    return (flags & vsplat((uint16_t)~(FLAG_CARRY | FLAG_OVERFLOW))) |
+           (carry & vsplat(FLAG_CARRY)) |
+           ((sign_bits >> 15) * FLAG_OVERFLOW);
+}
+
+// Counts wrap at 32 and anything from 16 up clears the value, as the
+// promoted-int shifts of the scalar cores do on x86
+static inline vec16 vshift(vec16 value, vec16 count, bool left) {
+    count &= 31;
+    vec16 in_range = (vec16)(count < 16);
+    count &= 15;
+    return (left ? value << count : value >> count) & in_range;
+}
+
+// Register-only instructions the bundle runs as vector operations
+static bool vector_op(const DecodedInsn *insn) {
+    bool reg_or_imm = insn->mode == MODE_IMMEDIATE || insn->mode == MODE_REGISTER;
+    switch (insn->opcode) {
+        case OP_NOP:
+        case OP_INC:
+        case OP_DEC:
+            return true;
+        case OP_LOAD:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_AND:
+        case OP_OR:
+        case OP_XOR:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_CMP:
+            return reg_or_imm;
+        case OP_MOV:
+            return insn->mode == MODE_REGISTER;
+        case OP_JMP:
+        case OP_JZ:
+        case OP_JNZ:
+        case OP_JC:
+        case OP_JNC:
+            return insn->mode == MODE_IMMEDIATE;
+        default:
+            return false;
+    }
+}
+
+// Whether lane holds the bytes insn was decoded from (lane 0's)
+static bool lane_matches(const CpuBundle *bundle, int lane, const DecodedInsn *insn) {
+    const CPU *cpu = bundle->cpus[lane];
+    return insn->pc <= cpu->mmio_base - MAX_INSN_LENGTH &&
+           memcmp(&cpu->memory[insn->pc], &bundle->cpus[0]->memory[insn->pc], insn->length) == 0;
+}
+
+// Shared decode of the instruction at pc
+static const BundleInsn *bundle_fetch(CpuBundle *bundle, uint16_t pc) {
+    BundleInsn *entry = &bundle->cache[pc & (DECODE_CACHE_SIZE - 1)];
+    if (entry->insn.length != 0 && entry->insn.pc == pc) {
+        return entry;
+    }
+
+    CPU *first = bundle->cpus[0];
+    entry->vector = false;
+    entry->uniform = false;
+    if (pc > first->mmio_base - MAX_INSN_LENGTH) {
+        // Never decode through devices; leave the entry empty
+        entry->insn.length = 0;
+        return entry;
+    }
+    cpu_decode(first, pc, &entry->insn);
+    entry->vector = vector_op(&entry->insn);
+    entry->uniform = entry->vector;
+    for (int lane = 1; lane < bundle->lanes && entry->uniform; lane++) {
+        entry->uniform = lane_matches(bundle, lane, &entry->insn);
+    }
+
+    // A lane store to these pages bumps its code_writes, which flushes the cache
+    if (entry->vector) {
+        uint16_t last = pc + entry->insn.length - 1;
+        for (int lane = 0; lane < bundle->lanes; lane++) {
+            bundle->cpus[lane]->code_pages[pc >> 8] |= CODE_PAGE_BUNDLE;
+            bundle->cpus[lane]->code_pages[last >> 8] |= CODE_PAGE_BUNDLE;
+        }
+    }
+    return entry;
+}
+
+// Execute insn once for every running lane at its PC
+static void vector_execute(CpuBundle *bundle, const DecodedInsn *insn) {
+    for (int lane = 0; lane < bundle->lanes; lane++) {
+        bundle->cycles[lane] += (bundle->active[lane] && bundle->pc[lane] == insn->pc) * insn->cost;
+    }
+
+    uint16_t next = insn->pc + insn->length;
+    int dest_index = insn->opcode == OP_MOV ? insn->dest_reg
+                   : ((insn->opcode == OP_INC || insn->opcode == OP_DEC) &&
+                      insn->mode == MODE_REGISTER) ? insn->operand : 0;
+    uint16_t *dest = bundle->reg[dest_index];
+
+    for (int base = 0; base < bundle->padded; base += VEC_LANES) {
+        vec16 active = vload(&bundle->active[base]) &
+                       (vec16)(vload(&bundle->pc[base]) == vsplat(insn->pc));
+        vec16 flags = vload(&bundle->flags[base]);
+        vec16 a = vload(&bundle->reg[0][base]);
+        vec16 operand = insn->mode == MODE_REGISTER ? vload(&bundle->reg[insn->operand][base])
+                                                     : vsplat(insn->operand);
+        vec16 pc = vsplat(next);
+        vec16 result = a;
+        bool writes = true;
+
+        switch (insn->opcode) {
+            case OP_NOP:
+                writes = false;
+                break;
+            case OP_LOAD:
+            case OP_MOV:
+                result = operand;
+                flags = vflags_zn(flags, result);
+                break;
+            case OP_INC:
+            case OP_DEC:
+                result = insn->mode == MODE_REGISTER ? operand : a;
+                result = insn->opcode == OP_INC ? result + 1 : result - 1;
+                flags = vflags_zn(flags, result);
+                break;
+            case OP_ADD:
+                result = a + operand;
+                flags = vflags_carry_overflow(flags, (vec16)(result < a), ~(a ^ operand) & (a ^ result));
+                flags = vflags_zn(flags, result);
+                break;
+            case OP_SUB:
+            case OP_CMP:
+                result = a - operand;
+                flags = vflags_carry_overflow(flags, (vec16)(a < operand), (a ^ operand) & (a ^ result));
+                flags = vflags_zn(flags, result);
+                writes = insn->opcode == OP_SUB;
+                break;
+            case OP_AND:
+                result = a & operand;
+                flags = vflags_zn(flags, result);
+                break;
+            case OP_OR:
+                result = a | operand;
+                flags = vflags_zn(flags, result);
+                break;
+            case OP_XOR:
+                result = a ^ operand;
+                flags = vflags_zn(flags, result);
+                break;
+            case OP_SHL:
+            case OP_SHR:
+                result = vshift(a, operand, insn->opcode == OP_SHL);
+                flags = vflags_zn(flags, result);
+                break;
+            case OP_JMP:
+                pc = operand;
+                writes = false;
+                break;
+            case OP_JZ:
+            case OP_JNZ:
+            case OP_JC:
+            case OP_JNC: {
+                uint16_t bit = (insn->opcode == OP_JZ || insn->opcode == OP_JNZ) ? FLAG_ZERO : FLAG_CARRY;
+                vec16 taken = (vec16)((flags & bit) != 0);
+                if (insn->opcode == OP_JNZ || insn->opcode == OP_JNC) {
+                    taken = ~taken;
+                }
+                pc = vselect(taken, operand, pc);
+                writes = false;
+                break;
+            }
+        }
+
+        if (writes) {
+            vstore(&dest[base], vselect(active, result, vload(&dest[base])));
+        }
+        vstore(&bundle->flags[base], vselect(active, flags, vload(&bundle->flags[base])));
+        vstore(&bundle->pc[base], vselect(active, pc, vload(&bundle->pc[base])));
+    }
+}
+
+// Lowest and highest PC over running lanes; false when none is running
+static bool lane_pc_range(const CpuBundle *bundle, uint16_t *low, uint16_t *high) {
+    vec16 lo = vsplat(0xFFFF);
+    vec16 hi = vsplat(0);
+    vec16 any = vsplat(0);
+    for (int base = 0; base < bundle->padded; base += VEC_LANES) {
+        vec16 active = vload(&bundle->active[base]);
+        vec16 pc = vload(&bundle->pc[base]);
+        vec16 below = pc | ~active;  // Stopped lanes never lower the minimum
+        vec16 above = pc & active;   // ...or raise the maximum
+        lo = vselect((vec16)(below < lo), below, lo);
+        hi = vselect((vec16)(above > hi), above, hi);
+        any |= active;
+    }
+
+    bool running = false;
+    *low = 0xFFFF;
+    *high = 0;
+    for (int i = 0; i < VEC_LANES; i++) {
+        running |= any[i] != 0;
+        *low = lo[i] < *low ? lo[i] : *low;
+        *high = hi[i] > *high ? hi[i] : *high;
+    }
+    return running;
+}
+
+// Whether every running lane at insn's PC holds the bytes it was decoded from
+static bool lanes_at_pc_match(const CpuBundle *bundle, const DecodedInsn *insn) {
+    for (int lane = 0; lane < bundle->lanes; lane++) {
+        if (bundle->active[lane] && bundle->pc[lane] == insn->pc &&
+            !lane_matches(bundle, lane, insn)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#else
+
+static bool lane_pc_range(const CpuBundle *bundle, uint16_t *low, uint16_t *high) {
+    bool running = false;
+    *low = 0xFFFF;
+    *high = 0;
+    for (int lane = 0; lane < bundle->lanes; lane++) {
+        if (bundle->active[lane]) {
+            running = true;
+            *low = bundle->pc[lane] < *low ? bundle->pc[lane] : *low;
+            *high = bundle->pc[lane] > *high ? bundle->pc[lane] : *high;
+        }
+    }
+    return running;
+}
+
+#endif
+
+// Advance the lanes at the lowest PC by one instruction, or every running
+// lane when they have been split too long; false once every lane has stopped
+bool bundle_step(CpuBundle *bundle) {
+    uint16_t low, high;
+    if (!lane_pc_range(bundle, &low, &high)) {
+        return false;
+    }
+
+    if (low == high) {
+        bundle->split_steps = 0;
+    } else if (++bundle->split_steps > BUNDLE_FAIR_STEPS) {
+        bundle->split_steps = 0;
+        for (int lane = 0; lane < bundle->lanes; lane++) {
+            if (bundle->active[lane]) {
+                scalar_step(bundle, lane);
+            }
+        }
+        bundle->scalar_steps++;
+        return true;
+    }
+
+#if defined(__GNUC__)
+    if (bundle->irq_lanes == 0) {
+        const BundleInsn *entry = bundle_fetch(bundle, low);
+        if (entry->vector && (entry->uniform || lanes_at_pc_match(bundle, &entry->insn))) {
+            vector_execute(bundle, &entry->insn);
+            bundle->vector_steps++;
+            return true;
+        }
+    }
+#endif
+
+    for (int lane = 0; lane < bundle->lanes; lane++) {
+        if (bundle->active[lane] && bundle->pc[lane] == low) {
+            scalar_step(bundle, lane);
+        }
+    }
+    bundle->scalar_steps++;
+    return true;
+}
+
+// Step until every lane stops or max_steps steps have run; returns the steps taken
+uint64_t bundle_run(CpuBundle *bundle, uint64_t max_steps) {
+    uint64_t steps = 0;
+    while (steps < max_steps && bundle_step(bundle)) {
+        steps++;
+    }
+    return steps;
+}
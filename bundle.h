@@ -0,0 +1,50 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+#define BUNDLE_MAX_LANES 1024
+#define BUNDLE_VECTOR_LANES 16  // Lane arrays are padded to a whole number of 256-bit vectors
+#define BUNDLE_FAIR_STEPS 64    // Split steps before every running lane gets a turn
+
+// Instruction shared by every lane at one PC
+typedef struct {
+    DecodedInsn insn;
+    bool vector;          // A register-only operation
+    bool uniform;         // Same bytes in every lane
+} BundleInsn;
+
+// Many CPUs running the same program in lockstep. Registers live in
+// structure-of-arrays form, one array element per lane; each lane keeps a
+// full CPU for its memory, devices and scalar execution.
+typedef struct {
+    int lanes;
+    int padded;           // lanes rounded up to BUNDLE_VECTOR_LANES
+    uint16_t *pc;
+    uint16_t *sp;
+    uint16_t *reg[4];     // A, B, C, D
+    uint16_t *flags;
+    uint16_t *active;     // 0xFFFF while the lane runs, 0 once it has stopped
+    uint64_t *cycles;
+    CPU **cpus;
+    BundleInsn *cache;    // Direct-mapped, DECODE_CACHE_SIZE entries keyed by PC
+    uint64_t vector_steps;  // Steps executed once for all lanes
+    uint64_t scalar_steps;  // Steps executed lane by lane
+    int split_steps;      // Steps since the running lanes last shared a PC
+    int irq_lanes;        // Running lanes with an interrupt source enabled or in WAIT (scalar only)
+} CpuBundle;
+
+// Function declarations
+bool bundle_init(CpuBundle *bundle, int lanes);
+void bundle_free(CpuBundle *bundle);
+void bundle_load_program(CpuBundle *bundle, const uint8_t *program, size_t size, uint16_t start_addr);
+void bundle_invalidate(CpuBundle *bundle);
+CPU *bundle_lane_cpu(CpuBundle *bundle, int lane);
+void bundle_set_regs(CpuBundle *bundle, int lane, const Registers *regs);
+void bundle_get_regs(const CpuBundle *bundle, int lane, Registers *regs);
+bool bundle_step(CpuBundle *bundle);
+uint64_t bundle_run(CpuBundle *bundle, uint64_t max_steps);
+
+#endif // BUNDLE_H
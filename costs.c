@@ -0,0 +1,133 @@
+#define _POSIX_C_SOURCE 200809L
+#include "cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Cycle cost model.
+//
+// cpu->cycles advances by each instruction's cost; cpu->instructions counts
+// instructions whatever they cost. The cost of an instruction byte
+// (opcode << 2 | mode) is its base cost plus the memory cost for each RAM
+// access it makes, precomputed into cpu->cycle_costs. cpu_decode copies it
+// into the decoded instruction, so engines charge it with a single add.
+// Device accesses are only known at run time: mmio_read8 / mmio_write8 and
+// 16-bit device reads add cpu->mmio_cost as they happen.
+//
+// A cost file has one setting per line; '#' starts a comment:
+//
+//     MUL 4              every mode of an opcode
+//     LOAD indirect 3    one mode: immediate, direct, register or indirect
+//     memory 1           per RAM access
+//     mmio 5             per device access
+
+void cycle_costs_default(CycleCostModel *model) {
+    memset(model->base, 1, sizeof(model->base));
+    model->memory = 0;
+    model->mmio = 0;
+}
+
+// RAM accesses beyond the fetch: DIRECT / INDIRECT operands (STORE's write
+// included) and stack traffic. A 16-bit access counts once.
+static int memory_accesses(uint8_t opcode, uint8_t mode) {
+    int operand = (mode == MODE_DIRECT || mode == MODE_INDIRECT) ? 1 : 0;
+    switch (opcode) {
+        case OP_NOP: case OP_MOV: case OP_INC: case OP_DEC: case OP_NOT:
+        case OP_HALT: case OP_OUT: case OP_EI: case OP_DI: case OP_WAIT:
+            return 0;
+        case OP_POP: case OP_RET:
+            return 1;
+        case OP_IRET:
+            return 2;
+        case OP_PUSH: case OP_CALL:
+            return operand + 1;
+        default:
+            return operand;
+    }
+}
+
+// Install a model; cached decodes carry the old costs, so they are dropped
+void cpu_set_cycle_costs(CPU *cpu, const CycleCostModel *model) {
+    for (int byte = 0; byte < 256; byte++) {
+        uint8_t opcode = byte >> 2;
+        uint8_t mode = byte & 3;
+        int cost = model->base[opcode][mode] + model->memory * memory_accesses(opcode, mode);
+        cpu->cycle_costs[byte] = cost > 255 ? 255 : cost;
+    }
+    cpu->mmio_cost = model->mmio;
+    cpu_invalidate_decode_cache(cpu);
+}
+
+static int parse_mode(const char *name) {
+    static const char *const modes[4] = { "immediate", "direct", "register", "indirect" };
+    for (int mode = 0; mode < 4; mode++) {
+        if (strcasecmp(name, modes[mode]) == 0) {
+            return mode;
+        }
+    }
+    return -1;
+}
+
+static int parse_opcode(const char *name) {
+    for (int opcode = 0; opcode <= OP_WAIT; opcode++) {
+        if (strcasecmp(name, get_opcode_name(opcode)) == 0) {
+            return opcode;
+        }
+    }
+    return -1;
+}
+
+// Read a cost file over the model's current values
+bool cycle_costs_load(CycleCostModel *model, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open cost file '%s'\n", path);
+        return false;
+    }
+
+    char line[256];
+    int line_number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *words[4];
+        int count = 0;
+        for (char *word = strtok(line, " \t\r\n"); word && count < 4; word = strtok(NULL, " \t\r\n")) {
+            words[count++] = word;
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        char *end;
+        long cycles = count >= 2 ? strtol(words[count - 1], &end, 0) : -1;
+        if (count < 2 || count > 3 || *end != '\0' || cycles < 0 || cycles > 255) {
+            ok = false;
+        } else if (count == 2 && strcasecmp(words[0], "memory") == 0) {
+            model->memory = cycles;
+        } else if (count == 2 && strcasecmp(words[0], "mmio") == 0) {
+            model->mmio = cycles;
+        } else {
+            int opcode = parse_opcode(words[0]);
+            int mode = count == 3 ? parse_mode(words[1]) : 0;
+            if (opcode < 0 || mode < 0 || cycles == 0) {
+                ok = false;  // Zero-cost instructions could run forever without using up a budget
+            } else if (count == 3) {
+                model->base[opcode][mode] = cycles;
+            } else {
+                memset(model->base[opcode], cycles, sizeof(model->base[opcode]));
+            }
+        }
+        if (!ok) {
+            fprintf(stderr, "Error: '%s' line %d: expected '<opcode> [mode] <cycles>', "
+                    "'memory <cycles>' or 'mmio <cycles>'\n", path, line_number);
+        }
+    }
+    fclose(f);
+    return ok;
+}
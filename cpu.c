@@ -2,15 +2,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
-#include <sys/time.h>
-
-// Helper function to get current time in milliseconds
-static uint64_t get_time_ms(void) {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (uint64_t)(tv.tv_sec) * 1000 + (uint64_t)(tv.tv_usec) / 1000;
-}
 
 // Initialize CPU
 void cpu_init(CPU *cpu) {
@@ -18,7 +9,29 @@ void cpu_init(CPU *cpu) {
     cpu->regs.SP = STACK_START;
     cpu->running = false;
     cpu->cycles = 0;
-    cpu->timer_start_ms = get_time_ms();
+    memset(cpu->cycle_costs, 1, sizeof(cpu->cycle_costs));
+
+    // Every page is RAM except the I/O window, which devices claim
+    for (int page = 0; page < MEMORY_SIZE / 256; page++) {
+        cpu->page_table[page] = &cpu->memory[page << 8];
+    }
+    for (int page = IO_START >> 8; page < MEMORY_SIZE / 256; page++) {
+        cpu->page_table[page] = NULL;
+    }
+    cpu->mmio_base = IO_START;
+    memset(cpu->dirty_pages, 0xFF, sizeof(cpu->dirty_pages));
+    cpu->idle_skip = true;
+    cpu_map_default_devices(cpu);
+}
+
+// Release engine resources (call before re-initialising or discarding a CPU)
+void cpu_free(CPU *cpu) {
+    cpu_flush_devices(cpu);
+    console_output_free(&cpu->console);
+    jit_free(cpu);
+    cpu_drop_snapshot(cpu);
+    cpu_set_profiling(cpu, false);
+    cpu_trace_stop(cpu);
 }
 
 // Reset CPU to initial state
@@ -30,39 +43,190 @@ void cpu_reset(CPU *cpu) {
     cpu->regs.C = 0;
     cpu->regs.D = 0;
     cpu->regs.FLAGS = 0;
+    cpu->flags_pending = 0;
     cpu->running = false;
+    cpu->waiting = false;
     cpu->cycles = 0;
+    cpu->instructions = 0;
+}
+
+// Save a page for cpu_restore before its first write since the snapshot
+static inline void track_write(CPU *cpu, uint16_t addr) {
+    uint8_t page = addr >> 8;
+    if (!((cpu->dirty_pages[page >> 6] >> (page & 63)) & 1)) {
+        snapshot_page_write(cpu, page);
+    }
 }
 
 // Load program into memory
-void cpu_load_program(CPU *cpu, const uint8_t *program, uint16_t size, uint16_t start_addr) {
+void cpu_load_program(CPU *cpu, const uint8_t *program, size_t size, uint16_t start_addr) {
     if (start_addr + size > MEMORY_SIZE) {
         fprintf(stderr, "Error: Program too large for memory\n");
         return;
     }
+    for (uint32_t addr = start_addr & ~0xFF; addr < (uint32_t)start_addr + size; addr += 256) {
+        track_write(cpu, addr);
+    }
     memcpy(&cpu->memory[start_addr], program, size);
+    cpu_invalidate_decode_cache(cpu);
     cpu->regs.PC = start_addr;
 }
 
+// Read a program image file into a malloc'd buffer. Returns NULL with the
+// reason in *error if it cannot be read or does not fit in memory.
+uint8_t *cpu_read_program(const char *path, size_t *size, const char **error) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        *error = "cannot be opened";
+        return NULL;
+    }
+    long length = -1;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        length = ftell(f);
+    }
+    uint8_t *program = NULL;
+    if (length < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        *error = "cannot be read";
+    } else if (length > MEMORY_SIZE) {
+        *error = "does not fit in memory";
+    } else if (!(program = malloc(length > 0 ? length : 1))) {
+        *error = "is too large to load (out of memory)";
+    } else if (fread(program, 1, length, f) != (size_t)length) {
+        *error = "cannot be read";
+        free(program);
+        program = NULL;
+    }
+    fclose(f);
+    *size = program ? (size_t)length : 0;
+    return program;
+}
+
+static void code_page_write(CPU *cpu, uint16_t addr);
+
+// Attach a memory-mapped device; the pages it touches leave the RAM fast path
+bool cpu_map_device(CPU *cpu, const MmioDevice *device) {
+    if (cpu->device_count >= MAX_MMIO_DEVICES) {
+        fprintf(stderr, "Error: Too many devices (max %d)\n", MAX_MMIO_DEVICES);
+        return false;
+    }
+    if (device->size == 0 || device->base < 0x0100 ||
+        (uint32_t)device->base + device->size > MEMORY_SIZE) {
+        fprintf(stderr, "Error: Device '%s' has an invalid range\n", device->name);
+        return false;
+    }
+
+    cpu->devices[cpu->device_count++] = *device;
+    for (uint32_t page = device->base >> 8; page <= (device->base + device->size - 1u) >> 8; page++) {
+        cpu->page_table[page] = NULL;
+    }
+    if ((device->base & 0xFF00) < cpu->mmio_base) {
+        // Cached decodes and translations assumed this range was plain RAM
+        cpu->mmio_base = device->base & 0xFF00;
+        cpu_invalidate_decode_cache(cpu);
+    }
+    return true;
+}
+
+// Write out anything devices are holding back (buffered console output)
+void cpu_flush_devices(CPU *cpu) {
+    for (int i = 0; i < cpu->device_count; i++) {
+        if (cpu->devices[i].flush) {
+            cpu->devices[i].flush(cpu, cpu->devices[i].opaque);
+        }
+    }
+}
+
+// Later mappings take precedence, so a device can be replaced by mapping over it
+const MmioDevice *cpu_find_device(const CPU *cpu, uint16_t addr) {
+    for (int i = cpu->device_count - 1; i >= 0; i--) {
+        const MmioDevice *device = &cpu->devices[i];
+        if (addr >= device->base && addr - device->base < device->size) {
+            return device;
+        }
+    }
+    return NULL;
+}
+
+static inline uint16_t load_le16(const uint8_t *p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+#else
+    return p[0] | (p[1] << 8);
+#endif
+}
+
+static inline void store_le16(uint8_t *p, uint16_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(p, &value, sizeof(value));
+#else
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+#endif
+}
+
+// Device-page access. Unclaimed addresses in the I/O window read as 0 and
+// ignore writes; elsewhere they fall back to RAM.
+static uint8_t mmio_read8(CPU *cpu, uint16_t addr) {
+    const MmioDevice *device = cpu_find_device(cpu, addr);
+    if (device) {
+        cpu->cycles += cpu->mmio_cost;
+        if (cpu->profile) {
+            profile_mmio_access(cpu, device, false);
+        }
+        return device->read8 ? device->read8(cpu, addr, device->opaque) : 0;
+    }
+    return addr >= IO_START ? 0 : cpu->memory[addr];
+}
+
+static void mmio_write8(CPU *cpu, uint16_t addr, uint8_t value) {
+    const MmioDevice *device = cpu_find_device(cpu, addr);
+    if (device) {
+        cpu->cycles += cpu->mmio_cost;
+        if (cpu->profile) {
+            profile_mmio_access(cpu, device, true);
+        }
+        if (device->write8) {
+            device->write8(cpu, addr, value, device->opaque);
+        }
+        return;
+    }
+    if (addr < IO_START) {
+        track_write(cpu, addr);
+        cpu->memory[addr] = value;
+        if (cpu->code_pages[addr >> 8]) {
+            code_page_write(cpu, addr);
+        }
+    }
+}
+
 // Memory read operations
 uint8_t mem_read8(CPU *cpu, uint16_t addr) {
-    // Handle memory-mapped I/O
-    if (addr >= IO_START) {
-        // Simple console input at 0xFF00
-        if (addr == 0xFF00) {
-            return getchar();
-        }
-        return 0;
+    uint8_t *page = cpu->page_table[addr >> 8];
+    if (page) {
+        return page[addr & 0xFF];
     }
-    return cpu->memory[addr];
+    return mmio_read8(cpu, addr);
 }
 
 uint16_t mem_read16(CPU *cpu, uint16_t addr) {
-    // Handle hardware timer at 0xFF03
-    if (addr == TIMER_ADDR) {
-        uint64_t elapsed_ms = get_time_ms() - cpu->timer_start_ms;
-        // Return lower 16 bits (wraps around every ~65 seconds)
-        return (uint16_t)(elapsed_ms & 0xFFFF);
+    // Fast path: both bytes in the same RAM page
+    uint8_t *page = cpu->page_table[addr >> 8];
+    if (page && (addr & 0xFF) != 0xFF) {
+        return load_le16(page + (addr & 0xFF));
+    }
+
+    // Devices such as the timer may answer a 16-bit read as a whole
+    if (!page) {
+        const MmioDevice *device = cpu_find_device(cpu, addr);
+        if (device && device->read16) {
+            cpu->cycles += cpu->mmio_cost;
+            if (cpu->profile) {
+                profile_mmio_access(cpu, device, false);
+            }
+            return device->read16(cpu, addr, device->opaque);
+        }
     }
 
     uint8_t low = mem_read8(cpu, addr);
@@ -72,19 +236,27 @@ uint16_t mem_read16(CPU *cpu, uint16_t addr) {
 
 // Memory write operations
 void mem_write8(CPU *cpu, uint16_t addr, uint8_t value) {
-    // Handle memory-mapped I/O
-    if (addr >= IO_START) {
-        // Simple console output at 0xFF01
-        if (addr == 0xFF01) {
-            putchar(value);
-            fflush(stdout);
-        }
+    uint8_t *page = cpu->page_table[addr >> 8];
+    if (!page) {
+        mmio_write8(cpu, addr, value);
         return;
     }
-    cpu->memory[addr] = value;
+    track_write(cpu, addr);
+    page[addr & 0xFF] = value;
+
+    // Self-modifying code: drop stale decodes
+    if (cpu->code_pages[addr >> 8]) {
+        code_page_write(cpu, addr);
+    }
 }
 
 void mem_write16(CPU *cpu, uint16_t addr, uint16_t value) {
+    uint8_t *page = cpu->page_table[addr >> 8];
+    if (page && (addr & 0xFF) != 0xFF && !cpu->code_pages[addr >> 8]) {
+        track_write(cpu, addr);
+        store_le16(page + (addr & 0xFF), value);
+        return;
+    }
     mem_write8(cpu, addr, value & 0xFF);
     mem_write8(cpu, addr + 1, (value >> 8) & 0xFF);
 }
@@ -113,18 +285,30 @@ uint16_t stack_pop16(CPU *cpu) {
 
 // Flag operations
 void set_flag(CPU *cpu, uint8_t flag) {
+    cpu->flags_pending &= ~flag;
     cpu->regs.FLAGS |= flag;
 }
 
 void clear_flag(CPU *cpu, uint8_t flag) {
+    cpu->flags_pending &= ~flag;
     cpu->regs.FLAGS &= ~flag;
 }
 
 bool get_flag(const CPU *cpu, uint8_t flag) {
+    if (cpu->flags_pending & flag) {
+        return (cpu_flags(cpu) & flag) != 0;
+    }
     return (cpu->regs.FLAGS & flag) != 0;
 }
 
 void update_flags(CPU *cpu, uint16_t result) {
+    // Lazy mode: remember the result, derive Z and N when they are read
+    if (cpu->lazy_flags) {
+        cpu->lazy_result = result;
+        cpu->flags_pending |= FLAG_ZERO | FLAG_NEGATIVE;
+        return;
+    }
+
     // Zero flag - check full 16-bit value
     if (result == 0) {
         set_flag(cpu, FLAG_ZERO);
@@ -140,6 +324,69 @@ void update_flags(CPU *cpu, uint16_t result) {
     }
 }
 
+// Carry and overflow bits for src + operand or src - operand
+static uint8_t arith_flags(uint8_t op, uint16_t src, uint16_t operand) {
+    uint8_t flags = 0;
+    if (op == LAZY_ADD) {
+        uint16_t result = src + operand;
+        if (result < src) flags |= FLAG_CARRY;
+        if (~(src ^ operand) & (src ^ result) & 0x8000) flags |= FLAG_OVERFLOW;
+    } else {
+        uint16_t result = src - operand;
+        if (src < operand) flags |= FLAG_CARRY;
+        if ((src ^ operand) & (src ^ result) & 0x8000) flags |= FLAG_OVERFLOW;
+    }
+    return flags;
+}
+
+// Z, N, C and O for ADD / SUB / CMP of operand against src
+void update_arith_flags(CPU *cpu, LazyFlagsOp op, uint16_t src, uint16_t operand) {
+    uint16_t result = (op == LAZY_ADD) ? src + operand : src - operand;
+    if (cpu->lazy_flags) {
+        cpu->lazy_op = op;
+        cpu->lazy_src = src;
+        cpu->lazy_operand = operand;
+        cpu->lazy_result = result;
+        cpu->flags_pending |= FLAG_ZERO | FLAG_NEGATIVE | FLAG_CARRY | FLAG_OVERFLOW;
+        return;
+    }
+    cpu->regs.FLAGS = (cpu->regs.FLAGS & ~(FLAG_CARRY | FLAG_OVERFLOW)) |
+                      arith_flags(op, src, operand);
+    update_flags(cpu, result);
+}
+
+// Current FLAGS value, computing any bits still pending in lazy mode
+uint8_t cpu_flags(const CPU *cpu) {
+    uint8_t pending = cpu->flags_pending;
+    if (pending == 0) {
+        return cpu->regs.FLAGS;
+    }
+    uint8_t flags = 0;
+    if (cpu->lazy_result == 0) flags |= FLAG_ZERO;
+    if (cpu->lazy_result & 0x8000) flags |= FLAG_NEGATIVE;
+    if (pending & (FLAG_CARRY | FLAG_OVERFLOW)) {
+        flags |= arith_flags(cpu->lazy_op, cpu->lazy_src, cpu->lazy_operand);
+    }
+    return (cpu->regs.FLAGS & ~pending) | (flags & pending);
+}
+
+// Write pending lazy flags back to regs.FLAGS (before reading FLAGS directly)
+void cpu_sync_flags(CPU *cpu) {
+    cpu->regs.FLAGS = cpu_flags(cpu);
+    cpu->flags_pending = 0;
+}
+
+// Switch between eager and lazy condition flags
+void cpu_set_lazy_flags(CPU *cpu, bool enabled) {
+    cpu_sync_flags(cpu);
+    cpu->lazy_flags = enabled;
+}
+
+// Map a register byte to 0-3 (out-of-range numbers select A)
+static uint8_t register_index(uint8_t reg_num) {
+    return reg_num <= 3 ? reg_num : 0;
+}
+
 // Get register value by number
 uint16_t* get_register(CPU *cpu, uint8_t reg_num) {
     switch (reg_num) {
@@ -151,273 +398,684 @@ uint16_t* get_register(CPU *cpu, uint8_t reg_num) {
     }
 }
 
+// Resolve an operand value for the given addressing mode
+static uint16_t resolve_operand(CPU *cpu, uint8_t mode, uint16_t operand) {
+    switch (mode) {
+        case MODE_IMMEDIATE:
+            return operand;
+        case MODE_DIRECT:
+            return mem_read16(cpu, operand);
+        case MODE_REGISTER:
+            return *get_register(cpu, operand);
+        default:
+            return mem_read16(cpu, *get_register(cpu, operand));
+    }
+}
+
+static uint16_t operand_value(CPU *cpu, const DecodedInsn *insn) {
+    return resolve_operand(cpu, insn->mode, insn->operand);
+}
+
+// Resolve the effective memory address for DIRECT / INDIRECT modes
+static uint16_t operand_address(CPU *cpu, const DecodedInsn *insn) {
+    if (insn->mode == MODE_DIRECT) {
+        return insn->operand;
+    }
+    return *get_register(cpu, insn->operand);
+}
+
+// Instruction handlers (PC already points past the instruction)
+static void op_nop(CPU *cpu, const DecodedInsn *insn) {
+    (void)cpu;
+    (void)insn;
+}
+
+static void op_load(CPU *cpu, const DecodedInsn *insn) {
+    cpu->regs.A = operand_value(cpu, insn);
+    update_flags(cpu, cpu->regs.A);
+}
+
+static void op_store(CPU *cpu, const DecodedInsn *insn) {
+    if (insn->mode == MODE_DIRECT || insn->mode == MODE_INDIRECT) {
+        mem_write16(cpu, operand_address(cpu, insn), cpu->regs.A);
+    }
+}
+
+static void op_mov(CPU *cpu, const DecodedInsn *insn) {
+    if (insn->mode == MODE_REGISTER) {
+        uint16_t *dest = get_register(cpu, insn->dest_reg);
+        *dest = operand_value(cpu, insn);
+        update_flags(cpu, *dest);
+    }
+}
+
+static void op_push(CPU *cpu, const DecodedInsn *insn) {
+    stack_push16(cpu, operand_value(cpu, insn));
+}
+
+static void op_pop(CPU *cpu, const DecodedInsn *insn) {
+    (void)insn;
+    cpu->regs.A = stack_pop16(cpu);
+    update_flags(cpu, cpu->regs.A);
+}
+
+static void op_add(CPU *cpu, const DecodedInsn *insn) {
+    uint16_t src = cpu->regs.A;
+    uint16_t operand = operand_value(cpu, insn);
+    cpu->regs.A = src + operand;
+    update_arith_flags(cpu, LAZY_ADD, src, operand);
+}
+
+static void op_sub(CPU *cpu, const DecodedInsn *insn) {
+    uint16_t src = cpu->regs.A;
+    uint16_t operand = operand_value(cpu, insn);
+    cpu->regs.A = src - operand;
+    update_arith_flags(cpu, LAZY_SUB, src, operand);
+}
+
+static void op_inc(CPU *cpu, const DecodedInsn *insn) {
+    uint16_t *reg = (insn->mode == MODE_REGISTER) ? get_register(cpu, insn->operand) : &cpu->regs.A;
+    (*reg)++;
+    update_flags(cpu, *reg);
+}
+
+static void op_dec(CPU *cpu, const DecodedInsn *insn) {
+    uint16_t *reg = (insn->mode == MODE_REGISTER) ? get_register(cpu, insn->operand) : &cpu->regs.A;
+    (*reg)--;
+    update_flags(cpu, *reg);
+}
+
+static void op_mul(CPU *cpu, const DecodedInsn *insn) {
+    cpu->regs.A = (cpu->regs.A * operand_value(cpu, insn)) & 0xFFFF;
+    update_flags(cpu, cpu->regs.A);
+}
+
+static void op_div(CPU *cpu, const DecodedInsn *insn) {
+    uint16_t operand = operand_value(cpu, insn);
+    if (operand != 0) {
+        cpu->regs.A = cpu->regs.A / operand;
+        update_flags(cpu, cpu->regs.A);
+    }
+}
+
+static void op_and(CPU *cpu, const DecodedInsn *insn) {
+    cpu->regs.A &= operand_value(cpu, insn);
+    update_flags(cpu, cpu->regs.A);
+}
+
+static void op_or(CPU *cpu, const DecodedInsn *insn) {
+    cpu->regs.A |= operand_value(cpu, insn);
+    update_flags(cpu, cpu->regs.A);
+}
+
+static void op_xor(CPU *cpu, const DecodedInsn *insn) {
+    cpu->regs.A ^= operand_value(cpu, insn);
+    update_flags(cpu, cpu->regs.A);
+}
+
+static void op_not(CPU *cpu, const DecodedInsn *insn) {
+    (void)insn;
+    cpu->regs.A = ~cpu->regs.A;
+    update_flags(cpu, cpu->regs.A);
+}
+
+static void op_shl(CPU *cpu, const DecodedInsn *insn) {
+    cpu->regs.A <<= operand_value(cpu, insn);
+    update_flags(cpu, cpu->regs.A);
+}
+
+static void op_shr(CPU *cpu, const DecodedInsn *insn) {
+    cpu->regs.A >>= operand_value(cpu, insn);
+    update_flags(cpu, cpu->regs.A);
+}
+
+static void op_cmp(CPU *cpu, const DecodedInsn *insn) {
+    update_arith_flags(cpu, LAZY_SUB, cpu->regs.A, operand_value(cpu, insn));
+}
+
+static void op_test(CPU *cpu, const DecodedInsn *insn) {
+    update_flags(cpu, cpu->regs.A & operand_value(cpu, insn));
+}
+
+static void op_jmp(CPU *cpu, const DecodedInsn *insn) {
+    cpu->regs.PC = operand_value(cpu, insn);
+}
+
+static void op_jz(CPU *cpu, const DecodedInsn *insn) {
+    uint16_t target = operand_value(cpu, insn);
+    if (get_flag(cpu, FLAG_ZERO)) {
+        cpu->regs.PC = target;
+    }
+}
+
+static void op_jnz(CPU *cpu, const DecodedInsn *insn) {
+    uint16_t target = operand_value(cpu, insn);
+    if (!get_flag(cpu, FLAG_ZERO)) {
+        cpu->regs.PC = target;
+    }
+}
+
+static void op_jc(CPU *cpu, const DecodedInsn *insn) {
+    uint16_t target = operand_value(cpu, insn);
+    if (get_flag(cpu, FLAG_CARRY)) {
+        cpu->regs.PC = target;
+    }
+}
+
+static void op_jnc(CPU *cpu, const DecodedInsn *insn) {
+    uint16_t target = operand_value(cpu, insn);
+    if (!get_flag(cpu, FLAG_CARRY)) {
+        cpu->regs.PC = target;
+    }
+}
+
+static void op_call(CPU *cpu, const DecodedInsn *insn) {
+    uint16_t target = operand_value(cpu, insn);
+    stack_push16(cpu, cpu->regs.PC);
+    cpu->regs.PC = target;
+}
+
+static void op_ret(CPU *cpu, const DecodedInsn *insn) {
+    (void)insn;
+    cpu->regs.PC = stack_pop16(cpu);
+}
+
+static void op_halt(CPU *cpu, const DecodedInsn *insn) {
+    (void)insn;
+    set_flag(cpu, FLAG_HALT);
+    cpu_stop(cpu, CPU_EXIT_HALTED);
+    cpu_flush_devices(cpu);
+    if (!cpu->quiet) {
+        printf("\n[CPU HALTED after %llu cycles]\n",
+               (unsigned long long)cpu->cycles);
+    }
+}
+
+static void op_in(CPU *cpu, const DecodedInsn *insn) {
+    cpu->regs.A = mem_read8(cpu, IO_START + operand_value(cpu, insn));
+    update_flags(cpu, cpu->regs.A);
+}
+
+static void op_out(CPU *cpu, const DecodedInsn *insn) {
+    (void)insn;
+    mem_write8(cpu, IO_START + 1, cpu->regs.A & 0xFF);
+}
+
+static void op_iret(CPU *cpu, const DecodedInsn *insn) {
+    (void)insn;
+    cpu->regs.FLAGS = stack_pop16(cpu) & ~FLAG_HALT;
+    cpu->flags_pending = 0;
+    cpu->regs.PC = stack_pop16(cpu);
+    cpu_interrupt_check(cpu);
+}
+
+static void op_ei(CPU *cpu, const DecodedInsn *insn) {
+    (void)insn;
+    set_flag(cpu, FLAG_INTERRUPT);
+    cpu_interrupt_check(cpu);
+}
+
+static void op_di(CPU *cpu, const DecodedInsn *insn) {
+    (void)insn;
+    clear_flag(cpu, FLAG_INTERRUPT);
+}
+
+// cpu_run_for skips ahead to the next interrupt event
+static void op_wait(CPU *cpu, const DecodedInsn *insn) {
+    (void)insn;
+    cpu->waiting = true;
+    cpu_interrupt_check(cpu);
+}
+
+static void op_unknown(CPU *cpu, const DecodedInsn *insn) {
+    if (!cpu->quiet) {
+        fprintf(stderr, "Unknown opcode: 0x%02X at PC=0x%04X\n",
+                insn->opcode, insn->pc);
+    }
+    cpu_stop(cpu, CPU_EXIT_UNKNOWN_OPCODE);
+}
+
+// Installed in place of the instruction at a breakpoint: undo the fetch and stop
+static void op_breakpoint(CPU *cpu, const DecodedInsn *insn) {
+    cpu->regs.PC = insn->pc;
+    cpu->cycles -= insn->cost;
+    cpu->instructions--;
+    cpu_stop(cpu, CPU_EXIT_BREAKPOINT);
+}
+
+// Superinstruction handlers. Engines charge the cost of the whole group and
+// count one instruction per dispatch; these count the instructions folded in.
+
+// CMP #0 / JZ|JNZ #target
+static void op_fused_cmp0_jcc(CPU *cpu, const DecodedInsn *insn) {
+    update_arith_flags(cpu, LAZY_SUB, cpu->regs.A, 0);
+    if (get_flag(cpu, FLAG_ZERO) == (insn->fusion == FUSION_CMP0_JZ)) {
+        cpu->regs.PC = insn->operand2;
+    }
+    cpu->instructions += 1;
+    cpu->fusion_hits[insn->fusion]++;
+}
+
+// LOAD reg / ADD|SUB x [/ MOV A reg]
+static void op_fused_load_alu(CPU *cpu, const DecodedInsn *insn) {
+    cpu->regs.A = *get_register(cpu, insn->operand);
+    uint16_t src = cpu->regs.A;
+    uint16_t operand = resolve_operand(cpu, insn->mode2, insn->operand2);
+    bool add = (insn->fusion == FUSION_LOAD_ADD || insn->fusion == FUSION_LOAD_ADD_MOV);
+    cpu->regs.A = add ? src + operand : src - operand;
+    update_arith_flags(cpu, add ? LAZY_ADD : LAZY_SUB, src, operand);
+
+    if (insn->fusion == FUSION_LOAD_ADD_MOV || insn->fusion == FUSION_LOAD_SUB_MOV) {
+        *get_register(cpu, insn->dest_reg) = cpu->regs.A;
+        cpu->instructions += 2;
+    } else {
+        cpu->instructions += 1;
+    }
+    cpu->fusion_hits[insn->fusion]++;
+}
+
+// LOAD reg / SUB #1 / MOV A reg
+static void op_fused_countdown(CPU *cpu, const DecodedInsn *insn) {
+    uint16_t *reg = get_register(cpu, insn->operand);
+    uint16_t src = *reg;
+    cpu->regs.A = src - 1;
+    *reg = cpu->regs.A;
+    update_arith_flags(cpu, LAZY_SUB, src, 1);
+    cpu->instructions += 2;
+    cpu->fusion_hits[FUSION_COUNTDOWN]++;
+}
+
+static const InsnHandler opcode_handlers[64] = {
+    [OP_NOP] = op_nop,   [OP_LOAD] = op_load, [OP_STORE] = op_store,
+    [OP_MOV] = op_mov,   [OP_PUSH] = op_push, [OP_POP] = op_pop,
+    [OP_ADD] = op_add,   [OP_SUB] = op_sub,   [OP_INC] = op_inc,
+    [OP_DEC] = op_dec,   [OP_MUL] = op_mul,   [OP_DIV] = op_div,
+    [OP_AND] = op_and,   [OP_OR] = op_or,     [OP_XOR] = op_xor,
+    [OP_NOT] = op_not,   [OP_SHL] = op_shl,   [OP_SHR] = op_shr,
+    [OP_CMP] = op_cmp,   [OP_TEST] = op_test, [OP_JMP] = op_jmp,
+    [OP_JZ] = op_jz,     [OP_JNZ] = op_jnz,   [OP_JC] = op_jc,
+    [OP_JNC] = op_jnc,   [OP_CALL] = op_call, [OP_RET] = op_ret,
+    [OP_HALT] = op_halt, [OP_IN] = op_in,     [OP_OUT] = op_out,
+    [OP_IRET] = op_iret, [OP_EI] = op_ei,     [OP_DI] = op_di,
+    [OP_WAIT] = op_wait,
+};
+
+// NOP, HALT, RET, NOT, POP and the interrupt instructions don't need operands
+static bool has_operand(uint8_t opcode, uint8_t mode) {
+    return !(opcode == OP_NOP || opcode == OP_HALT || opcode == OP_RET ||
+             opcode == OP_NOT || (opcode == OP_POP && mode == MODE_IMMEDIATE) ||
+             (opcode >= OP_IRET && opcode <= OP_WAIT));
+}
+
+// Decode the instruction at pc (opcode, mode, operand bytes and length)
+void cpu_decode(CPU *cpu, uint16_t pc, DecodedInsn *insn) {
+    uint8_t instruction = mem_read8(cpu, pc);
+    insn->label = NULL;
+    insn->pc = pc;
+    insn->opcode = (instruction >> 2) & 0x3F;  // Upper 6 bits
+    insn->mode = instruction & 0x03;            // Lower 2 bits
+    insn->operand = 0;
+    insn->dest_reg = 0;
+    insn->length = 1;
+    insn->fusion = FUSION_NONE;
+    insn->cost = cpu->cycle_costs[instruction];
+    insn->breakpoint = false;
+    insn->timer_poll = false;
+    insn->mode2 = 0;
+    insn->operand2 = 0;
+
+    // Only fetch operands for instructions that need them
+    uint8_t opcode = insn->opcode;
+    if (has_operand(opcode, insn->mode)) {
+        if (insn->mode == MODE_IMMEDIATE || insn->mode == MODE_DIRECT) {
+            insn->operand = mem_read16(cpu, pc + 1);
+            insn->length = 3;
+        } else {
+            insn->operand = register_index(mem_read8(cpu, pc + 1));
+            insn->length = 2;
+        }
+    }
+
+    // MOV reg, reg carries a second register byte
+    if (opcode == OP_MOV && insn->mode == MODE_REGISTER) {
+        insn->dest_reg = register_index(mem_read8(cpu, pc + insn->length));
+        insn->length++;
+    }
+
+    insn->handler = opcode_handlers[opcode] ? opcode_handlers[opcode] : op_unknown;
+}
+
+// Fold the instructions following insn into a superinstruction when they
+// form a known sequence. Only used for decode-cache entries.
+void cpu_fuse(CPU *cpu, DecodedInsn *insn) {
+    uint16_t pc = insn->pc;
+    DecodedInsn second, third;
+
+    // Lookahead must stay in RAM
+    if (pc >= cpu->mmio_base - MAX_FUSED_LENGTH) {
+        return;
+    }
+
+    if (insn->opcode == OP_CMP && insn->mode == MODE_IMMEDIATE && insn->operand == 0) {
+        cpu_decode(cpu, pc + insn->length, &second);
+        if ((second.opcode == OP_JZ || second.opcode == OP_JNZ) && second.mode == MODE_IMMEDIATE) {
+            insn->fusion = (second.opcode == OP_JZ) ? FUSION_CMP0_JZ : FUSION_CMP0_JNZ;
+            insn->operand2 = second.operand;
+            insn->length += second.length;
+            insn->cost += second.cost;
+            insn->handler = op_fused_cmp0_jcc;
+        }
+        return;
+    }
+
+    if (insn->opcode != OP_LOAD || insn->mode != MODE_REGISTER) {
+        return;
+    }
+    cpu_decode(cpu, pc + insn->length, &second);
+    if (second.opcode != OP_ADD && second.opcode != OP_SUB) {
+        return;
+    }
+    cpu_decode(cpu, pc + insn->length + second.length, &third);
+    bool mov_back = (third.opcode == OP_MOV && third.mode == MODE_REGISTER && third.operand == 0);
+
+    insn->mode2 = second.mode;
+    insn->operand2 = second.operand;
+    insn->length += second.length;
+    insn->cost += second.cost;
+    insn->handler = op_fused_load_alu;
+    if (!mov_back) {
+        insn->fusion = (second.opcode == OP_ADD) ? FUSION_LOAD_ADD : FUSION_LOAD_SUB;
+        return;
+    }
+
+    insn->dest_reg = third.dest_reg;
+    insn->length += third.length;
+    insn->cost += third.cost;
+    if (second.opcode == OP_SUB && second.mode == MODE_IMMEDIATE && second.operand == 1 &&
+        third.dest_reg == insn->operand) {
+        insn->fusion = FUSION_COUNTDOWN;
+        insn->handler = op_fused_countdown;
+    } else {
+        insn->fusion = (second.opcode == OP_ADD) ? FUSION_LOAD_ADD_MOV : FUSION_LOAD_SUB_MOV;
+    }
+}
+
+// Enable or disable superinstruction fusion (rebuilds the decode cache)
+void cpu_set_fusion(CPU *cpu, bool enabled) {
+    cpu->fusion = enabled;
+    cpu_invalidate_decode_cache(cpu);
+}
+
+// Drop every cached decode and translation (call after writing cpu->memory directly)
+void cpu_invalidate_decode_cache(CPU *cpu) {
+    memset(cpu->decode_cache, 0, sizeof(cpu->decode_cache));
+    memset(cpu->code_pages, 0, sizeof(cpu->code_pages));
+    cpu->code_writes++;
+    jit_flush(cpu);
+}
+
+// Drop cached instructions whose encoding covers addr
+static void decode_cache_invalidate_addr(CPU *cpu, uint16_t addr) {
+    for (uint8_t back = 0; back < MAX_FUSED_LENGTH; back++) {
+        uint16_t pc = addr - back;
+        DecodedInsn *entry = &cpu->decode_cache[pc & (DECODE_CACHE_SIZE - 1)];
+        if (entry->length > back && entry->pc == pc) {
+            entry->length = 0;
+            entry->label = NULL;
+        }
+    }
+}
+
+// A write hit a page holding cached code: drop whatever covers addr
+static void code_page_write(CPU *cpu, uint16_t addr) {
+    cpu->code_writes++;
+    if (cpu->code_pages[addr >> 8] & CODE_PAGE_DECODED) {
+        decode_cache_invalidate_addr(cpu, addr);
+    }
+    if (cpu->code_pages[addr >> 8] & CODE_PAGE_JIT) {
+        jit_invalidate_addr(cpu, addr);
+    }
+}
+
+// Drop cached decodes and translations covering addr (after writing cpu->memory directly)
+void cpu_invalidate_code(CPU *cpu, uint16_t addr) {
+    if (cpu->code_pages[addr >> 8]) {
+        code_page_write(cpu, addr);
+    }
+}
+
+static bool breakpoint_in_range(const CPU *cpu, uint16_t start, uint16_t end) {
+    for (uint32_t addr = start; addr < end; addr++) {
+        if (cpu_is_breakpoint(cpu, addr)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decode pc into a cache entry, applying fusion, breakpoints and timer polls
+void cpu_fill_decode_entry(CPU *cpu, uint16_t pc, DecodedInsn *entry) {
+    cpu_decode(cpu, pc, entry);
+    if (cpu->breakpoint_count > 0 && cpu_is_breakpoint(cpu, pc)) {
+        entry->breakpoint = true;
+        entry->handler = op_breakpoint;
+    } else if (cpu->idle_skip && entry->opcode == OP_LOAD && entry->mode == MODE_DIRECT &&
+               entry->operand == TIMER_ADDR) {
+        entry->timer_poll = true;
+        entry->handler = cpu_idle_poll;
+    } else if (cpu->fusion && !cpu->profile) {
+        // The profiler counts instructions one by one, so it runs unfused
+        cpu_fuse(cpu, entry);
+        // A group must not run past a breakpoint inside it
+        if (entry->fusion && cpu->breakpoint_count > 0 &&
+            breakpoint_in_range(cpu, pc + 1, pc + entry->length)) {
+            cpu_decode(cpu, pc, entry);
+        }
+    }
+    cpu->code_pages[pc >> 8] |= CODE_PAGE_DECODED;
+    cpu->code_pages[(pc + entry->length - 1) >> 8] |= CODE_PAGE_DECODED;
+}
+
+// Look up the decoded instruction at pc, decoding it on a miss
+const DecodedInsn *cpu_decode_cached(CPU *cpu, uint16_t pc, DecodedInsn *scratch) {
+    DecodedInsn *entry = &cpu->decode_cache[pc & (DECODE_CACHE_SIZE - 1)];
+    if (entry->length != 0 && entry->pc == pc) {
+        return entry;
+    }
+
+    // Code overlapping device pages is never cached so device reads keep their side effects
+    if (pc > cpu->mmio_base - MAX_INSN_LENGTH) {
+        cpu_decode(cpu, pc, scratch);
+        if (cpu->breakpoint_count > 0 && cpu_is_breakpoint(cpu, pc)) {
+            scratch->breakpoint = true;
+            scratch->handler = op_breakpoint;
+        }
+        return scratch;
+    }
+
+    cpu_fill_decode_entry(cpu, pc, entry);
+    return entry;
+}
+
 // Execute one instruction (Fetch-Decode-Execute cycle)
 void cpu_step(CPU *cpu) {
     if (!cpu->running || get_flag(cpu, FLAG_HALT)) {
         return;
     }
-    
-    // FETCH
-    uint8_t instruction = mem_read8(cpu, cpu->regs.PC++);
-    uint8_t opcode = (instruction >> 2) & 0x3F;  // Upper 6 bits
-    uint8_t mode = instruction & 0x03;            // Lower 2 bits
-    
-    cpu->cycles++;
-    
-    // DECODE & EXECUTE
-    uint16_t operand = 0;
-    uint16_t address = 0;
-    uint16_t *reg_ptr = NULL;
 
-    // Only fetch operands for instructions that need them
-    // NOP, HALT, RET, NOT, POP don't need operands
-    bool needs_operand = true;
-    if (opcode == OP_NOP || opcode == OP_HALT || opcode == OP_RET ||
-        opcode == OP_NOT || (opcode == OP_POP && mode == MODE_IMMEDIATE)) {
-        needs_operand = false;
-    }
-
-    // Get operand based on addressing mode
-    if (needs_operand) {
-        switch (mode) {
-            case MODE_IMMEDIATE:
-                operand = mem_read16(cpu, cpu->regs.PC);
-                cpu->regs.PC += 2;
-                break;
-
-            case MODE_DIRECT:
-                address = mem_read16(cpu, cpu->regs.PC);
-                cpu->regs.PC += 2;
-                operand = mem_read16(cpu, address);
-                break;
-
-            case MODE_REGISTER:
-                {
-                    uint8_t reg_num = mem_read8(cpu, cpu->regs.PC++);
-                    reg_ptr = get_register(cpu, reg_num);
-                    operand = *reg_ptr;
-                }
-                break;
-
-            case MODE_INDIRECT:
-                {
-                    uint8_t reg_num = mem_read8(cpu, cpu->regs.PC++);
-                    address = *get_register(cpu, reg_num);
-                    operand = mem_read16(cpu, address);
-                }
-                break;
+    // FETCH & DECODE (served from the decode cache when possible)
+    DecodedInsn scratch;
+    const DecodedInsn *insn = cpu_decode_cached(cpu, cpu->regs.PC, &scratch);
+    cpu->regs.PC += insn->length;
+
+    cpu->cycles += insn->cost;
+    cpu->instructions++;
+
+    // EXECUTE
+    insn->handler(cpu, insn);
+    if (!cpu->running) {
+        cpu_rewind_io_wait(cpu, insn);
+    }
+}
+
+// Stop the running engine after the current instruction
+void cpu_stop(CPU *cpu, CpuExitReason reason) {
+    cpu->running = false;
+    cpu->exit_reason = reason;
+    cpu->run_until = 0;
+}
+
+// A device stopped the CPU with CPU_EXIT_IO_WAIT while insn ran. LOAD and IN
+// only write A and FLAGS, so they are rolled back and re-execute on resume;
+// other instructions complete with whatever the device returned.
+bool cpu_io_wait_repeats(const CPU *cpu, const DecodedInsn *insn) {
+    return cpu->exit_reason == CPU_EXIT_IO_WAIT && insn->fusion == FUSION_NONE &&
+           (insn->opcode == OP_LOAD || insn->opcode == OP_IN);
+}
+
+void cpu_rewind_io_wait(CPU *cpu, const DecodedInsn *insn) {
+    if (cpu_io_wait_repeats(cpu, insn)) {
+        cpu->regs.PC = insn->pc;
+        cpu->cycles -= insn->cost;
+        cpu->instructions--;
+    }
+}
+
+// Breakpoints stop execution before the instruction at addr
+bool cpu_set_breakpoint(CPU *cpu, uint16_t addr) {
+    if (cpu_is_breakpoint(cpu, addr)) {
+        return false;
+    }
+    cpu->breakpoints[addr >> 3] |= 1 << (addr & 7);
+    cpu->breakpoint_count++;
+    if (cpu->code_pages[addr >> 8]) {
+        code_page_write(cpu, addr);
+    }
+    return true;
+}
+
+bool cpu_clear_breakpoint(CPU *cpu, uint16_t addr) {
+    if (!cpu_is_breakpoint(cpu, addr)) {
+        return false;
+    }
+    cpu->breakpoints[addr >> 3] &= ~(1 << (addr & 7));
+    cpu->breakpoint_count--;
+    if (cpu->code_pages[addr >> 8]) {
+        code_page_write(cpu, addr);
+    }
+    return true;
+}
+
+bool cpu_is_breakpoint(const CPU *cpu, uint16_t addr) {
+    return (cpu->breakpoints[addr >> 3] >> (addr & 7)) & 1;
+}
+
+// Select the core used by cpu_run
+void cpu_set_engine(CPU *cpu, CpuEngine engine) {
+    cpu->engine = engine;
+}
+
+const char* cpu_engine_name(CpuEngine engine) {
+    switch (engine) {
+        case CPU_ENGINE_INTERP: return "interp";
+        case CPU_ENGINE_THREADED: return "threaded";
+        case CPU_ENGINE_JIT: return "jit";
+        default: return "unknown";
+    }
+}
+
+// Run for at most budget cycles and report why execution stopped. The check
+// sits between dispatches, so the last instruction (or superinstruction) may
+// end past the budget by up to its cost less one.
+CpuExitReason cpu_run_for(CPU *cpu, uint64_t budget) {
+    if (get_flag(cpu, FLAG_HALT)) {
+        cpu->running = false;
+        cpu->exit_reason = CPU_EXIT_HALTED;
+        return CPU_EXIT_HALTED;
+    }
+
+    bool resume_breakpoint = (cpu->exit_reason == CPU_EXIT_BREAKPOINT &&
+                              cpu_is_breakpoint(cpu, cpu->regs.PC));
+    cpu->running = true;
+    cpu->exit_reason = CPU_EXIT_BUDGET;
+    uint64_t end = (budget > UINT64_MAX - cpu->cycles) ? UINT64_MAX : cpu->cycles + budget;
+    cpu->run_until = end;
+
+    // Resuming at the breakpoint we stopped on: run that instruction first
+    if (resume_breakpoint && budget > 0) {
+        DecodedInsn insn;
+        cpu_decode(cpu, cpu->regs.PC, &insn);
+        cpu->regs.PC += insn.length;
+        cpu->cycles += insn.cost;
+        cpu->instructions++;
+        insn.handler(cpu, &insn);
+        if (!cpu->running) {
+            cpu_rewind_io_wait(cpu, &insn);
+            cpu_flush_devices(cpu);
+            return cpu->exit_reason;
         }
     }
-    
-    // Execute instruction
-    switch (opcode) {
-        case OP_NOP:
-            break;
-            
-        case OP_LOAD:
-            cpu->regs.A = operand;
-            update_flags(cpu, cpu->regs.A);
-            break;
-            
-        case OP_STORE:
-            if (mode == MODE_DIRECT) {
-                mem_write16(cpu, address, cpu->regs.A);
-            } else if (mode == MODE_INDIRECT) {
-                mem_write16(cpu, address, cpu->regs.A);
-            }
-            break;
-            
-        case OP_MOV:
-            if (mode == MODE_REGISTER) {
-                uint8_t dest_reg = mem_read8(cpu, cpu->regs.PC++);
-                uint16_t *dest = get_register(cpu, dest_reg);
-                *dest = operand;
-                update_flags(cpu, *dest);
-            }
-            break;
-            
-        case OP_PUSH:
-            stack_push16(cpu, operand);
-            break;
-            
-        case OP_POP:
-            cpu->regs.A = stack_pop16(cpu);
-            update_flags(cpu, cpu->regs.A);
+
+    // Engines run in slices that end where an interrupt may be due
+    do {
+        cpu_service_interrupts(cpu, end);
+        if (!cpu->running) {
             break;
-            
-        case OP_ADD:
-            {
-                uint32_t result = cpu->regs.A + operand;
-                if (result > 0xFFFF) {
-                    set_flag(cpu, FLAG_CARRY);
-                } else {
-                    clear_flag(cpu, FLAG_CARRY);
-                }
-                cpu->regs.A = result & 0xFFFF;
-                update_flags(cpu, cpu->regs.A);
+        }
+        if (cpu->profile && (cpu->trace || cpu->engine == CPU_ENGINE_INTERP)) {
+            // Counting loop in profile.c (it also traces)
+            cpu_run_profiled(cpu);
+        } else if (cpu->trace) {
+            cpu_run_traced(cpu);
+        } else if (cpu->engine == CPU_ENGINE_INTERP) {
+            DecodedInsn scratch;
+            const DecodedInsn *insn = NULL;
+            while (cpu->cycles < cpu->run_until) {
+                insn = cpu_decode_cached(cpu, cpu->regs.PC, &scratch);
+                cpu->regs.PC += insn->length;
+                cpu->cycles += insn->cost;
+                cpu->instructions++;
+                insn->handler(cpu, insn);
             }
-            break;
-            
-        case OP_SUB:
-            {
-                int32_t result = cpu->regs.A - operand;
-                if (result < 0) {
-                    set_flag(cpu, FLAG_CARRY);
-                } else {
-                    clear_flag(cpu, FLAG_CARRY);
-                }
-                cpu->regs.A = result & 0xFFFF;
-                update_flags(cpu, cpu->regs.A);
+            if (insn) {
+                cpu_rewind_io_wait(cpu, insn);
             }
-            break;
-            
-        case OP_INC:
-            if (mode == MODE_REGISTER && reg_ptr) {
-                (*reg_ptr)++;
-                update_flags(cpu, *reg_ptr);
+        } else {
+            // The threaded and JIT cores keep FLAGS up to date themselves.
+            // Only the threaded core counts for the profiler, so it stands
+            // in for the JIT while profiling.
+            bool lazy = cpu->lazy_flags;
+            cpu_set_lazy_flags(cpu, false);
+            if (cpu->engine == CPU_ENGINE_THREADED || cpu->profile) {
+                cpu_run_threaded(cpu);
             } else {
-                cpu->regs.A++;
-                update_flags(cpu, cpu->regs.A);
+                cpu_run_jit(cpu);
             }
-            break;
-            
-        case OP_DEC:
-            if (mode == MODE_REGISTER && reg_ptr) {
-                (*reg_ptr)--;
-                update_flags(cpu, *reg_ptr);
-            } else {
-                cpu->regs.A--;
-                update_flags(cpu, cpu->regs.A);
-            }
-            break;
-            
-        case OP_MUL:
-            cpu->regs.A = (cpu->regs.A * operand) & 0xFFFF;
-            update_flags(cpu, cpu->regs.A);
-            break;
-            
-        case OP_DIV:
-            if (operand != 0) {
-                cpu->regs.A = cpu->regs.A / operand;
-                update_flags(cpu, cpu->regs.A);
-            }
-            break;
-            
-        case OP_AND:
-            cpu->regs.A &= operand;
-            update_flags(cpu, cpu->regs.A);
-            break;
-            
-        case OP_OR:
-            cpu->regs.A |= operand;
-            update_flags(cpu, cpu->regs.A);
-            break;
-            
-        case OP_XOR:
-            cpu->regs.A ^= operand;
-            update_flags(cpu, cpu->regs.A);
-            break;
-            
-        case OP_NOT:
-            cpu->regs.A = ~cpu->regs.A;
-            update_flags(cpu, cpu->regs.A);
-            break;
-            
-        case OP_SHL:
-            cpu->regs.A <<= operand;
-            update_flags(cpu, cpu->regs.A);
-            break;
-            
-        case OP_SHR:
-            cpu->regs.A >>= operand;
-            update_flags(cpu, cpu->regs.A);
-            break;
-            
-        case OP_CMP:
-            {
-                int32_t result = cpu->regs.A - operand;
-                if (result < 0) {
-                    set_flag(cpu, FLAG_CARRY);
-                } else {
-                    clear_flag(cpu, FLAG_CARRY);
-                }
-                update_flags(cpu, result & 0xFFFF);
-            }
-            break;
-            
-        case OP_TEST:
-            {
-                uint16_t result = cpu->regs.A & operand;
-                update_flags(cpu, result);
-            }
-            break;
-            
-        case OP_JMP:
-            cpu->regs.PC = operand;
-            break;
-            
-        case OP_JZ:
-            if (get_flag(cpu, FLAG_ZERO)) {
-                cpu->regs.PC = operand;
-            }
-            break;
-            
-        case OP_JNZ:
-            if (!get_flag(cpu, FLAG_ZERO)) {
-                cpu->regs.PC = operand;
-            }
-            break;
-            
-        case OP_JC:
-            if (get_flag(cpu, FLAG_CARRY)) {
-                cpu->regs.PC = operand;
-            }
-            break;
-            
-        case OP_JNC:
-            if (!get_flag(cpu, FLAG_CARRY)) {
-                cpu->regs.PC = operand;
-            }
-            break;
-            
-        case OP_CALL:
-            stack_push16(cpu, cpu->regs.PC);
-            cpu->regs.PC = operand;
-            break;
-            
-        case OP_RET:
-            cpu->regs.PC = stack_pop16(cpu);
-            break;
-            
-        case OP_HALT:
-            set_flag(cpu, FLAG_HALT);
-            cpu->running = false;
-            printf("\n[CPU HALTED after %llu cycles]\n", 
-                   (unsigned long long)cpu->cycles);
-            break;
-            
-        case OP_IN:
-            cpu->regs.A = mem_read8(cpu, IO_START + operand);
-            update_flags(cpu, cpu->regs.A);
-            break;
-            
-        case OP_OUT:
-            mem_write8(cpu, IO_START + 1, cpu->regs.A & 0xFF);
-            break;
-            
-        default:
-            fprintf(stderr, "Unknown opcode: 0x%02X at PC=0x%04X\n", 
-                    opcode, cpu->regs.PC - 1);
-            cpu->running = false;
-            break;
+            cpu->lazy_flags = lazy;
+        }
+    } while (cpu->running && cpu->cycles < end);
+
+    if (cpu->exit_reason == CPU_EXIT_BUDGET) {
+        cpu->running = false;
     }
+    cpu_flush_devices(cpu);
+    return cpu->exit_reason;
 }
 
 // Run CPU until halt
 void cpu_run(CPU *cpu) {
-    cpu->running = true;
-    while (cpu->running && !get_flag(cpu, FLAG_HALT)) {
-        cpu_step(cpu);
+    cpu_run_for(cpu, UINT64_MAX);
+}
+
+const char* cpu_exit_reason_name(CpuExitReason reason) {
+    switch (reason) {
+        case CPU_EXIT_HALTED: return "halted";
+        case CPU_EXIT_BUDGET: return "budget exhausted";
+        case CPU_EXIT_UNKNOWN_OPCODE: return "unknown opcode";
+        case CPU_EXIT_BREAKPOINT: return "breakpoint";
+        case CPU_EXIT_IO_WAIT: return "I/O wait";
+        case CPU_EXIT_DEADLOCK: return "deadlock";
+        default: return "unknown";
     }
 }
 
@@ -427,7 +1085,7 @@ void cpu_dump_registers(const CPU *cpu) {
     printf("PC: 0x%04X   SP: 0x%04X\n", cpu->regs.PC, cpu->regs.SP);
     printf("A:  0x%04X   B:  0x%04X\n", cpu->regs.A, cpu->regs.B);
     printf("C:  0x%04X   D:  0x%04X\n", cpu->regs.C, cpu->regs.D);
-    printf("FLAGS: 0x%02X [", cpu->regs.FLAGS);
+    printf("FLAGS: 0x%02X [", cpu_flags(cpu));
     if (get_flag(cpu, FLAG_ZERO)) printf("Z");
     if (get_flag(cpu, FLAG_CARRY)) printf("C");
     if (get_flag(cpu, FLAG_NEGATIVE)) printf("N");
@@ -435,6 +1093,24 @@ void cpu_dump_registers(const CPU *cpu) {
     if (get_flag(cpu, FLAG_HALT)) printf("H");
     printf("]\n");
     printf("Cycles: %llu\n", (unsigned long long)cpu->cycles);
+    if (cpu->instructions != cpu->cycles) {
+        printf("Instructions: %llu\n", (unsigned long long)cpu->instructions);
+    }
+}
+
+// Dump superinstruction hit counts
+void cpu_dump_fusion_stats(const CPU *cpu) {
+    uint64_t saved = 0;
+    printf("\n=== Fusion Statistics ===\n");
+    for (int kind = FUSION_NONE + 1; kind < FUSION_KIND_COUNT; kind++) {
+        int folded = (kind == FUSION_CMP0_JZ || kind == FUSION_CMP0_JNZ ||
+                      kind == FUSION_LOAD_ADD || kind == FUSION_LOAD_SUB) ? 1 : 2;
+        printf("%-18s %llu\n", get_fusion_name(kind),
+               (unsigned long long)cpu->fusion_hits[kind]);
+        saved += cpu->fusion_hits[kind] * folded;
+    }
+    printf("Dispatches: %llu for %llu instructions\n",
+           (unsigned long long)(cpu->instructions - saved), (unsigned long long)cpu->instructions);
 }
 
 // Dump memory contents with ASCII representation
@@ -507,6 +1183,25 @@ const char* get_opcode_name(uint8_t opcode) {
         case OP_HALT: return "HALT";
         case OP_IN: return "IN";
         case OP_OUT: return "OUT";
+        case OP_IRET: return "IRET";
+        case OP_EI: return "EI";
+        case OP_DI: return "DI";
+        case OP_WAIT: return "WAIT";
+        default: return "UNKNOWN";
+    }
+}
+
+// Get superinstruction name as string
+const char* get_fusion_name(uint8_t fusion) {
+    switch (fusion) {
+        case FUSION_NONE: return "NONE";
+        case FUSION_CMP0_JZ: return "CMP#0+JZ";
+        case FUSION_CMP0_JNZ: return "CMP#0+JNZ";
+        case FUSION_LOAD_ADD: return "LOAD+ADD";
+        case FUSION_LOAD_SUB: return "LOAD+SUB";
+        case FUSION_LOAD_ADD_MOV: return "LOAD+ADD+MOV";
+        case FUSION_LOAD_SUB_MOV: return "LOAD+SUB+MOV";
+        case FUSION_COUNTDOWN: return "LOAD+SUB#1+MOV";
         default: return "UNKNOWN";
     }
 }
@@ -543,3 +1238,39 @@ const char* get_instruction_name(uint8_t opcode, uint8_t mode) {
     // Default: return base name
     return base_name;
 }
+
+// Format the instruction at pc in assembler syntax and return its length.
+// Reads cpu->memory directly, so no device is touched.
+int cpu_disassemble(const CPU *cpu, uint16_t pc, char *buffer, size_t size) {
+    static const char *const reg_names[4] = { "A", "B", "C", "D" };
+    uint8_t instruction = cpu->memory[pc];
+    uint8_t opcode = (instruction >> 2) & 0x3F;
+    uint8_t mode = instruction & 0x03;
+    const char *name = get_opcode_name(opcode);
+    uint8_t byte1 = cpu->memory[(uint16_t)(pc + 1)];
+    uint8_t byte2 = cpu->memory[(uint16_t)(pc + 2)];
+
+    if (!has_operand(opcode, mode)) {
+        snprintf(buffer, size, "%s", name);
+        return 1;
+    }
+    switch (mode) {
+        case MODE_IMMEDIATE:
+            snprintf(buffer, size, "%s #0x%04X", name, byte1 | (byte2 << 8));
+            return 3;
+        case MODE_DIRECT:
+            snprintf(buffer, size, "%s 0x%04X", name, byte1 | (byte2 << 8));
+            return 3;
+        case MODE_REGISTER:
+            if (opcode == OP_MOV) {
+                snprintf(buffer, size, "%s %s %s", name, reg_names[register_index(byte1)],
+                         reg_names[register_index(byte2)]);
+                return 3;
+            }
+            snprintf(buffer, size, "%s %s", name, reg_names[register_index(byte1)]);
+            return 2;
+        default:
+            snprintf(buffer, size, "%s [%s]", name, reg_names[register_index(byte1)]);
+            return 2;
+    }
+}
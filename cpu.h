@@ -3,12 +3,15 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 // Memory configuration
 #define MEMORY_SIZE 65536  // 64KB of memory
 #define IO_START 0xFF00    // Memory-mapped I/O starts here
 #define STACK_START 0xFEFF // Stack grows downward from here
 #define TIMER_ADDR 0xFF03  // Hardware timer (returns milliseconds since init)
+#define CPU_DEFAULT_CLOCK_HZ 1000000  // Emulated clock for the virtual timer
+#define TIMER_SLICE_CYCLES 4096       // Wall-clock timer samples the host clock at most this often
 
 // Register definitions
 typedef struct {
@@ -26,6 +29,7 @@ typedef struct {
 #define FLAG_CARRY    0x02  // Carry flag
 #define FLAG_NEGATIVE 0x04  // Negative flag
 #define FLAG_OVERFLOW 0x08  // Overflow flag
+#define FLAG_INTERRUPT 0x10 // Interrupts enabled (EI / DI)
 #define FLAG_HALT     0x80  // Halt flag
 
 // Instruction format: [OPCODE:6 bits][MODE:2 bits] [OPERAND: 0-16 bits]
@@ -72,6 +76,12 @@ typedef enum {
     OP_HALT = 27,       // Halt execution
     OP_IN = 28,         // Input from I/O port
     OP_OUT = 29,        // Output to I/O port
+
+    // Interrupts (30-33)
+    OP_IRET = 30,       // Return from interrupt handler
+    OP_EI = 31,         // Enable interrupts
+    OP_DI = 32,         // Disable interrupts
+    OP_WAIT = 33,       // Sleep until an interrupt source is pending
 } Opcode;
 
 // Addressing modes (2 bits = 4 modes)
@@ -82,25 +92,293 @@ typedef enum {
     MODE_INDIRECT = 3,   // Indirect through register
 } AddressingMode;
 
-// CPU structure
+// Decoded instruction cache (direct-mapped, keyed by PC)
+#define DECODE_CACHE_SIZE 4096  // Entries; must be a power of two
+#define MAX_INSN_LENGTH 3       // Longest encoding: opcode + 2 operand bytes
+#define MAX_FUSED_LENGTH 8      // Longest fused group: LOAD reg / SUB #imm / MOV reg reg
+
+// code_pages flags: which caches hold code from a 256-byte page
+#define CODE_PAGE_DECODED 0x01  // Decode-cache entries
+#define CODE_PAGE_JIT     0x02  // JIT translations
+#define CODE_PAGE_BUNDLE  0x04  // Lockstep bundle decodes (bundle.c)
+
+typedef struct CPU CPU;
+typedef struct DecodedInsn DecodedInsn;
+typedef void (*InsnHandler)(CPU *cpu, const DecodedInsn *insn);
+
+// Superinstructions: common sequences executed as one dispatch
+typedef enum {
+    FUSION_NONE = 0,
+    FUSION_CMP0_JZ,        // CMP #0 / JZ #target
+    FUSION_CMP0_JNZ,       // CMP #0 / JNZ #target
+    FUSION_LOAD_ADD,       // LOAD reg / ADD x
+    FUSION_LOAD_SUB,       // LOAD reg / SUB x
+    FUSION_LOAD_ADD_MOV,   // LOAD reg / ADD x / MOV A reg
+    FUSION_LOAD_SUB_MOV,   // LOAD reg / SUB x / MOV A reg
+    FUSION_COUNTDOWN,      // LOAD reg / SUB #1 / MOV A reg (same reg)
+    FUSION_KIND_COUNT
+} FusionKind;
+
+struct DecodedInsn {
+    InsnHandler handler;  // Execute routine for this opcode
+    const void *label;    // Threaded-dispatch target (filled by the threaded engine)
+    uint16_t pc;          // Address of the instruction (cache tag)
+    uint16_t operand;     // Immediate value, address or register number (0-3)
+    uint8_t opcode;
+    uint8_t mode;
+    uint8_t length;       // Encoded size in bytes; 0 marks an empty entry
+    uint8_t dest_reg;     // Destination register for MOV
+    uint8_t fusion;       // FusionKind; FUSION_NONE for a single instruction
+    uint8_t cost;         // Cycles charged at dispatch (the whole group when fused)
+    bool breakpoint;      // Stops execution before this instruction runs
+    bool timer_poll;      // LOAD of TIMER_ADDR that may head an idle loop (idle.c)
+    uint8_t mode2;        // Fused ALU operand: addressing mode
+    uint16_t operand2;    // Fused ALU operand or branch target
+};
+
+// Execution engines selectable for cpu_run
+typedef enum {
+    CPU_ENGINE_INTERP = 0,    // Reference interpreter (cpu_step loop)
+    CPU_ENGINE_THREADED = 1,  // Direct-threaded computed-goto dispatch
+    CPU_ENGINE_JIT = 2,       // Hot basic blocks translated to x86-64
+} CpuEngine;
+
+typedef struct JitState JitState;
+
+// Time base of the TIMER_ADDR device
+typedef enum {
+    TIMER_WALL_CLOCK = 0,  // Host monotonic clock (default)
+    TIMER_VIRTUAL = 1,     // cpu->cycles at cpu->clock_hz: reproducible
+} TimerMode;
+typedef struct CpuSnapshot CpuSnapshot;
+typedef struct CpuProfile CpuProfile;
+typedef struct SymbolTable SymbolTable;
+typedef struct CpuTrace CpuTrace;
+
+// Why cpu_run_for returned
+typedef enum {
+    CPU_EXIT_HALTED = 0,       // HALT executed (or the CPU was already halted)
+    CPU_EXIT_BUDGET,           // Cycle budget used up
+    CPU_EXIT_UNKNOWN_OPCODE,   // Undefined opcode; PC is past it
+    CPU_EXIT_BREAKPOINT,       // PC is at a breakpoint that has not executed yet
+    CPU_EXIT_IO_WAIT,          // A device called cpu_stop; LOAD/IN will re-execute
+    CPU_EXIT_DEADLOCK,         // WAIT with no interrupt source that can fire
+} CpuExitReason;
+
+// Memory-mapped device. Callbacks receive the absolute guest address.
+typedef struct {
+    const char *name;
+    uint16_t base;      // First address claimed by the device
+    uint16_t size;      // Number of addresses claimed
+    uint8_t (*read8)(CPU *cpu, uint16_t addr, void *opaque);
+    void (*write8)(CPU *cpu, uint16_t addr, uint8_t value, void *opaque);
+    uint16_t (*read16)(CPU *cpu, uint16_t addr, void *opaque);  // Optional; NULL = two read8 calls
+    void *opaque;
+    void (*flush)(CPU *cpu, void *opaque);  // Optional; called on HALT and when a run returns
+} MmioDevice;
+
+#define MAX_MMIO_DEVICES 16
+
+// Console output (devices.c): bytes written to IO_START + 1 collect in a
+// ring buffer that is written out on newline, when full, on HALT, when a run
+// returns, before console input is read, or on any write to the flush port
+#define CONSOLE_BUFFER_SIZE 4096
+#define CONSOLE_FLUSH_PORT (IO_START + 2)
+#define CONSOLE_CAPTURE (-1)  // ConsoleOutput.fd: keep output in memory
+
+typedef struct {
+    int fd;               // Destination file descriptor, or CONSOLE_CAPTURE
+    bool buffered;        // false: write every byte as it arrives (interactive use)
+    uint8_t ring[CONSOLE_BUFFER_SIZE];
+    uint32_t head;        // Oldest byte not yet written out
+    uint32_t count;       // Bytes waiting in ring
+    char *capture;        // CONSOLE_CAPTURE: everything flushed so far
+    size_t capture_len;
+    size_t capture_cap;
+} ConsoleOutput;
+
+// Console input from a tape instead of stdin. Reads of IO_START take the
+// next byte; CONSOLE_STATUS_PORT reports whether one is there. An open tape
+// can still grow with input_tape_append; a closed one ends with 0xFF bytes.
+#define CONSOLE_STATUS_PORT (IO_START + 5)
+#define INPUT_STATUS_EMPTY 0x00  // Open tape, nothing to read yet
+#define INPUT_STATUS_READY 0x01  // Next read returns a byte from the tape
+#define INPUT_STATUS_EOF   0xFF  // Closed tape fully read
+#define INPUT_NO_DATA      0x00  // Read of an empty open tape without io_wait
+
+typedef struct {
+    const uint8_t *data;  // Tape contents: caller's buffer, file mapping or owned copy
+    size_t len;
+    size_t pos;           // Next byte to read
+    bool closed;          // No more input will be appended
+    bool io_wait;         // Empty open tape: stop the CPU with CPU_EXIT_IO_WAIT
+    uint8_t *owned;       // Buffer grown by input_tape_append
+    size_t owned_cap;
+    void *mapping;        // mmap of the file from input_tape_open_file
+    size_t mapping_len;
+} InputTape;
+
+// Interrupt controller (interrupts.c). Enabled sources raise bits in
+// pending; while FLAG_INTERRUPT is set, cpu_run_for takes the lowest one
+// between instructions: PC and FLAGS are pushed, FLAG_INTERRUPT is cleared
+// and PC loads from the source's entry in the vector table. IRET returns.
+#define IRQ_ENABLE_PORT  (IO_START + 8)   // Enabled sources (IRQ_* bits)
+#define IRQ_PENDING_PORT (IO_START + 9)   // Raised sources; writing 1 bits clears them
+#define IRQ_VECTOR_PORT  (IO_START + 10)  // 16-bit vector table address
+#define IRQ_COMPARE_PORT (IO_START + 12)  // 16-bit timer value that raises IRQ_TIMER
+#define IRQ_TIMER 0x01  // Timer reached the compare value (once per compare write)
+#define IRQ_INPUT 0x02  // Input ready: CONSOLE_STATUS_PORT reads INPUT_STATUS_READY
+#define IRQ_SOURCE_COUNT 2
+
 typedef struct {
+    uint8_t enable;
+    uint8_t pending;
+    uint16_t vectors;         // Table of IRQ_SOURCE_COUNT handler addresses
+    uint16_t compare;
+    bool compare_armed;       // IRQ_TIMER not yet raised for this compare value
+    uint64_t deadline_ms;     // Timer reading (not wrapped) the compare value stands for
+} InterruptController;
+
+// Operation behind pending lazy C/O flags
+typedef enum {
+    LAZY_ADD = 0,  // lazy_src + lazy_operand
+    LAZY_SUB = 1,  // lazy_src - lazy_operand (SUB and CMP)
+} LazyFlagsOp;
+
+// CPU structure
+struct CPU {
     Registers regs;
     uint8_t memory[MEMORY_SIZE];
     bool running;
-    uint64_t cycles;
+    bool quiet;               // Suppress halt / unknown-opcode messages
+    uint64_t cycles;          // Weighted by the cycle cost model (costs.c)
+    uint64_t instructions;    // Guest instructions executed
+    uint8_t cycle_costs[256]; // Cycles per instruction byte, RAM accesses included
+    uint8_t mmio_cost;        // Extra cycles per device access
     uint64_t timer_start_ms;  // Timer initialization timestamp
-} CPU;
+    TimerMode timer_mode;
+    uint64_t clock_hz;        // Cycles per emulated second (TIMER_VIRTUAL)
+    uint64_t timer_sample_ms;     // Last host clock reading (TIMER_WALL_CLOCK)
+    uint64_t timer_sample_cycles; // cycles at that reading
+    uint8_t *page_table[MEMORY_SIZE / 256];  // RAM for each 256-byte page; NULL = device page
+    uint16_t mmio_base;       // Lowest device-page address (caches treat everything above as I/O)
+    MmioDevice devices[MAX_MMIO_DEVICES];
+    int device_count;
+    ConsoleOutput console;    // Default console output on stdout
+    InterruptController irq;
+    bool waiting;             // WAIT executed; no enabled source pending yet
+    uint64_t interrupts;      // Interrupts taken
+    uint64_t wait_cycles;     // Cycles skipped in the WAIT state
+    uint64_t run_until;       // Engines stop once cycles reaches this (0 after cpu_stop)
+    CpuExitReason exit_reason;
+    uint8_t breakpoints[MEMORY_SIZE / 8];  // One bit per address
+    int breakpoint_count;
+    CpuEngine engine;         // Core used by cpu_run
+    DecodedInsn decode_cache[DECODE_CACHE_SIZE];
+    uint8_t code_pages[MEMORY_SIZE / 256];  // CODE_PAGE_* flags per 256-byte page
+    uint64_t code_writes;     // Writes that hit cached code, plus full invalidations
+    JitState *jit;            // Translation cache, allocated on first JIT run
+    CpuSnapshot *snapshot;    // State saved by cpu_snapshot, allocated on first use
+    CpuProfile *profile;      // Execution counts while profiling (profile.c); NULL = off
+    CpuTrace *trace;          // Binary trace being written (trace.c); NULL = off
+    uint64_t dirty_pages[MEMORY_SIZE / 256 / 64];  // Pages written since the snapshot (all set without one)
+    bool fusion;              // Decode common sequences into superinstructions
+    uint64_t fusion_hits[FUSION_KIND_COUNT];
+    bool idle_skip;           // Fast-forward loops that only poll the timer
+    uint64_t idle_skips;      // Idle loops fast-forwarded
+    uint64_t idle_cycles;     // Cycles accounted without executing
+    bool lazy_flags;          // Record flag inputs; compute FLAGS only when read
+    uint8_t flags_pending;    // FLAGS bits not yet materialised from the fields below
+    uint8_t lazy_op;          // LazyFlagsOp for pending C/O
+    uint16_t lazy_result;     // Last flag-setting result (Z, N)
+    uint16_t lazy_src;        // Operands of the last ADD/SUB/CMP (C, O)
+    uint16_t lazy_operand;
+};
 
 // Function declarations
 void cpu_init(CPU *cpu);
+void cpu_free(CPU *cpu);
 void cpu_reset(CPU *cpu);
-void cpu_load_program(CPU *cpu, const uint8_t *program, uint16_t size, uint16_t start_addr);
+void cpu_load_program(CPU *cpu, const uint8_t *program, size_t size, uint16_t start_addr);
+uint8_t *cpu_read_program(const char *path, size_t *size, const char **error);
 void cpu_step(CPU *cpu);
 void cpu_run(CPU *cpu);
+CpuExitReason cpu_run_for(CPU *cpu, uint64_t budget);
+void cpu_stop(CPU *cpu, CpuExitReason reason);
+const char* cpu_exit_reason_name(CpuExitReason reason);
+bool cpu_set_breakpoint(CPU *cpu, uint16_t addr);
+bool cpu_clear_breakpoint(CPU *cpu, uint16_t addr);
+bool cpu_is_breakpoint(const CPU *cpu, uint16_t addr);
+
+// Engine loops for cpu_run_for: run until cycles reaches cpu->run_until
+void cpu_run_threaded(CPU *cpu);
+void cpu_run_jit(CPU *cpu);
+void cpu_set_engine(CPU *cpu, CpuEngine engine);
+const char* cpu_engine_name(CpuEngine engine);
 void cpu_dump_registers(const CPU *cpu);
 void cpu_dump_memory(const CPU *cpu, uint16_t start, uint16_t length);
 const char* get_opcode_name(uint8_t opcode);
 const char* get_instruction_name(uint8_t opcode, uint8_t mode);
+int cpu_disassemble(const CPU *cpu, uint16_t pc, char *buffer, size_t size);
+
+// Decoded instruction cache
+void cpu_decode(CPU *cpu, uint16_t pc, DecodedInsn *insn);
+void cpu_fill_decode_entry(CPU *cpu, uint16_t pc, DecodedInsn *entry);
+const DecodedInsn *cpu_decode_cached(CPU *cpu, uint16_t pc, DecodedInsn *scratch);
+bool cpu_io_wait_repeats(const CPU *cpu, const DecodedInsn *insn);
+void cpu_rewind_io_wait(CPU *cpu, const DecodedInsn *insn);
+void cpu_invalidate_decode_cache(CPU *cpu);
+void cpu_fuse(CPU *cpu, DecodedInsn *insn);
+void cpu_set_fusion(CPU *cpu, bool enabled);
+void cpu_dump_fusion_stats(const CPU *cpu);
+const char* get_fusion_name(uint8_t fusion);
+
+// Copy-on-write snapshots (snapshot.c)
+bool cpu_snapshot(CPU *cpu);
+bool cpu_restore(CPU *cpu);
+void cpu_drop_snapshot(CPU *cpu);
+void snapshot_page_write(CPU *cpu, uint8_t page);
+void cpu_invalidate_code(CPU *cpu, uint16_t addr);
+
+// Cycle cost model (costs.c): cycles per opcode and addressing mode, plus
+// extra cycles per RAM or stack access and per device access. The default
+// charges one cycle per instruction and nothing for accesses.
+typedef struct {
+    uint8_t base[64][4];  // [opcode][mode]; at least 1
+    uint8_t memory;       // Per RAM access: DIRECT / INDIRECT operands and the stack
+    uint8_t mmio;         // Per device access, on top of memory
+} CycleCostModel;
+
+void cycle_costs_default(CycleCostModel *model);
+bool cycle_costs_load(CycleCostModel *model, const char *path);
+void cpu_set_cycle_costs(CPU *cpu, const CycleCostModel *model);
+
+// Idle-loop fast-forward (idle.c)
+void cpu_idle_poll(CPU *cpu, const DecodedInsn *insn);
+void cpu_set_idle_skip(CPU *cpu, bool enabled);
+void cpu_dump_idle_stats(const CPU *cpu);
+uint64_t cpu_idle_sleep(CPU *cpu, uint64_t wait_ms, uint64_t max_cycles);
+
+// Execution profiler (profile.c)
+bool cpu_set_profiling(CPU *cpu, bool enabled);
+void cpu_run_profiled(CPU *cpu);
+void profile_retire(CPU *cpu, const DecodedInsn *insn);
+void profile_end_slice(CPU *cpu);
+void profile_mmio_access(CPU *cpu, const MmioDevice *device, bool write);
+void profile_interrupt(CPU *cpu);
+void cpu_dump_profile(const CPU *cpu, int top, const SymbolTable *symbols);
+bool cpu_write_folded_stacks(const CPU *cpu, const SymbolTable *symbols, const char *path);
+
+// Execution trace (trace.c)
+bool cpu_trace_start(CPU *cpu, const char *path);
+bool cpu_trace_stop(CPU *cpu);
+void cpu_run_traced(CPU *cpu);
+void trace_record(CPU *cpu, const DecodedInsn *insn);
+
+// JIT translation cache (jit.c)
+void jit_invalidate_addr(CPU *cpu, uint16_t addr);
+void jit_flush(CPU *cpu);
+void jit_free(CPU *cpu);
 
 // Memory operations
 uint8_t mem_read8(CPU *cpu, uint16_t addr);
@@ -108,6 +386,37 @@ uint16_t mem_read16(CPU *cpu, uint16_t addr);
 void mem_write8(CPU *cpu, uint16_t addr, uint8_t value);
 void mem_write16(CPU *cpu, uint16_t addr, uint16_t value);
 
+// Memory-mapped devices
+bool cpu_map_device(CPU *cpu, const MmioDevice *device);
+const MmioDevice *cpu_find_device(const CPU *cpu, uint16_t addr);
+void cpu_flush_devices(CPU *cpu);
+void cpu_map_default_devices(CPU *cpu);  // Console, timer and interrupt controller (devices.c)
+void cpu_set_timer(CPU *cpu, TimerMode mode, uint64_t clock_hz);
+bool cpu_timer_is_default(const CPU *cpu);
+uint64_t cpu_timer_ms_at(const CPU *cpu, uint64_t cycles);
+uint64_t cpu_timer_sample(CPU *cpu);
+
+// Interrupts (interrupts.c)
+void cpu_map_interrupt_controller(CPU *cpu);
+void cpu_service_interrupts(CPU *cpu, uint64_t end);
+void cpu_interrupt_check(CPU *cpu);
+void cpu_dump_interrupt_stats(const CPU *cpu);
+
+// Console devices (devices.c)
+void console_output_init(ConsoleOutput *out, int fd, bool buffered);
+void console_output_write(ConsoleOutput *out, uint8_t value);
+void console_output_flush(ConsoleOutput *out);
+void console_output_set_buffered(ConsoleOutput *out, bool buffered);
+void console_output_free(ConsoleOutput *out);
+bool cpu_map_console_output(CPU *cpu, ConsoleOutput *out);
+void input_tape_init(InputTape *tape, const uint8_t *data, size_t len, bool closed);
+bool input_tape_open_file(InputTape *tape, const char *path);
+bool input_tape_append(InputTape *tape, const uint8_t *data, size_t len);
+void input_tape_close(InputTape *tape);
+void input_tape_free(InputTape *tape);
+bool cpu_map_input_tape(CPU *cpu, InputTape *tape);
+uint8_t cpu_input_status(CPU *cpu);
+
 // Stack operations
 void stack_push8(CPU *cpu, uint8_t value);
 void stack_push16(CPU *cpu, uint16_t value);
@@ -119,5 +428,9 @@ void set_flag(CPU *cpu, uint8_t flag);
 void clear_flag(CPU *cpu, uint8_t flag);
 bool get_flag(const CPU *cpu, uint8_t flag);
 void update_flags(CPU *cpu, uint16_t result);
+void update_arith_flags(CPU *cpu, LazyFlagsOp op, uint16_t src, uint16_t operand);
+uint8_t cpu_flags(const CPU *cpu);
+void cpu_sync_flags(CPU *cpu);
+void cpu_set_lazy_flags(CPU *cpu, bool enabled);
 
 #endif // CPU_H
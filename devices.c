@@ -0,0 +1,331 @@
+#define _POSIX_C_SOURCE 200809L
+#include "cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/uio.h>
+
+// Built-in memory-mapped devices. Each one is registered with
+// cpu_map_device, so the RAM fast path in cpu.c never tests for them.
+
+// Helper function to get current time in milliseconds
+static uint64_t get_time_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Console input: 0xFF00 reads a character from stdin
+static uint8_t console_read8(CPU *cpu, uint16_t addr, void *opaque) {
+    (void)opaque;
+    if (addr == IO_START) {
+        // Show any pending prompt before blocking
+        cpu_flush_devices(cpu);
+        return getchar();
+    }
+    return 0;
+}
+
+void console_output_init(ConsoleOutput *out, int fd, bool buffered) {
+    out->fd = fd;
+    out->buffered = buffered;
+    out->head = 0;
+    out->count = 0;
+    out->capture = NULL;
+    out->capture_len = 0;
+    out->capture_cap = 0;
+}
+
+// Append to the in-memory capture; returns bytes taken or -1
+static ssize_t capture_writev(ConsoleOutput *out, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if (out->capture_len + total > out->capture_cap) {
+        size_t capacity = out->capture_cap ? out->capture_cap : 256;
+        while (capacity < out->capture_len + total) {
+            capacity *= 2;
+        }
+        char *grown = realloc(out->capture, capacity);
+        if (!grown) {
+            return -1;
+        }
+        out->capture = grown;
+        out->capture_cap = capacity;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(out->capture + out->capture_len, iov[i].iov_base, iov[i].iov_len);
+        out->capture_len += iov[i].iov_len;
+    }
+    return total;
+}
+
+// Write out the ring: one writev covering both halves when it has wrapped
+void console_output_flush(ConsoleOutput *out) {
+    if (out->count == 0) {
+        return;
+    }
+    if (out->fd == STDOUT_FILENO) {
+        fflush(stdout);  // Keep ordering with the host's printf output
+    }
+    while (out->count > 0) {
+        uint32_t first = CONSOLE_BUFFER_SIZE - out->head;
+        if (first > out->count) {
+            first = out->count;
+        }
+        struct iovec iov[2] = {
+            { &out->ring[out->head], first },
+            { out->ring, out->count - first },
+        };
+        int iovcnt = out->count > first ? 2 : 1;
+        ssize_t written = out->fd == CONSOLE_CAPTURE ? capture_writev(out, iov, iovcnt)
+                                                     : writev(out->fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            out->count = 0;  // Nowhere to put it: drop rather than spin
+            break;
+        }
+        out->head = (out->head + written) % CONSOLE_BUFFER_SIZE;
+        out->count -= written;
+    }
+    out->head = 0;
+}
+
+void console_output_write(ConsoleOutput *out, uint8_t value) {
+    out->ring[(out->head + out->count) % CONSOLE_BUFFER_SIZE] = value;
+    out->count++;
+    if (!out->buffered || value == '\n' || out->count == CONSOLE_BUFFER_SIZE) {
+        console_output_flush(out);
+    }
+}
+
+void console_output_set_buffered(ConsoleOutput *out, bool buffered) {
+    console_output_flush(out);
+    out->buffered = buffered;
+}
+
+// Flush and release the capture buffer (the file descriptor stays open)
+void console_output_free(ConsoleOutput *out) {
+    console_output_flush(out);
+    free(out->capture);
+    out->capture = NULL;
+    out->capture_len = 0;
+    out->capture_cap = 0;
+}
+
+// Console output: 0xFF01 writes a character, any write to 0xFF02 flushes
+static void console_write8(CPU *cpu, uint16_t addr, uint8_t value, void *opaque) {
+    (void)cpu;
+    if (addr == IO_START + 1) {
+        console_output_write(opaque, value);
+    } else if (addr == CONSOLE_FLUSH_PORT) {
+        console_output_flush(opaque);
+    }
+}
+
+static void console_flush(CPU *cpu, void *opaque) {
+    (void)cpu;
+    console_output_flush(opaque);
+}
+
+// Send console output to out instead of the CPU's default stdout console
+bool cpu_map_console_output(CPU *cpu, ConsoleOutput *out) {
+    const MmioDevice device = {
+        "console-out", IO_START + 1, 2, NULL, console_write8, NULL, out, console_flush
+    };
+    return cpu_map_device(cpu, &device);
+}
+
+// Virtual timer reading at a given cycle count: cycles at clock_hz
+uint64_t cpu_timer_ms_at(const CPU *cpu, uint64_t cycles) {
+    return cycles / cpu->clock_hz * 1000 + cycles % cpu->clock_hz * 1000 / cpu->clock_hz;
+}
+
+// Read the host clock now (TIMER_WALL_CLOCK); returns milliseconds since init
+uint64_t cpu_timer_sample(CPU *cpu) {
+    cpu->timer_sample_ms = get_time_ms();
+    cpu->timer_sample_cycles = cpu->cycles;
+    return cpu->timer_sample_ms - cpu->timer_start_ms;
+}
+
+// Hardware timer: a 16-bit read of TIMER_ADDR returns milliseconds since init
+// (byte reads see 0)
+static uint16_t timer_read16(CPU *cpu, uint16_t addr, void *opaque) {
+    (void)addr;
+    (void)opaque;
+    uint64_t elapsed_ms;
+    if (cpu->timer_mode == TIMER_VIRTUAL) {
+        elapsed_ms = cpu_timer_ms_at(cpu, cpu->cycles);
+    } else {
+        // Wall clock, sampled at most once per TIMER_SLICE_CYCLES (cycles
+        // going backwards, as after cpu_restore, also resamples)
+        if (cpu->cycles - cpu->timer_sample_cycles >= TIMER_SLICE_CYCLES) {
+            cpu_timer_sample(cpu);
+        }
+        elapsed_ms = cpu->timer_sample_ms - cpu->timer_start_ms;
+    }
+    // Return lower 16 bits (wraps around every ~65 seconds)
+    return (uint16_t)(elapsed_ms & 0xFFFF);
+}
+
+// True while TIMER_ADDR is served by the built-in timer rather than a replacement
+bool cpu_timer_is_default(const CPU *cpu) {
+    const MmioDevice *device = cpu_find_device(cpu, TIMER_ADDR);
+    return device && device->read16 == timer_read16;
+}
+
+// Choose the timer's time base; clock_hz is the emulated clock for TIMER_VIRTUAL
+void cpu_set_timer(CPU *cpu, TimerMode mode, uint64_t clock_hz) {
+    cpu->timer_mode = mode;
+    cpu->clock_hz = clock_hz > 0 ? clock_hz : CPU_DEFAULT_CLOCK_HZ;
+    cpu->timer_sample_cycles = cpu->cycles;
+    cpu->timer_sample_ms = get_time_ms();
+}
+
+// Tape over an existing buffer (not copied; it must outlive the tape)
+void input_tape_init(InputTape *tape, const uint8_t *data, size_t len, bool closed) {
+    memset(tape, 0, sizeof(InputTape));
+    tape->data = data;
+    tape->len = len;
+    tape->closed = closed;
+}
+
+// Closed tape over a read-only mapping of a file
+bool input_tape_open_file(InputTape *tape, const char *path) {
+    input_tape_init(tape, NULL, 0, true);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    if (st.st_size > 0) {
+        void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        tape->mapping = mapping;
+        tape->mapping_len = st.st_size;
+        tape->data = mapping;
+        tape->len = st.st_size;
+    }
+    close(fd);
+    return true;
+}
+
+// Add input to an open tape; consumed bytes are dropped on the way
+bool input_tape_append(InputTape *tape, const uint8_t *data, size_t len) {
+    size_t remaining = tape->len - tape->pos;
+    if (tape->data != tape->owned || remaining + len > tape->owned_cap) {
+        size_t capacity = tape->owned_cap ? tape->owned_cap : 256;
+        while (capacity < remaining + len) {
+            capacity *= 2;
+        }
+        uint8_t *buffer = malloc(capacity);
+        if (!buffer) {
+            return false;
+        }
+        if (remaining > 0) {
+            memcpy(buffer, tape->data + tape->pos, remaining);
+        }
+        free(tape->owned);
+        tape->owned = buffer;
+        tape->owned_cap = capacity;
+    } else if (remaining > 0) {
+        memmove(tape->owned, tape->owned + tape->pos, remaining);
+    }
+    if (len > 0) {
+        memcpy(tape->owned + remaining, data, len);
+    }
+    tape->data = tape->owned;
+    tape->len = remaining + len;
+    tape->pos = 0;
+    return true;
+}
+
+// No more input: reads past the end now see 0xFF
+void input_tape_close(InputTape *tape) {
+    tape->closed = true;
+}
+
+void input_tape_free(InputTape *tape) {
+    if (tape->mapping) {
+        munmap(tape->mapping, tape->mapping_len);
+    }
+    free(tape->owned);
+    input_tape_init(tape, NULL, 0, true);
+}
+
+// Tape input: IO_START reads the next byte, CONSOLE_STATUS_PORT its status
+static uint8_t tape_read8(CPU *cpu, uint16_t addr, void *opaque) {
+    InputTape *tape = opaque;
+    bool ready = tape->pos < tape->len;
+    if (addr == CONSOLE_STATUS_PORT) {
+        return ready ? INPUT_STATUS_READY : tape->closed ? INPUT_STATUS_EOF : INPUT_STATUS_EMPTY;
+    }
+    if (addr != IO_START) {
+        return 0;
+    }
+    if (ready) {
+        return tape->data[tape->pos++];
+    }
+    if (tape->closed) {
+        return 0xFF;  // Same byte getchar's EOF produces
+    }
+    if (tape->io_wait) {
+        // LOAD / IN re-execute once the caller has appended input and resumes
+        cpu_stop(cpu, CPU_EXIT_IO_WAIT);
+    }
+    return INPUT_NO_DATA;
+}
+
+// Feed console input from tape instead of stdin
+bool cpu_map_input_tape(CPU *cpu, InputTape *tape) {
+    const MmioDevice data = {
+        "input-tape", IO_START, 1, tape_read8, NULL, NULL, tape, NULL
+    };
+    const MmioDevice status = {
+        "input-status", CONSOLE_STATUS_PORT, 1, tape_read8, NULL, NULL, tape, NULL
+    };
+    return cpu_map_device(cpu, &data) && cpu_map_device(cpu, &status);
+}
+
+// What CONSOLE_STATUS_PORT reads, for the host: asks the device directly,
+// so no device access is charged or profiled
+uint8_t cpu_input_status(CPU *cpu) {
+    const MmioDevice *device = cpu_find_device(cpu, CONSOLE_STATUS_PORT);
+    if (!device || !device->read8) {
+        return 0;
+    }
+    return device->read8(cpu, CONSOLE_STATUS_PORT, device->opaque);
+}
+
+void cpu_map_default_devices(CPU *cpu) {
+    static const MmioDevice console_in = {
+        "console-in", IO_START, 1, console_read8, NULL, NULL, NULL, NULL
+    };
+    static const MmioDevice timer = {
+        "timer", TIMER_ADDR, 1, NULL, NULL, timer_read16, NULL, NULL
+    };
+
+    cpu->timer_start_ms = get_time_ms();
+    cpu_set_timer(cpu, TIMER_WALL_CLOCK, CPU_DEFAULT_CLOCK_HZ);
+    console_output_init(&cpu->console, STDOUT_FILENO, true);
+    cpu_map_device(cpu, &console_in);
+    cpu_map_console_output(cpu, &cpu->console);
+    cpu_map_device(cpu, &timer);
+    cpu_map_interrupt_controller(cpu);
+}
@@ -0,0 +1,279 @@
+#define _POSIX_C_SOURCE 200809L
+#include "cpu.h"
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+// Idle-loop fast-forward for guests that busy-wait on the timer.
+//
+// A LOAD of TIMER_ADDR is decoded with cpu_idle_poll as its handler. After
+// the read, the instructions that follow are checked for a loop of the form
+//
+//     poll: LOAD [TIMER_ADDR]
+//           ...register-only ALU ops on A (SUB R2, CMP #1000, ...)
+//           JC|JNC|JZ|JNZ #poll
+//
+// The body writes only A and FLAGS, and the inputs it reads besides the
+// timer value never change, so whether the branch repeats the loop is a
+// function of the timer value alone. Iterations that would read a value
+// known to repeat the loop are skipped: PC returns to the LOAD with cycles
+// and instructions advanced by whole iterations and A and FLAGS as the last
+// skipped iteration left them. A pass costs the instructions' cycle costs
+// plus the timer read's device access. The loop that then reads the exit value runs
+// normally.
+//
+// In TIMER_VIRTUAL mode the skip lands exactly where execution would have,
+// so results are unchanged. In TIMER_WALL_CLOCK mode the host thread sleeps
+// until the first exit value is due, and the idle time is charged at
+// clock_hz so cycle budgets still run out. Only cpu_run_for skips (the
+// cycle budget bounds every jump); cpu_step alone always executes the read.
+
+#define IDLE_MAX_INSNS 8           // Loop length, poll and branch included
+#define IDLE_MAX_SLEEP_MS 1000     // Longest single host sleep
+
+typedef struct {
+    DecodedInsn body[IDLE_MAX_INSNS];  // Instructions after the poll, branch last
+    int count;                         // Entries in body
+    uint64_t head;                     // Cycles from dispatching the poll to its read
+    uint64_t pass;                     // Cycles per pass, poll included
+} IdleLoop;
+
+// Register-only operations on A with a result defined by the timer value
+static bool idle_body_op(const DecodedInsn *d) {
+    switch (d->opcode) {
+        case OP_NOP:
+        case OP_NOT:
+            return true;
+        case OP_ADD: case OP_SUB: case OP_AND: case OP_OR:
+        case OP_XOR: case OP_CMP: case OP_TEST:
+            return d->mode == MODE_IMMEDIATE || d->mode == MODE_REGISTER;
+        case OP_SHL:
+        case OP_SHR:
+            return d->mode == MODE_IMMEDIATE && d->operand < 16;
+        default:
+            return false;
+    }
+}
+
+// Decode the loop headed by the poll at head; false if it is not an idle loop
+static bool idle_loop_decode(CPU *cpu, const DecodedInsn *poll, IdleLoop *loop) {
+    uint16_t head = poll->pc;
+    uint16_t pc = head + poll->length;
+    loop->count = 0;
+    loop->head = poll->cost + cpu->mmio_cost;
+    loop->pass = loop->head;
+    while (loop->count < IDLE_MAX_INSNS - 1) {
+        // Code must stay in RAM and must not stop at a breakpoint
+        if (pc < head || pc > cpu->mmio_base - MAX_INSN_LENGTH ||
+            (cpu->breakpoint_count > 0 && cpu_is_breakpoint(cpu, pc))) {
+            return false;
+        }
+        DecodedInsn *d = &loop->body[loop->count++];
+        cpu_decode(cpu, pc, d);
+        pc += d->length;
+        loop->pass += d->cost;
+        if (d->opcode >= OP_JZ && d->opcode <= OP_JNC) {
+            return d->mode == MODE_IMMEDIATE && d->operand == head;
+        }
+        if (!idle_body_op(d)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+static uint8_t zn_flags(uint16_t result) {
+    return (result == 0 ? FLAG_ZERO : 0) | ((result & 0x8000) ? FLAG_NEGATIVE : 0);
+}
+
+// Z, N, C and O for src + operand or src - operand
+static uint8_t arith_flags(bool add, uint16_t src, uint16_t operand) {
+    uint16_t result = add ? src + operand : src - operand;
+    uint16_t sign = add ? ~(src ^ operand) & (src ^ result) : (src ^ operand) & (src ^ result);
+    bool carry = add ? result < src : src < operand;
+    return zn_flags(result) | (carry ? FLAG_CARRY : 0) | ((sign & 0x8000) ? FLAG_OVERFLOW : 0);
+}
+
+// Run one iteration on a timer value; true if the branch repeats the loop.
+// A and FLAGS start from the CPU and receive the iteration's results.
+static bool idle_loop_repeats(const IdleLoop *loop, const CPU *cpu, uint16_t timer,
+                              uint16_t *a_out, uint8_t *flags_out) {
+    const uint16_t regs[4] = { 0, cpu->regs.B, cpu->regs.C, cpu->regs.D };
+    uint16_t a = timer;
+    uint8_t flags = (*flags_out & ~(FLAG_ZERO | FLAG_NEGATIVE)) | zn_flags(a);
+    const uint8_t zn = FLAG_ZERO | FLAG_NEGATIVE;
+    const uint8_t znco = zn | FLAG_CARRY | FLAG_OVERFLOW;
+
+    for (int i = 0; i < loop->count - 1; i++) {
+        const DecodedInsn *d = &loop->body[i];
+        uint16_t operand = d->operand;
+        if (d->mode == MODE_REGISTER) {
+            operand = d->operand == 0 ? a : regs[d->operand];
+        }
+        switch (d->opcode) {
+            case OP_ADD:
+                flags = (flags & ~znco) | arith_flags(true, a, operand);
+                a += operand;
+                break;
+            case OP_SUB:
+                flags = (flags & ~znco) | arith_flags(false, a, operand);
+                a -= operand;
+                break;
+            case OP_CMP:
+                flags = (flags & ~znco) | arith_flags(false, a, operand);
+                break;
+            case OP_AND: a &= operand; flags = (flags & ~zn) | zn_flags(a); break;
+            case OP_OR:  a |= operand; flags = (flags & ~zn) | zn_flags(a); break;
+            case OP_XOR: a ^= operand; flags = (flags & ~zn) | zn_flags(a); break;
+            case OP_NOT: a = ~a;       flags = (flags & ~zn) | zn_flags(a); break;
+            case OP_SHL: a <<= operand; flags = (flags & ~zn) | zn_flags(a); break;
+            case OP_SHR: a >>= operand; flags = (flags & ~zn) | zn_flags(a); break;
+            case OP_TEST: flags = (flags & ~zn) | zn_flags(a & operand); break;
+            default: break;
+        }
+    }
+    *a_out = a;
+    *flags_out = flags;
+
+    switch (loop->body[loop->count - 1].opcode) {
+        case OP_JZ:  return (flags & FLAG_ZERO) != 0;
+        case OP_JNZ: return (flags & FLAG_ZERO) == 0;
+        case OP_JC:  return (flags & FLAG_CARRY) != 0;
+        default:     return (flags & FLAG_CARRY) == 0;
+    }
+}
+
+// First timer reading in (from, from + 65536] that leaves the loop; 0 if none
+static uint64_t idle_exit_ms(const IdleLoop *loop, const CPU *cpu, uint64_t from, uint8_t flags) {
+    for (uint64_t ms = from + 1; ms <= from + 0x10000; ms++) {
+        uint16_t a;
+        uint8_t f = flags;
+        if (!idle_loop_repeats(loop, cpu, (uint16_t)ms, &a, &f)) {
+            return ms;
+        }
+    }
+    return 0;  // Every value repeats: the loop never ends
+}
+
+// Put the CPU back at the poll after `iterations` more passes; timer is the
+// value the last of them read
+static void idle_skip_to(CPU *cpu, const IdleLoop *loop, const DecodedInsn *poll,
+                         uint64_t iterations, uint16_t timer, uint8_t flags) {
+    uint64_t length = loop->count + 1;
+    uint64_t skipped = iterations * loop->pass - loop->head;
+    uint16_t a;
+    idle_loop_repeats(loop, cpu, timer, &a, &flags);
+    cpu->regs.A = a;
+    cpu->regs.FLAGS = flags;
+    cpu->flags_pending = 0;
+    cpu->regs.PC = poll->pc;
+    cpu->cycles += skipped;
+    cpu->instructions += iterations * length - 1;
+    cpu->idle_skips++;
+    cpu->idle_cycles += skipped;
+}
+
+static void sleep_until_ms(uint64_t deadline_ms) {
+    struct timespec ts = {
+        (time_t)(deadline_ms / 1000), (long)(deadline_ms % 1000) * 1000000
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+// Sleep the host thread for up to wait_ms of wall-clock time, but no longer
+// than max_cycles take at clock_hz. Returns the cycles the time slept stands
+// for; a max_cycles shorter than a millisecond is returned whole.
+uint64_t cpu_idle_sleep(CPU *cpu, uint64_t wait_ms, uint64_t max_cycles) {
+    uint64_t budget_ms = max_cycles / cpu->clock_hz * 1000 +
+                         max_cycles % cpu->clock_hz * 1000 / cpu->clock_hz;
+    if (wait_ms == 0) {
+        return 0;
+    }
+    if (budget_ms == 0) {
+        return max_cycles;
+    }
+    if (wait_ms > budget_ms) {
+        wait_ms = budget_ms;
+    }
+    if (wait_ms > IDLE_MAX_SLEEP_MS) {
+        wait_ms = IDLE_MAX_SLEEP_MS;
+    }
+    cpu_flush_devices(cpu);  // Output written before the wait shows up now
+    uint64_t start = cpu_timer_sample(cpu);
+    sleep_until_ms(cpu->timer_start_ms + start + wait_ms);
+    uint64_t slept = (cpu_timer_sample(cpu) - start) * cpu->clock_hz / 1000;
+    return slept < max_cycles ? slept : max_cycles;
+}
+
+// Handler for LOAD [TIMER_ADDR]: the read itself, then the fast-forward
+void cpu_idle_poll(CPU *cpu, const DecodedInsn *insn) {
+    cpu->regs.A = mem_read16(cpu, TIMER_ADDR);
+    update_flags(cpu, cpu->regs.A);
+
+    IdleLoop loop;
+    if (!cpu->running || cpu->cycles >= cpu->run_until || !cpu_timer_is_default(cpu) ||
+        !idle_loop_decode(cpu, insn, &loop)) {
+        return;
+    }
+    uint8_t flags = cpu_flags(cpu);
+    uint16_t a;
+    uint8_t f = flags;
+    if (!idle_loop_repeats(&loop, cpu, cpu->regs.A, &a, &f)) {
+        return;
+    }
+
+    // Whole passes that fit in the budget: each is the poll plus the body
+    uint64_t pass = loop.pass;
+    uint64_t polled = cpu->cycles;  // Cycle count the current poll read at
+    uint64_t budget = (cpu->run_until - polled + loop.head) / pass;
+    uint64_t iterations;
+
+    if (cpu->timer_mode == TIMER_VIRTUAL) {
+        uint64_t exit_ms = idle_exit_ms(&loop, cpu, cpu_timer_ms_at(cpu, polled), flags);
+        iterations = budget;
+        if (exit_ms > 0) {
+            // First pass whose poll sees exit_ms or later
+            uint64_t exit_cycle = (exit_ms * cpu->clock_hz + 999) / 1000;
+            uint64_t needed = (exit_cycle - polled + pass - 1) / pass;
+            if (needed < iterations) {
+                iterations = needed;
+            }
+        }
+        if (iterations == 0) {
+            return;
+        }
+        uint64_t last = polled + (iterations - 1) * pass;
+        idle_skip_to(cpu, &loop, insn, iterations, (uint16_t)cpu_timer_ms_at(cpu, last), flags);
+        return;
+    }
+
+    // Wall clock: sleep until the first exit value is due
+    uint64_t now = cpu_timer_sample(cpu);
+    f = flags;
+    if (!idle_loop_repeats(&loop, cpu, (uint16_t)now, &a, &f)) {
+        return;  // The next poll sees the fresh sample and leaves
+    }
+    uint64_t exit_ms = idle_exit_ms(&loop, cpu, now, flags);
+    uint64_t slept = cpu_idle_sleep(cpu, exit_ms > 0 ? exit_ms - now : IDLE_MAX_SLEEP_MS,
+                                    budget * pass);
+    iterations = slept / pass;
+    if (iterations > 0) {
+        uint64_t timer = cpu->timer_sample_ms - cpu->timer_start_ms;
+        idle_skip_to(cpu, &loop, insn, iterations, (uint16_t)timer, flags);
+    }
+}
+
+// Enable or disable idle-loop fast-forward (rebuilds the decode cache)
+void cpu_set_idle_skip(CPU *cpu, bool enabled) {
+    cpu->idle_skip = enabled;
+    cpu_invalidate_decode_cache(cpu);
+}
+
+// Dump fast-forward hit counts
+void cpu_dump_idle_stats(const CPU *cpu) {
+    printf("\n=== Idle Loop Statistics ===\n");
+    printf("Fast-forwards: %llu\n", (unsigned long long)cpu->idle_skips);
+    printf("Cycles skipped: %llu of %llu\n", (unsigned long long)cpu->idle_cycles,
+           (unsigned long long)cpu->cycles);
+}
@@ -0,0 +1,208 @@
+#include "cpu.h"
+#include <stdio.h>
+
+// Interrupt controller and the WAIT state.
+//
+// Interrupts are delivered by cpu_run_for, which runs the engines in slices
+// and calls cpu_service_interrupts between them. A slice ends at the next
+// point a source can change: the exact cycle the compare value comes due
+// with the virtual timer, every TIMER_SLICE_CYCLES with the wall clock, and
+// straight after EI, IRET, WAIT or a write to the controller
+// (cpu_interrupt_check). With no source enabled the whole budget is one
+// slice, so guests that never use interrupts run exactly as before.
+//
+// WAIT does not step: the CPU skips to the next event. With the virtual
+// timer the cycle count jumps to the compare deadline; with the wall clock
+// the host thread sleeps until it (cpu_idle_sleep). Waiting only for input
+// on an empty open tape stops the run with CPU_EXIT_IO_WAIT, and the wait
+// carries on when the run resumes.
+
+// Timer reading, not wrapped to 16 bits
+static uint64_t timer_now(CPU *cpu) {
+    if (cpu->timer_mode == TIMER_VIRTUAL) {
+        return cpu_timer_ms_at(cpu, cpu->cycles);
+    }
+    return cpu_timer_sample(cpu);
+}
+
+static bool timer_source_active(const CPU *cpu) {
+    return (cpu->irq.enable & IRQ_TIMER) && cpu->irq.compare_armed;
+}
+
+// Have cpu_run_for look at interrupts before the next instruction
+void cpu_interrupt_check(CPU *cpu) {
+    if (cpu->run_until > cpu->cycles) {
+        cpu->run_until = cpu->cycles;
+    }
+}
+
+// Sample the enabled sources into pending
+static void irq_poll(CPU *cpu) {
+    InterruptController *irq = &cpu->irq;
+    if (timer_source_active(cpu) && timer_now(cpu) >= irq->deadline_ms) {
+        irq->pending |= IRQ_TIMER;
+        irq->compare_armed = false;
+    }
+    if (irq->enable & IRQ_INPUT) {
+        // Level-triggered: pending exactly while input is ready
+        if (cpu_input_status(cpu) == INPUT_STATUS_READY) {
+            irq->pending |= IRQ_INPUT;
+        } else {
+            irq->pending &= ~IRQ_INPUT;
+        }
+    }
+}
+
+// Push PC and FLAGS and enter the handler for source
+static void irq_take(CPU *cpu, int source) {
+    InterruptController *irq = &cpu->irq;
+    cpu_sync_flags(cpu);
+    stack_push16(cpu, cpu->regs.PC);
+    stack_push16(cpu, cpu->regs.FLAGS);
+    cpu->regs.FLAGS &= ~FLAG_INTERRUPT;
+    irq->pending &= ~(1 << source);
+    cpu->regs.PC = mem_read16(cpu, irq->vectors + 2 * source);
+    cpu->interrupts++;
+    if (cpu->profile) {
+        profile_interrupt(cpu);
+    }
+}
+
+// First cycle at which the timer source can fire (UINT64_MAX: none)
+static uint64_t irq_next_event(const CPU *cpu) {
+    if (!timer_source_active(cpu)) {
+        return UINT64_MAX;
+    }
+    if (cpu->timer_mode == TIMER_VIRTUAL) {
+        return (cpu->irq.deadline_ms * cpu->clock_hz + 999) / 1000;
+    }
+    return cpu->cycles + TIMER_SLICE_CYCLES;
+}
+
+// WAIT with nothing pending: move time on to the next event. Returns false
+// once the run has to stop (budget used up or no event ahead).
+static bool irq_wait(CPU *cpu, uint64_t end) {
+    uint64_t before = cpu->cycles;
+    if (timer_source_active(cpu)) {
+        if (cpu->timer_mode == TIMER_VIRTUAL) {
+            uint64_t next = irq_next_event(cpu);
+            cpu->cycles = next < end ? next : end;
+        } else {
+            uint64_t now = cpu_timer_sample(cpu);
+            uint64_t wait_ms = now < cpu->irq.deadline_ms ? cpu->irq.deadline_ms - now : 0;
+            cpu->cycles += cpu_idle_sleep(cpu, wait_ms, end - cpu->cycles);
+        }
+        cpu->wait_cycles += cpu->cycles - before;
+        return cpu->cycles < end;
+    }
+    if ((cpu->irq.enable & IRQ_INPUT) &&
+        cpu_input_status(cpu) == INPUT_STATUS_EMPTY) {
+        cpu_stop(cpu, CPU_EXIT_IO_WAIT);
+    } else {
+        cpu_stop(cpu, CPU_EXIT_DEADLOCK);
+    }
+    return false;
+}
+
+// Between slices: take a pending interrupt, or leave the WAIT state, then
+// set run_until to the end of the next slice (at most end)
+void cpu_service_interrupts(CPU *cpu, uint64_t end) {
+    InterruptController *irq = &cpu->irq;
+    cpu->run_until = end;
+    if (irq->enable == 0 && !cpu->waiting) {
+        return;
+    }
+
+    for (;;) {
+        irq_poll(cpu);
+        uint8_t active = irq->pending & irq->enable;
+        if (active) {
+            // Any enabled source ends WAIT, even with interrupts disabled
+            cpu->waiting = false;
+            if (cpu->regs.FLAGS & FLAG_INTERRUPT) {
+                int source = 0;
+                while (!(active & (1 << source))) {
+                    source++;
+                }
+                irq_take(cpu, source);
+            }
+            break;
+        }
+        if (!cpu->waiting) {
+            break;
+        }
+        if (!irq_wait(cpu, end)) {
+            return;
+        }
+    }
+
+    uint64_t next = irq_next_event(cpu);
+    if (next < end) {
+        cpu->run_until = next;
+    }
+}
+
+// Arm IRQ_TIMER for the next time the timer reads compare
+static void irq_arm_compare(CPU *cpu) {
+    InterruptController *irq = &cpu->irq;
+    uint64_t now = timer_now(cpu);
+    irq->deadline_ms = now + (uint16_t)(irq->compare - (uint16_t)now);
+    irq->compare_armed = true;
+}
+
+static uint8_t irq_read8(CPU *cpu, uint16_t addr, void *opaque) {
+    InterruptController *irq = opaque;
+    switch (addr) {
+        case IRQ_ENABLE_PORT: return irq->enable;
+        case IRQ_PENDING_PORT: irq_poll(cpu); return irq->pending;
+        case IRQ_VECTOR_PORT: return irq->vectors & 0xFF;
+        case IRQ_VECTOR_PORT + 1: return irq->vectors >> 8;
+        case IRQ_COMPARE_PORT: return irq->compare & 0xFF;
+        case IRQ_COMPARE_PORT + 1: return irq->compare >> 8;
+        default: return 0;
+    }
+}
+
+static void irq_write8(CPU *cpu, uint16_t addr, uint8_t value, void *opaque) {
+    InterruptController *irq = opaque;
+    switch (addr) {
+        case IRQ_ENABLE_PORT:
+            irq->enable = value;
+            break;
+        case IRQ_PENDING_PORT:
+            irq->pending &= ~value;
+            break;
+        case IRQ_VECTOR_PORT:
+            irq->vectors = (irq->vectors & 0xFF00) | value;
+            break;
+        case IRQ_VECTOR_PORT + 1:
+            irq->vectors = (irq->vectors & 0x00FF) | (value << 8);
+            break;
+        case IRQ_COMPARE_PORT:
+            irq->compare = (irq->compare & 0xFF00) | value;
+            irq_arm_compare(cpu);
+            break;
+        case IRQ_COMPARE_PORT + 1:
+            irq->compare = (irq->compare & 0x00FF) | (value << 8);
+            irq_arm_compare(cpu);
+            break;
+        default:
+            return;
+    }
+    cpu_interrupt_check(cpu);
+}
+
+void cpu_map_interrupt_controller(CPU *cpu) {
+    const MmioDevice device = {
+        "interrupts", IRQ_ENABLE_PORT, 6, irq_read8, irq_write8, NULL, &cpu->irq, NULL
+    };
+    cpu_map_device(cpu, &device);
+}
+
+// Dump interrupt and WAIT counts
+void cpu_dump_interrupt_stats(const CPU *cpu) {
+    printf("\n=== Interrupt Statistics ===\n");
+    printf("Interrupts taken: %llu\n", (unsigned long long)cpu->interrupts);
+    printf("WAIT cycles: %llu of %llu\n", (unsigned long long)cpu->wait_cycles,
+           (unsigned long long)cpu->cycles);
+}
@@ -0,0 +1,958 @@
+#define _DEFAULT_SOURCE
+#include "cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+// Basic-block JIT for x86-64 hosts.
+//
+// The dispatcher interprets cold code with cpu_step and counts entries to
+// each basic block. Once a block start is hot it is translated into native
+// code in an mmap'd buffer. Inside a block the guest registers live in
+// callee-saved host registers:
+//
+//   A = ebx   B = r12d   C = r13d   D = r14d   SP = r15d   FLAGS = ebp
+//
+// Jumps, calls and returns end a block. Instructions the JIT does not
+// handle (HALT, IN, OUT, MMIO operands) end the block before them, so the
+// interpreter executes them. Stores go through mem_write16, which
+// invalidates translations covering the written address; the block then
+// exits so stale code never runs.
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+
+#include <sys/mman.h>
+
+#ifndef JIT_HOT_THRESHOLD
+#define JIT_HOT_THRESHOLD 32         // Block entries before translation
+#endif
+#define JIT_NEVER 0xFFFF              // Hotness marker: first instruction untranslatable
+#define JIT_MAX_BLOCK_INSNS 64
+#define JIT_MAX_BLOCKS 8192
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+#define JIT_MAX_BLOCK_CODE 8192       // Worst-case native bytes for one block
+
+typedef void (*JitFn)(CPU *cpu);
+
+typedef struct JitBlock {
+    JitFn code;
+    uint16_t start;                   // First guest byte
+    uint16_t end;                     // One past the last guest byte
+    uint32_t cycles;                  // Most guest cycles one pass can charge
+    bool live;
+    struct JitBlock *page_next[2];    // Per-page lists (a block spans at most 2 pages)
+} JitBlock;
+
+struct JitState {
+    uint8_t *code;                    // Executable buffer
+    size_t code_used;
+    JitBlock *blocks;                 // Block pool
+    int block_count;
+    JitBlock *entry[MEMORY_SIZE];     // Live block starting at each PC
+    JitBlock *page_blocks[MEMORY_SIZE / 256];
+    uint16_t hotness[MEMORY_SIZE];
+    bool invalidated;                 // Set when a write drops a translation
+};
+
+// ---------------------------------------------------------------------------
+// x86-64 emitter
+
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+       R12 = 12, R13 = 13, R14 = 14, R15 = 15 };
+
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7 };
+
+enum { ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29,
+       ALU_XOR = 0x31, ALU_CMP = 0x39, ALU_TEST = 0x85 };
+
+typedef struct {
+    uint8_t *buf;
+    size_t pos;
+    size_t cap;
+} Emitter;
+
+// Host register holding each guest register number (0-3 = A-D)
+static const int guest_reg[4] = { RBX, R12, R13, R14 };
+#define HOST_SP R15
+#define HOST_FLAGS RBP
+
+#define OFF_A      ((int32_t)offsetof(CPU, regs.A))
+#define OFF_B      ((int32_t)offsetof(CPU, regs.B))
+#define OFF_C      ((int32_t)offsetof(CPU, regs.C))
+#define OFF_D      ((int32_t)offsetof(CPU, regs.D))
+#define OFF_SP     ((int32_t)offsetof(CPU, regs.SP))
+#define OFF_PC     ((int32_t)offsetof(CPU, regs.PC))
+#define OFF_FLAGS  ((int32_t)offsetof(CPU, regs.FLAGS))
+#define OFF_CYCLES ((int32_t)offsetof(CPU, cycles))
+#define OFF_INSTRUCTIONS ((int32_t)offsetof(CPU, instructions))
+#define OFF_RUN_UNTIL ((int32_t)offsetof(CPU, run_until))
+#define OFF_MEMORY ((int32_t)offsetof(CPU, memory))
+
+static void emit8(Emitter *e, uint8_t b) {
+    if (e->pos < e->cap) {
+        e->buf[e->pos] = b;
+    }
+    e->pos++;
+}
+
+static void emit16(Emitter *e, uint16_t v) {
+    emit8(e, v & 0xFF);
+    emit8(e, v >> 8);
+}
+
+static void emit32(Emitter *e, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        emit8(e, (v >> (8 * i)) & 0xFF);
+    }
+}
+
+static void emit64(Emitter *e, uint64_t v) {
+    emit32(e, (uint32_t)v);
+    emit32(e, (uint32_t)(v >> 32));
+}
+
+// REX prefix; force emits 0x40 even when no bits are set (for spl/bpl/sil/dil)
+static void emit_rex(Emitter *e, bool w, int reg, int index, int base, bool force) {
+    uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (rex != 0x40 || force) {
+        emit8(e, rex);
+    }
+}
+
+static void emit_modrm(Emitter *e, int mod, int reg, int rm) {
+    emit8(e, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [base + index + disp32] memory operand (index < 0 for none)
+static void emit_mem(Emitter *e, int reg, int base, int index, int32_t disp) {
+    if (index < 0 && (base & 7) != RSP) {
+        emit_modrm(e, 2, reg, base);
+    } else {
+        emit_modrm(e, 2, reg, RSP);
+        emit8(e, ((index < 0 ? RSP : index) & 7) << 3 | (base & 7));
+    }
+    emit32(e, (uint32_t)disp);
+}
+
+static void emit_op_mem(Emitter *e, bool w, const uint8_t *op, int oplen,
+                        int reg, int base, int index, int32_t disp) {
+    emit_rex(e, w, reg, index < 0 ? 0 : index, base, false);
+    for (int i = 0; i < oplen; i++) {
+        emit8(e, op[i]);
+    }
+    emit_mem(e, reg, base, index, disp);
+}
+
+// movzx dst32, word [base + index + disp]
+static void emit_load16(Emitter *e, int dst, int base, int index, int32_t disp) {
+    static const uint8_t op[] = { 0x0F, 0xB7 };
+    emit_op_mem(e, false, op, 2, dst, base, index, disp);
+}
+
+// movzx dst32, byte [base + disp]
+static void emit_load8(Emitter *e, int dst, int base, int32_t disp) {
+    static const uint8_t op[] = { 0x0F, 0xB6 };
+    emit_op_mem(e, false, op, 2, dst, base, -1, disp);
+}
+
+// mov word [base + disp], src16
+static void emit_store16(Emitter *e, int base, int32_t disp, int src) {
+    static const uint8_t op[] = { 0x89 };
+    emit8(e, 0x66);
+    emit_op_mem(e, false, op, 1, src, base, -1, disp);
+}
+
+// mov byte [base + disp], src8
+static void emit_store8(Emitter *e, int base, int32_t disp, int src) {
+    emit_rex(e, false, src, 0, base, src >= 4 && src < 8);
+    emit8(e, 0x88);
+    emit_mem(e, src, base, -1, disp);
+}
+
+// mov word [base + disp], imm16
+static void emit_store16_imm(Emitter *e, int base, int32_t disp, uint16_t imm) {
+    emit8(e, 0x66);
+    emit_rex(e, false, 0, 0, base, false);
+    emit8(e, 0xC7);
+    emit_mem(e, 0, base, -1, disp);
+    emit16(e, imm);
+}
+
+// add qword [base + disp], imm32
+static void emit_add64_mem_imm(Emitter *e, int base, int32_t disp, uint32_t imm) {
+    emit_rex(e, true, 0, 0, base, false);
+    emit8(e, 0x81);
+    emit_mem(e, 0, base, -1, disp);
+    emit32(e, imm);
+}
+
+// mov dst64, qword [base + disp]
+static void emit_load64(Emitter *e, int dst, int base, int32_t disp) {
+    static const uint8_t op[] = { 0x8B };
+    emit_op_mem(e, true, op, 1, dst, base, -1, disp);
+}
+
+// cmp reg64, qword [base + disp]
+static void emit_cmp64_mem(Emitter *e, int reg, int base, int32_t disp) {
+    static const uint8_t op[] = { 0x3B };
+    emit_op_mem(e, true, op, 1, reg, base, -1, disp);
+}
+
+// add reg64, imm32
+static void emit_add64_ri(Emitter *e, int reg, uint32_t imm) {
+    emit_rex(e, true, 0, 0, reg, false);
+    emit8(e, 0x81);
+    emit_modrm(e, 3, 0, reg);
+    emit32(e, imm);
+}
+
+// mov r64, [rsp + disp8]
+static void emit_load_frame(Emitter *e, int dst, uint8_t disp) {
+    emit_rex(e, true, dst, 0, RSP, false);
+    emit8(e, 0x8B);
+    emit_modrm(e, 1, dst, RSP);
+    emit8(e, 0x24);
+    emit8(e, disp);
+}
+
+// mov [rsp + disp8], r64
+static void emit_store_frame(Emitter *e, uint8_t disp, int src) {
+    emit_rex(e, true, src, 0, RSP, false);
+    emit8(e, 0x89);
+    emit_modrm(e, 1, src, RSP);
+    emit8(e, 0x24);
+    emit8(e, disp);
+}
+
+static void emit_mov_rr(Emitter *e, int dst, int src) {
+    emit_rex(e, false, src, 0, dst, false);
+    emit8(e, 0x89);
+    emit_modrm(e, 3, src, dst);
+}
+
+static void emit_mov_ri(Emitter *e, int dst, uint32_t imm) {
+    emit_rex(e, false, 0, 0, dst, false);
+    emit8(e, 0xB8 + (dst & 7));
+    emit32(e, imm);
+}
+
+static void emit_alu_rr(Emitter *e, uint8_t op, int dst, int src) {
+    emit_rex(e, false, src, 0, dst, false);
+    emit8(e, op);
+    emit_modrm(e, 3, src, dst);
+}
+
+// ALU dst32, imm32 (ext: 0=add 1=or 4=and 5=sub 6=xor 7=cmp)
+static void emit_alu_ri(Emitter *e, int ext, int dst, uint32_t imm) {
+    emit_rex(e, false, 0, 0, dst, false);
+    emit8(e, 0x81);
+    emit_modrm(e, 3, ext, dst);
+    emit32(e, imm);
+}
+
+static void emit_test_ri(Emitter *e, int dst, uint32_t imm) {
+    emit_rex(e, false, 0, 0, dst, false);
+    emit8(e, 0xF7);
+    emit_modrm(e, 3, 0, dst);
+    emit32(e, imm);
+}
+
+// Group-3 / group-5 unary ops on r32 (F7 /ext or FF /ext)
+static void emit_unary(Emitter *e, uint8_t op, int ext, int reg) {
+    emit_rex(e, false, 0, 0, reg, false);
+    emit8(e, op);
+    emit_modrm(e, 3, ext, reg);
+}
+
+// Shift r32 by cl (ext: 4=shl 5=shr) or by imm8
+static void emit_shift_cl(Emitter *e, int ext, int reg) {
+    emit_unary(e, 0xD3, ext, reg);
+}
+
+static void emit_shift_imm(Emitter *e, int ext, int reg, uint8_t count) {
+    emit_unary(e, 0xC1, ext, reg);
+    emit8(e, count);
+}
+
+// movzx dst32, src16
+static void emit_zext16(Emitter *e, int dst, int src) {
+    emit_rex(e, false, dst, 0, src, false);
+    emit8(e, 0x0F);
+    emit8(e, 0xB7);
+    emit_modrm(e, 3, dst, src);
+}
+
+static void emit_imul_rr(Emitter *e, int dst, int src) {
+    emit_rex(e, false, dst, 0, src, false);
+    emit8(e, 0x0F);
+    emit8(e, 0xAF);
+    emit_modrm(e, 3, dst, src);
+}
+
+static void emit_setcc(Emitter *e, int cc, int reg) {
+    emit_rex(e, false, 0, 0, reg, reg >= 4 && reg < 8);
+    emit8(e, 0x0F);
+    emit8(e, 0x90 | cc);
+    emit_modrm(e, 3, 0, reg);
+}
+
+// jcc rel32 with a placeholder; returns the offset to patch
+static size_t emit_jcc(Emitter *e, int cc) {
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | cc);
+    size_t at = e->pos;
+    emit32(e, 0);
+    return at;
+}
+
+static void emit_jmp_to(Emitter *e, size_t target) {
+    emit8(e, 0xE9);
+    emit32(e, (uint32_t)(int32_t)(target - (e->pos + 4)));
+}
+
+// Point a rel32 placeholder at the current position
+static void patch_here(Emitter *e, size_t at) {
+    int32_t rel = (int32_t)(e->pos - (at + 4));
+    if (at + 4 <= e->cap) {
+        memcpy(e->buf + at, &rel, 4);
+    }
+}
+
+static void emit_call(Emitter *e, const void *fn) {
+    emit8(e, 0x48);
+    emit8(e, 0xB8);               // mov rax, imm64
+    emit64(e, (uint64_t)(uintptr_t)fn);
+    emit8(e, 0xFF);
+    emit8(e, 0xD0);               // call rax
+}
+
+// ---------------------------------------------------------------------------
+// Block frame: [rsp] = CPU *, [rsp + 8] = scratch slot
+
+#define FRAME_CPU 0
+#define FRAME_SCRATCH 8
+
+static const int saved_regs[6] = { RBX, RBP, R12, R13, R14, R15 };
+
+static void emit_prologue(Emitter *e) {
+    for (int i = 0; i < 6; i++) {
+        emit_rex(e, false, 0, 0, saved_regs[i], false);
+        emit8(e, 0x50 + (saved_regs[i] & 7));     // push
+    }
+    emit8(e, 0x48);
+    emit8(e, 0x83);
+    emit8(e, 0xEC);
+    emit8(e, 24);                                   // sub rsp, 24 (keeps calls 16-byte aligned)
+    emit_store_frame(e, FRAME_CPU, RDI);
+    emit_load16(e, RBX, RDI, -1, OFF_A);
+    emit_load16(e, R12, RDI, -1, OFF_B);
+    emit_load16(e, R13, RDI, -1, OFF_C);
+    emit_load16(e, R14, RDI, -1, OFF_D);
+    emit_load16(e, R15, RDI, -1, OFF_SP);
+    emit_load8(e, RBP, RDI, OFF_FLAGS);
+}
+
+static void emit_epilogue(Emitter *e) {
+    emit_load_frame(e, RDI, FRAME_CPU);
+    emit_store16(e, RDI, OFF_A, RBX);
+    emit_store16(e, RDI, OFF_B, R12);
+    emit_store16(e, RDI, OFF_C, R13);
+    emit_store16(e, RDI, OFF_D, R14);
+    emit_store16(e, RDI, OFF_SP, R15);
+    emit_store8(e, RDI, OFF_FLAGS, RBP);
+    emit8(e, 0x48);
+    emit8(e, 0x83);
+    emit8(e, 0xC4);
+    emit8(e, 24);                                   // add rsp, 24
+    for (int i = 5; i >= 0; i--) {
+        emit_rex(e, false, 0, 0, saved_regs[i], false);
+        emit8(e, 0x58 + (saved_regs[i] & 7));     // pop
+    }
+    emit8(e, 0xC3);                                 // ret
+}
+
+// Charge `count` guest instructions costing `cycles` (rdi = cpu)
+static void emit_retire(Emitter *e, uint32_t count, uint32_t cycles) {
+    emit_add64_mem_imm(e, RDI, OFF_INSTRUCTIONS, count);
+    emit_add64_mem_imm(e, RDI, OFF_CYCLES, cycles);
+}
+
+// Leave the block with PC = pc after `count` guest instructions
+static void emit_exit(Emitter *e, uint16_t pc, uint32_t count, uint32_t cycles) {
+    emit_load_frame(e, RDI, FRAME_CPU);
+    emit_store16_imm(e, RDI, OFF_PC, pc);
+    emit_retire(e, count, cycles);
+    emit_epilogue(e);
+}
+
+// Leave the block with PC taken from a host register
+static void emit_exit_dynamic(Emitter *e, int pc_reg, uint32_t count, uint32_t cycles) {
+    emit_load_frame(e, RDI, FRAME_CPU);
+    emit_store16(e, RDI, OFF_PC, pc_reg);
+    emit_retire(e, count, cycles);
+    emit_epilogue(e);
+}
+
+// if (cond) leave the block at pc, before the current instruction executes
+static void emit_side_exit_if(Emitter *e, int cc, uint16_t pc, uint32_t count, uint32_t cycles) {
+    size_t skip = emit_jcc(e, cc ^ 1);
+    emit_exit(e, pc, count, cycles);
+    patch_here(e, skip);
+}
+
+// FLAGS: Z and N from a zero-extended 16-bit value (clobbers edx)
+static void emit_set_zn(Emitter *e, int reg) {
+    emit_alu_ri(e, 4, HOST_FLAGS, (uint32_t)~(FLAG_ZERO | FLAG_NEGATIVE));
+    emit_alu_rr(e, ALU_XOR, RDX, RDX);
+    emit_alu_rr(e, ALU_TEST, reg, reg);
+    emit_setcc(e, CC_E, RDX);
+    emit_alu_rr(e, ALU_OR, HOST_FLAGS, RDX);
+    emit_mov_rr(e, RDX, reg);
+    emit_shift_imm(e, 5, RDX, 13);
+    emit_alu_ri(e, 4, RDX, FLAG_NEGATIVE);
+    emit_alu_rr(e, ALU_OR, HOST_FLAGS, RDX);
+}
+
+// FLAGS: C from bit (shift + 1) of eax (clobbers edx)
+static void emit_set_carry(Emitter *e, uint8_t shift) {
+    emit_alu_ri(e, 4, HOST_FLAGS, (uint32_t)~FLAG_CARRY);
+    emit_mov_rr(e, RDX, RAX);
+    emit_shift_imm(e, 5, RDX, shift);
+    emit_alu_ri(e, 4, RDX, FLAG_CARRY);
+    emit_alu_rr(e, ALU_OR, HOST_FLAGS, RDX);
+}
+
+// FLAGS: O after eax = ebx +/- ecx (clobbers edx, esi)
+static void emit_set_overflow(Emitter *e, bool add) {
+    // ADD: (r ^ a) & (r ^ b); SUB: (a ^ b) & (a ^ r); sign bit 15 -> FLAG_OVERFLOW
+    emit_mov_rr(e, RDX, add ? RAX : RBX);
+    emit_alu_rr(e, ALU_XOR, RDX, add ? RBX : RCX);
+    emit_mov_rr(e, RSI, add ? RAX : RBX);
+    emit_alu_rr(e, ALU_XOR, RSI, add ? RCX : RAX);
+    emit_alu_rr(e, ALU_AND, RDX, RSI);
+    emit_shift_imm(e, 5, RDX, 12);
+    emit_alu_ri(e, 4, RDX, FLAG_OVERFLOW);
+    emit_alu_ri(e, 4, HOST_FLAGS, (uint32_t)~FLAG_OVERFLOW);
+    emit_alu_rr(e, ALU_OR, HOST_FLAGS, RDX);
+}
+
+// ---------------------------------------------------------------------------
+// Runtime helpers called from translated code
+
+static uint32_t jit_helper_write16(CPU *cpu, uint32_t addr, uint32_t value) {
+    cpu->jit->invalidated = false;
+    mem_write16(cpu, (uint16_t)addr, (uint16_t)value);
+    return cpu->jit->invalidated;
+}
+
+// ---------------------------------------------------------------------------
+// Translation
+
+typedef enum {
+    EMIT_OK,           // Instruction translated, block continues
+    EMIT_END,          // Terminator translated, block is closed
+    EMIT_UNSUPPORTED,  // Nothing emitted; interpreter must run this instruction
+} EmitResult;
+
+typedef struct {
+    Emitter *e;
+    uint16_t block_start;
+    size_t body_start;   // Native offset right after the prologue
+    uint16_t pc;         // Address of the instruction being translated
+    uint16_t next_pc;
+    uint32_t count;      // Guest instructions completed before this one
+    uint32_t cycles;     // Their cycle costs
+    uint8_t cost;        // Cycle cost of this one
+    uint16_t mmio_base;  // cpu->mmio_base at translation time
+} BlockCtx;
+
+static bool addr_is_mmio16(const BlockCtx *b, uint16_t addr) {
+    return addr >= b->mmio_base - 1;
+}
+
+// Load the instruction's operand into ecx; false if it needs the interpreter
+static bool emit_operand(BlockCtx *b, const DecodedInsn *d) {
+    Emitter *e = b->e;
+    switch (d->mode) {
+        case MODE_IMMEDIATE:
+            emit_mov_ri(e, RCX, d->operand);
+            return true;
+        case MODE_DIRECT:
+            if (addr_is_mmio16(b, d->operand)) {
+                return false;
+            }
+            emit_load_frame(e, RAX, FRAME_CPU);
+            emit_load16(e, RCX, RAX, -1, OFF_MEMORY + d->operand);
+            return true;
+        case MODE_REGISTER:
+            emit_mov_rr(e, RCX, guest_reg[d->operand]);
+            return true;
+        default:
+            // Indirect: device addresses leave the block before the access
+            emit_alu_ri(e, 7, guest_reg[d->operand], b->mmio_base - 1);
+            emit_side_exit_if(e, CC_AE, b->pc, b->count, b->cycles);
+            emit_load_frame(e, RAX, FRAME_CPU);
+            emit_load16(e, RCX, RAX, guest_reg[d->operand], OFF_MEMORY);
+            return true;
+    }
+}
+
+// Transfer control to a constant target (loops back in place when it is the
+// block start and another full pass fits in the cycle budget)
+static void emit_goto(BlockCtx *b, uint16_t target, uint32_t count, uint32_t cycles) {
+    Emitter *e = b->e;
+    if (target == b->block_start) {
+        emit_load_frame(e, RDI, FRAME_CPU);
+        emit_retire(e, count, cycles);
+        emit_load64(e, RAX, RDI, OFF_CYCLES);
+        emit_add64_ri(e, RAX, cycles);
+        emit_cmp64_mem(e, RAX, RDI, OFF_RUN_UNTIL);
+        size_t over_budget = emit_jcc(e, CC_A);
+        emit_jmp_to(e, b->body_start);
+        patch_here(e, over_budget);
+        emit_store16_imm(e, RDI, OFF_PC, target);
+        emit_epilogue(e);
+    } else {
+        emit_exit(e, target, count, cycles);
+    }
+}
+
+// Push the 16-bit value in ecx; leaves eax nonzero if translations were invalidated
+static void emit_push(BlockCtx *b) {
+    Emitter *e = b->e;
+    // SP - 1 and SP must both be RAM
+    emit_mov_rr(e, RAX, HOST_SP);
+    emit_alu_ri(e, 5, RAX, 1);
+    emit_alu_ri(e, 7, RAX, b->mmio_base - 1);
+    emit_side_exit_if(e, CC_AE, b->pc, b->count, b->cycles);
+    emit_mov_rr(e, RDX, RCX);
+    emit_mov_rr(e, RSI, RAX);
+    emit_load_frame(e, RDI, FRAME_CPU);
+    emit_call(e, (const void *)jit_helper_write16);
+    emit_alu_ri(e, 5, HOST_SP, 2);
+    emit_zext16(e, HOST_SP, HOST_SP);
+}
+
+// Pop a 16-bit value into dst
+static void emit_pop(BlockCtx *b, int dst) {
+    Emitter *e = b->e;
+    // SP + 1 and SP + 2 must both be RAM
+    emit_alu_ri(e, 7, HOST_SP, b->mmio_base - 2);
+    emit_side_exit_if(e, CC_AE, b->pc, b->count, b->cycles);
+    emit_load_frame(e, RAX, FRAME_CPU);
+    emit_load16(e, dst, RAX, HOST_SP, OFF_MEMORY + 1);
+    emit_alu_ri(e, 0, HOST_SP, 2);
+}
+
+// Leave the block if a store dropped translations (eax != 0)
+static void emit_check_invalidated(BlockCtx *b) {
+    Emitter *e = b->e;
+    emit_alu_rr(e, ALU_TEST, RAX, RAX);
+    emit_side_exit_if(e, CC_NE, b->next_pc, b->count + 1, b->cycles + b->cost);
+}
+
+static EmitResult emit_insn(BlockCtx *b, const DecodedInsn *d) {
+    Emitter *e = b->e;
+    uint32_t done = b->count + 1;   // Instruction count once this one retires
+    uint32_t done_cycles = b->cycles + d->cost;
+
+    switch (d->opcode) {
+        case OP_NOP:
+            return EMIT_OK;
+
+        case OP_LOAD:
+            if (!emit_operand(b, d)) return EMIT_UNSUPPORTED;
+            emit_mov_rr(e, RBX, RCX);
+            emit_set_zn(e, RBX);
+            return EMIT_OK;
+
+        case OP_STORE:
+            if (d->mode == MODE_DIRECT) {
+                if (addr_is_mmio16(b, d->operand) || d->operand == 0xFFFF) return EMIT_UNSUPPORTED;
+                emit_mov_ri(e, RSI, d->operand);
+            } else if (d->mode == MODE_INDIRECT) {
+                emit_alu_ri(e, 7, guest_reg[d->operand], b->mmio_base - 1);
+                emit_side_exit_if(e, CC_AE, b->pc, b->count, b->cycles);
+                emit_mov_rr(e, RSI, guest_reg[d->operand]);
+            } else {
+                return EMIT_OK;
+            }
+            emit_mov_rr(e, RDX, RBX);
+            emit_load_frame(e, RDI, FRAME_CPU);
+            emit_call(e, (const void *)jit_helper_write16);
+            emit_check_invalidated(b);
+            return EMIT_OK;
+
+        case OP_MOV:
+            if (d->mode == MODE_REGISTER) {
+                int dst = guest_reg[d->dest_reg];
+                emit_mov_rr(e, dst, guest_reg[d->operand]);
+                emit_set_zn(e, dst);
+            }
+            return EMIT_OK;
+
+        case OP_PUSH:
+            if (!emit_operand(b, d)) return EMIT_UNSUPPORTED;
+            emit_push(b);
+            emit_check_invalidated(b);
+            return EMIT_OK;
+
+        case OP_POP:
+            emit_pop(b, RBX);
+            emit_set_zn(e, RBX);
+            return EMIT_OK;
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_CMP:
+            if (!emit_operand(b, d)) return EMIT_UNSUPPORTED;
+            emit_mov_rr(e, RAX, RBX);
+            emit_alu_rr(e, d->opcode == OP_ADD ? ALU_ADD : ALU_SUB, RAX, RCX);
+            // ADD carries out of bit 16; SUB/CMP borrow leaves bit 31 set
+            emit_set_carry(e, d->opcode == OP_ADD ? 15 : 30);
+            emit_set_overflow(e, d->opcode == OP_ADD);
+            emit_zext16(e, RAX, RAX);
+            if (d->opcode != OP_CMP) {
+                emit_mov_rr(e, RBX, RAX);
+            }
+            emit_set_zn(e, RAX);
+            return EMIT_OK;
+
+        case OP_INC:
+        case OP_DEC:
+            {
+                int reg = (d->mode == MODE_REGISTER) ? guest_reg[d->operand] : RBX;
+                emit_unary(e, 0xFF, d->opcode == OP_INC ? 0 : 1, reg);
+                emit_zext16(e, reg, reg);
+                emit_set_zn(e, reg);
+            }
+            return EMIT_OK;
+
+        case OP_MUL:
+            if (!emit_operand(b, d)) return EMIT_UNSUPPORTED;
+            emit_imul_rr(e, RBX, RCX);
+            emit_zext16(e, RBX, RBX);
+            emit_set_zn(e, RBX);
+            return EMIT_OK;
+
+        case OP_DIV:
+            {
+                if (!emit_operand(b, d)) return EMIT_UNSUPPORTED;
+                emit_alu_rr(e, ALU_TEST, RCX, RCX);
+                size_t skip = emit_jcc(e, CC_E);
+                emit_mov_rr(e, RAX, RBX);
+                emit_alu_rr(e, ALU_XOR, RDX, RDX);
+                emit_unary(e, 0xF7, 6, RCX);           // div ecx
+                emit_mov_rr(e, RBX, RAX);
+                emit_set_zn(e, RBX);
+                patch_here(e, skip);
+            }
+            return EMIT_OK;
+
+        case OP_AND:
+        case OP_OR:
+        case OP_XOR:
+            if (!emit_operand(b, d)) return EMIT_UNSUPPORTED;
+            emit_alu_rr(e, d->opcode == OP_AND ? ALU_AND : d->opcode == OP_OR ? ALU_OR : ALU_XOR,
+                        RBX, RCX);
+            emit_set_zn(e, RBX);
+            return EMIT_OK;
+
+        case OP_NOT:
+            emit_unary(e, 0xF7, 2, RBX);
+            emit_zext16(e, RBX, RBX);
+            emit_set_zn(e, RBX);
+            return EMIT_OK;
+
+        case OP_SHL:
+        case OP_SHR:
+            if (!emit_operand(b, d)) return EMIT_UNSUPPORTED;
+            emit_shift_cl(e, d->opcode == OP_SHL ? 4 : 5, RBX);
+            emit_zext16(e, RBX, RBX);
+            emit_set_zn(e, RBX);
+            return EMIT_OK;
+
+        case OP_TEST:
+            if (!emit_operand(b, d)) return EMIT_UNSUPPORTED;
+            emit_mov_rr(e, RAX, RBX);
+            emit_alu_rr(e, ALU_AND, RAX, RCX);
+            emit_set_zn(e, RAX);
+            return EMIT_OK;
+
+        case OP_JMP:
+            if (d->mode == MODE_IMMEDIATE) {
+                emit_goto(b, d->operand, done, done_cycles);
+                return EMIT_END;
+            }
+            if (!emit_operand(b, d)) return EMIT_UNSUPPORTED;
+            emit_exit_dynamic(e, RCX, done, done_cycles);
+            return EMIT_END;
+
+        case OP_JZ:
+        case OP_JNZ:
+        case OP_JC:
+        case OP_JNC:
+            {
+                if (d->mode != MODE_IMMEDIATE && !emit_operand(b, d)) return EMIT_UNSUPPORTED;
+                uint8_t flag = (d->opcode == OP_JZ || d->opcode == OP_JNZ) ? FLAG_ZERO : FLAG_CARRY;
+                bool when_set = (d->opcode == OP_JZ || d->opcode == OP_JC);
+                emit_test_ri(e, HOST_FLAGS, flag);
+                size_t not_taken = emit_jcc(e, when_set ? CC_E : CC_NE);
+                if (d->mode == MODE_IMMEDIATE) {
+                    emit_goto(b, d->operand, done, done_cycles);
+                } else {
+                    emit_exit_dynamic(e, RCX, done, done_cycles);
+                }
+                patch_here(e, not_taken);
+                emit_goto(b, b->next_pc, done, done_cycles);
+            }
+            return EMIT_END;
+
+        case OP_CALL:
+            if (!emit_operand(b, d)) return EMIT_UNSUPPORTED;
+            emit_store_frame(e, FRAME_SCRATCH, RCX);
+            emit_mov_ri(e, RCX, b->next_pc);
+            emit_push(b);
+            // Always leave: the push may have overwritten this very block
+            if (d->mode == MODE_IMMEDIATE) {
+                emit_exit(e, d->operand, done, done_cycles);
+            } else {
+                emit_load_frame(e, RCX, FRAME_SCRATCH);
+                emit_exit_dynamic(e, RCX, done, done_cycles);
+            }
+            return EMIT_END;
+
+        case OP_RET:
+            emit_pop(b, RCX);
+            emit_exit_dynamic(e, RCX, done, done_cycles);
+            return EMIT_END;
+
+        default:
+            // HALT, IN, OUT and unknown opcodes run in the interpreter
+            return EMIT_UNSUPPORTED;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Translation cache management
+
+static JitState *jit_state(CPU *cpu) {
+    if (cpu->jit) {
+        return cpu->jit;
+    }
+    JitState *jit = calloc(1, sizeof(JitState));
+    if (!jit) {
+        return NULL;
+    }
+    jit->blocks = calloc(JIT_MAX_BLOCKS, sizeof(JitBlock));
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!jit->blocks || jit->code == MAP_FAILED) {
+        fprintf(stderr, "Warning: JIT unavailable, using threaded interpreter\n");
+        free(jit->blocks);
+        free(jit);
+        return NULL;
+    }
+    cpu->jit = jit;
+    return jit;
+}
+
+void jit_flush(CPU *cpu) {
+    JitState *jit = cpu->jit;
+    if (!jit) {
+        return;
+    }
+    memset(jit->entry, 0, sizeof(jit->entry));
+    memset(jit->page_blocks, 0, sizeof(jit->page_blocks));
+    jit->block_count = 0;
+    jit->code_used = 0;
+    jit->invalidated = true;
+    for (int page = 0; page < MEMORY_SIZE / 256; page++) {
+        cpu->code_pages[page] &= ~CODE_PAGE_JIT;
+    }
+}
+
+void jit_free(CPU *cpu) {
+    JitState *jit = cpu->jit;
+    if (!jit) {
+        return;
+    }
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit->blocks);
+    free(jit);
+    cpu->jit = NULL;
+}
+
+// A guest write hit a page with translations: drop blocks covering addr
+void jit_invalidate_addr(CPU *cpu, uint16_t addr) {
+    JitState *jit = cpu->jit;
+    if (!jit) {
+        return;
+    }
+    int page = addr >> 8;
+    bool page_live = false;
+    for (JitBlock *block = jit->page_blocks[page]; block; ) {
+        int slot = ((block->start >> 8) == page) ? 0 : 1;
+        JitBlock *next = block->page_next[slot];
+        if (block->live && addr >= block->start && addr < block->end) {
+            block->live = false;
+            if (jit->entry[block->start] == block) {
+                jit->entry[block->start] = NULL;
+            }
+            jit->invalidated = true;
+        }
+        page_live |= block->live;
+        block = next;
+    }
+    if (!page_live) {
+        cpu->code_pages[page] &= ~CODE_PAGE_JIT;
+    }
+}
+
+static JitBlock *jit_compile(CPU *cpu, JitState *jit, uint16_t start) {
+    if (jit->block_count >= JIT_MAX_BLOCKS ||
+        jit->code_used + JIT_MAX_BLOCK_CODE > JIT_CODE_SIZE) {
+        jit_flush(cpu);
+    }
+
+    Emitter e = { jit->code + jit->code_used, 0, JIT_MAX_BLOCK_CODE };
+    BlockCtx b = { &e, start, 0, start, start, 0, 0, 0, cpu->mmio_base };
+    EmitResult result = EMIT_OK;
+
+    emit_prologue(&e);
+    b.body_start = e.pos;
+
+    // Translate until a terminator, an untranslatable instruction or the size limits
+    while (b.count < JIT_MAX_BLOCK_INSNS && b.pc <= b.mmio_base - MAX_INSN_LENGTH &&
+           b.pc - start <= 256 - MAX_INSN_LENGTH) {
+        if (b.count > 0 && cpu->breakpoint_count > 0 && cpu_is_breakpoint(cpu, b.pc)) {
+            break;
+        }
+        DecodedInsn d;
+        cpu_decode(cpu, b.pc, &d);
+        b.next_pc = b.pc + d.length;
+        b.cost = d.cost;
+        size_t mark = e.pos;
+        result = emit_insn(&b, &d);
+        if (result == EMIT_UNSUPPORTED) {
+            e.pos = mark;
+            break;
+        }
+        b.count++;
+        b.cycles += d.cost;
+        b.pc = b.next_pc;
+        if (result == EMIT_END) {
+            break;
+        }
+    }
+
+    if (b.count == 0 || e.pos > e.cap) {
+        return NULL;
+    }
+    if (result != EMIT_END) {
+        emit_exit(&e, b.pc, b.count, b.cycles);
+    }
+
+    JitBlock *block = &jit->blocks[jit->block_count++];
+    block->code = (JitFn)(void *)(jit->code + jit->code_used);
+    block->start = start;
+    block->end = b.pc;
+    block->cycles = b.cycles;
+    block->live = true;
+    jit->code_used += (e.pos + 15) & ~(size_t)15;
+    jit->entry[start] = block;
+
+    // Link into the page lists so writes can find it
+    int first_page = start >> 8;
+    int last_page = (b.pc - 1) >> 8;
+    block->page_next[0] = jit->page_blocks[first_page];
+    jit->page_blocks[first_page] = block;
+    cpu->code_pages[first_page] |= CODE_PAGE_JIT;
+    block->page_next[1] = NULL;
+    if (last_page != first_page) {
+        block->page_next[1] = jit->page_blocks[last_page];
+        jit->page_blocks[last_page] = block;
+        cpu->code_pages[last_page] |= CODE_PAGE_JIT;
+    }
+    return block;
+}
+
+static bool is_block_terminator(uint8_t opcode) {
+    return (opcode >= OP_JMP && opcode <= OP_RET) || opcode == OP_HALT;
+}
+
+// Interpret from PC to the end of the current basic block
+static void jit_interpret(CPU *cpu, JitState *jit, bool single) {
+    for (;;) {
+        uint16_t pc = cpu->regs.PC;
+        uint8_t opcode = (cpu->memory[pc] >> 2) & 0x3F;
+        cpu_step(cpu);
+        if (single || cpu->cycles >= cpu->run_until ||
+            is_block_terminator(opcode) || jit->entry[cpu->regs.PC]) {
+            return;
+        }
+    }
+}
+
+void cpu_run_jit(CPU *cpu) {
+    JitState *jit = jit_state(cpu);
+    if (!jit) {
+        cpu_run_threaded(cpu);
+        return;
+    }
+
+    while (cpu->cycles < cpu->run_until) {
+        uint16_t pc = cpu->regs.PC;
+        JitBlock *block = jit->entry[pc];
+        if (block && cpu->run_until - cpu->cycles < block->cycles) {
+            // Not enough budget left for a full pass
+            jit_interpret(cpu, jit, true);
+            continue;
+        }
+        if (block) {
+            uint64_t before = cpu->instructions;
+            block->code(cpu);
+            if (cpu->instructions != before) {
+                continue;
+            }
+            // Side exit on the first instruction (e.g. a device access): step it
+            jit_interpret(cpu, jit, true);
+            continue;
+        }
+
+        if (cpu->breakpoint_count > 0 && cpu_is_breakpoint(cpu, pc)) {
+            jit_interpret(cpu, jit, true);
+            continue;
+        }
+        if (jit->hotness[pc] != JIT_NEVER && ++jit->hotness[pc] >= JIT_HOT_THRESHOLD) {
+            if (jit_compile(cpu, jit, pc)) {
+                continue;
+            }
+            jit->hotness[pc] = JIT_NEVER;
+        }
+        jit_interpret(cpu, jit, jit->hotness[pc] == JIT_NEVER);
+    }
+}
+
+#else
+
+// No code generator for this host: the JIT engine runs the threaded core
+void cpu_run_jit(CPU *cpu) {
+    cpu_run_threaded(cpu);
+}
+
+void jit_invalidate_addr(CPU *cpu, uint16_t addr) {
+    (void)cpu;
+    (void)addr;
+}
+
+void jit_flush(CPU *cpu) {
+    (void)cpu;
+}
+
+void jit_free(CPU *cpu) {
+    (void)cpu;
+}
+
+#endif
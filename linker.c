@@ -0,0 +1,337 @@
+#define _POSIX_C_SOURCE 200809L
+#include "linker.h"
+#include "cpu.h"
+#include "symbols.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// An object file loaded for linking
+typedef struct {
+    const char *path;
+    ObjectHeader header;
+    uint8_t *code;
+    ObjectSymbol *symbols;
+    ObjectRelocation *relocations;
+    char *names;
+    uint16_t base;            // Load address in the linked program
+    uint16_t *addresses;      // Final address of each symbol
+} ObjectFile;
+
+// Import order: by name, so references to one symbol share an entry
+static int compare_fixup_names(const void *a, const void *b) {
+    return strcmp((*(const Fixup *const *)a)->name, (*(const Fixup *const *)b)->name);
+}
+
+// Write an assembled module (assembled with relocatable set) as an object.
+// Labels keep their indices as symbols; undefined labels follow as imports.
+bool write_object(const Assembler *as, const char *path) {
+    if (as->output_size > MEMORY_SIZE) {
+        fprintf(stderr, "Error: Object code must fit in 64 KB (%zu bytes)\n", as->output_size);
+        return false;
+    }
+
+    size_t most_symbols = as->label_count + as->fixup_count + 1;
+    ObjectSymbol *symbols = malloc(most_symbols * sizeof(ObjectSymbol));
+    const char **symbol_names = malloc(most_symbols * sizeof(symbol_names[0]));
+    ObjectRelocation *relocations = malloc((as->fixup_count + 1) * sizeof(ObjectRelocation));
+    const Fixup **imports = malloc((as->fixup_count + 1) * sizeof(imports[0]));
+    char *names = NULL;
+    bool ok = symbols && symbol_names && relocations && imports;
+
+    // Relocations to defined labels; collect the rest as imports
+    uint32_t symbol_count = 0;
+    uint32_t names_size = 0;
+    int import_refs = 0;
+    for (int i = 0; ok && i < as->label_count; i++) {
+        const char *name = as->labels[i].name;
+        symbols[symbol_count].address = as->labels[i].address;
+        symbols[symbol_count].kind = name[0] == '.' ? OBJECT_LOCAL : OBJECT_EXPORT;
+        symbol_names[symbol_count++] = name;
+    }
+    for (int i = 0; ok && i < as->fixup_count; i++) {
+        relocations[i].offset = as->fixups[i].offset;
+        int label_idx = find_label(as, as->fixups[i].name);
+        if (label_idx >= 0) {
+            relocations[i].symbol = label_idx;
+        } else {
+            imports[import_refs++] = &as->fixups[i];
+        }
+    }
+    if (ok) {
+        qsort(imports, import_refs, sizeof(imports[0]), compare_fixup_names);
+    }
+    for (int i = 0; ok && i < import_refs; i++) {
+        if (i == 0 || strcmp(imports[i]->name, imports[i - 1]->name) != 0) {
+            symbols[symbol_count].address = 0;
+            symbols[symbol_count].kind = OBJECT_IMPORT;
+            symbol_names[symbol_count++] = imports[i]->name;
+        }
+        relocations[imports[i] - as->fixups].symbol = symbol_count - 1;
+    }
+
+    // String table in symbol order
+    for (uint32_t i = 0; ok && i < symbol_count; i++) {
+        symbols[i].name = names_size;
+        symbols[i].reserved = 0;
+        names_size += strlen(symbol_names[i]) + 1;
+    }
+    names = ok ? malloc(names_size + 1) : NULL;
+    for (uint32_t i = 0; names && i < symbol_count; i++) {
+        strcpy(names + symbols[i].name, symbol_names[i]);
+    }
+
+    FILE *out = names ? fopen(path, "wb") : NULL;
+    ok = out != NULL;
+    if (!names) {
+        fprintf(stderr, "Error: Out of memory for object file\n");
+    } else if (!out) {
+        fprintf(stderr, "Error: Cannot create object file '%s'\n", path);
+    } else {
+        ObjectHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, OBJECT_MAGIC, sizeof(header.magic));
+        header.version = OBJECT_VERSION;
+        header.code_size = as->output_size;
+        header.symbol_count = symbol_count;
+        header.relocation_count = as->fixup_count;
+        header.names_size = names_size;
+        ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+             fwrite(as->output, 1, as->output_size, out) == as->output_size &&
+             fwrite(symbols, sizeof(ObjectSymbol), symbol_count, out) == symbol_count &&
+             fwrite(relocations, sizeof(ObjectRelocation), as->fixup_count, out) ==
+                 (size_t)as->fixup_count &&
+             fwrite(names, 1, names_size, out) == names_size;
+        if (fclose(out) != 0 || !ok) {
+            fprintf(stderr, "Error: Cannot write object file '%s'\n", path);
+            ok = false;
+        }
+    }
+    free(names);
+    free(symbols);
+    free(symbol_names);
+    free(relocations);
+    free(imports);
+    return ok;
+}
+
+static void object_free(ObjectFile *object) {
+    free(object->code);
+    free(object->symbols);
+    free(object->relocations);
+    free(object->names);
+    free(object->addresses);
+}
+
+// Read an object file, checking that every offset in it is in bounds
+static bool object_load(ObjectFile *object, const char *path) {
+    memset(object, 0, sizeof(*object));
+    object->path = path;
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open object file '%s'\n", path);
+        return false;
+    }
+
+    ObjectHeader *header = &object->header;
+    struct stat st;
+    bool ok = fstat(fileno(f), &st) == 0 &&
+              fread(header, sizeof(*header), 1, f) == 1 &&
+              memcmp(header->magic, OBJECT_MAGIC, sizeof(header->magic)) == 0 &&
+              header->version == OBJECT_VERSION &&
+              header->code_size <= MEMORY_SIZE &&
+              (uint64_t)st.st_size == sizeof(*header) + (uint64_t)header->code_size +
+                  (uint64_t)header->symbol_count * sizeof(ObjectSymbol) +
+                  (uint64_t)header->relocation_count * sizeof(ObjectRelocation) +
+                  header->names_size;
+    if (ok) {
+        object->code = malloc(header->code_size + 1);
+        object->symbols = malloc((header->symbol_count + 1) * sizeof(ObjectSymbol));
+        object->relocations = malloc((header->relocation_count + 1) * sizeof(ObjectRelocation));
+        object->names = malloc(header->names_size + 1);
+        object->addresses = malloc((header->symbol_count + 1) * sizeof(uint16_t));
+        ok = object->code && object->symbols && object->relocations && object->names &&
+             object->addresses &&
+             fread(object->code, 1, header->code_size, f) == header->code_size &&
+             fread(object->symbols, sizeof(ObjectSymbol), header->symbol_count, f) ==
+                 header->symbol_count &&
+             fread(object->relocations, sizeof(ObjectRelocation), header->relocation_count, f) ==
+                 header->relocation_count &&
+             fread(object->names, 1, header->names_size, f) == header->names_size;
+    }
+    fclose(f);
+
+    // Names are NUL-terminated in the table; records index inside it
+    ok = ok && (header->names_size == 0 || object->names[header->names_size - 1] == '\0');
+    for (uint32_t i = 0; ok && i < header->symbol_count; i++) {
+        ok = object->symbols[i].name < header->names_size &&
+             object->symbols[i].kind <= OBJECT_IMPORT;
+    }
+    for (uint32_t i = 0; ok && i < header->relocation_count; i++) {
+        ok = object->relocations[i].offset + 2 <= (uint64_t)header->code_size &&
+             object->relocations[i].symbol < header->symbol_count;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: '%s' is not a valid object file\n", path);
+        object_free(object);
+    }
+    return ok;
+}
+
+static const char *symbol_name(const ObjectFile *object, uint32_t symbol) {
+    return object->names + object->symbols[symbol].name;
+}
+
+// Which earlier object exports name, for the duplicate error
+static const char *exporter(const ObjectFile *objects, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        for (uint32_t s = 0; s < objects[i].header.symbol_count; s++) {
+            if (objects[i].symbols[s].kind == OBJECT_EXPORT &&
+                strcmp(symbol_name(&objects[i], s), name) == 0) {
+                return objects[i].path;
+            }
+        }
+    }
+    return "?";
+}
+
+// Module name for local symbols in the map: the file name without directory
+// or extension, so '.loop' in math.obj is listed as 'math.loop'
+static void qualified_name(const char *path, const char *name, char *text, size_t size) {
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    const char *dot = strrchr(base, '.');
+    int length = dot && dot != base ? (int)(dot - base) : (int)strlen(base);
+    snprintf(text, size, "%.*s%s", length, base, name);
+}
+
+// Link objects into a program image. They are placed in order from address
+// 0, where execution starts, and relocated against each other's exports.
+// The symbol map lists exports and, qualified by module, local labels.
+bool link_objects(const char *output_file, char *const *input_files, int count) {
+    ObjectFile *objects = calloc(count, sizeof(ObjectFile));
+    if (!objects) {
+        fprintf(stderr, "Error: Out of memory for objects\n");
+        return false;
+    }
+    Assembler linked;  // Global symbols and the program image
+    assembler_init(&linked);
+
+    printf("Linking %d objects...\n", count);
+
+    // Place every module and collect the exports
+    int loaded = 0;
+    bool ok = true;
+    while (ok && loaded < count) {
+        ObjectFile *object = &objects[loaded];
+        if (!object_load(object, input_files[loaded])) {
+            ok = false;
+            break;
+        }
+        loaded++;
+        if (linked.output_size + object->header.code_size > MEMORY_SIZE) {
+            fprintf(stderr, "Error: Linked program does not fit in 64 KB at '%s'\n", object->path);
+            ok = false;
+            break;
+        }
+        object->base = linked.output_size;
+        for (uint32_t i = 0; i < object->header.code_size; i++) {
+            emit_byte(&linked, object->code[i]);
+        }
+        for (uint32_t s = 0; ok && s < object->header.symbol_count; s++) {
+            const char *name = symbol_name(object, s);
+            object->addresses[s] = object->base + object->symbols[s].address;
+            if (object->symbols[s].kind != OBJECT_EXPORT) {
+                continue;
+            }
+            if (find_label(&linked, name) >= 0) {
+                fprintf(stderr, "Error: '%s' exports '%s', already exported by '%s'\n",
+                        object->path, name, exporter(objects, loaded - 1, name));
+                ok = false;
+            } else {
+                ok = add_label(&linked, name, object->addresses[s]);
+            }
+        }
+    }
+    if (ok && linked.output_failed) {
+        fprintf(stderr, "Error: Out of memory for the linked program\n");
+        ok = false;
+    }
+
+    // Resolve imports, reporting every undefined one, then patch the words
+    bool resolved = ok;
+    for (int i = 0; ok && i < count; i++) {
+        ObjectFile *object = &objects[i];
+        for (uint32_t s = 0; s < object->header.symbol_count; s++) {
+            if (object->symbols[s].kind != OBJECT_IMPORT) {
+                continue;
+            }
+            int label_idx = find_label(&linked, symbol_name(object, s));
+            if (label_idx < 0) {
+                fprintf(stderr, "Error: '%s' uses undefined symbol '%s'\n",
+                        object->path, symbol_name(object, s));
+                resolved = false;
+            } else {
+                object->addresses[s] = linked.labels[label_idx].address;
+            }
+        }
+    }
+    ok = resolved;
+    for (int i = 0; ok && i < count; i++) {
+        const ObjectFile *object = &objects[i];
+        for (uint32_t r = 0; r < object->header.relocation_count; r++) {
+            const ObjectRelocation *relocation = &object->relocations[r];
+            uint16_t address = object->addresses[relocation->symbol];
+            linked.output[object->base + relocation->offset] = address & 0xFF;
+            linked.output[object->base + relocation->offset + 1] = address >> 8;
+        }
+    }
+
+    // Local labels join the exports for the symbol map only, after imports
+    // were resolved, so a qualified name never satisfies an import
+    for (int i = 0; ok && i < count; i++) {
+        const ObjectFile *object = &objects[i];
+        for (uint32_t s = 0; ok && s < object->header.symbol_count; s++) {
+            char name[MAX_LINE_LENGTH];
+            if (object->symbols[s].kind != OBJECT_LOCAL) {
+                continue;
+            }
+            qualified_name(object->path, symbol_name(object, s), name, sizeof(name));
+            if (find_label(&linked, name) < 0) {
+                ok = add_label(&linked, name, object->addresses[s]);
+            }
+        }
+    }
+
+    if (ok) {
+        printf("Linked %d objects: %d symbols. Generated %zu bytes.\n",
+               count, linked.label_count, linked.output_size);
+        FILE *out = fopen(output_file, "wb");
+        if (!out) {
+            fprintf(stderr, "Error: Cannot create output file '%s'\n", output_file);
+            ok = false;
+        } else {
+            bool written = fwrite(linked.output, 1, linked.output_size, out) == linked.output_size;
+            if (fclose(out) != 0 || !written) {
+                fprintf(stderr, "Error: Cannot write output file '%s'\n", output_file);
+                ok = false;
+            }
+        }
+    }
+    if (ok) {
+        printf("Output written to '%s'\n", output_file);
+        char symbol_path[1024];
+        symbol_map_path(output_file, symbol_path, sizeof(symbol_path));
+        if (strcmp(symbol_path, output_file) != 0 && write_symbol_map(&linked, symbol_path)) {
+            printf("Symbols written to '%s'\n", symbol_path);
+        }
+    }
+
+    for (int i = 0; i < loaded; i++) {
+        object_free(&objects[i]);
+    }
+    free(objects);
+    assembler_free(&linked);
+    return ok;
+}
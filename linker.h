@@ -0,0 +1,51 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+#include "assembler.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Relocatable object file, written by `assemble --object` and combined by
+// `link`: an ObjectHeader, the module's code assembled at address 0, then
+// symbol_count ObjectSymbols, relocation_count ObjectRelocations and a
+// names_size string table of NUL-terminated symbol names.
+//
+// Every label operand has a relocation; the linker overwrites its word with
+// the final address of the symbol. Numeric operands are absolute and left
+// alone. Labels starting with '.' stay local to their module.
+#define OBJECT_MAGIC "CPUOBJ\0\0"
+#define OBJECT_VERSION 1
+
+typedef enum {
+    OBJECT_LOCAL = 0,   // Defined here, visible only to this module
+    OBJECT_EXPORT = 1,  // Defined here, visible to every module
+    OBJECT_IMPORT = 2,  // Used here, defined by another module
+} ObjectSymbolKind;
+
+typedef struct {
+    char magic[8];
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t code_size;
+    uint32_t symbol_count;
+    uint32_t relocation_count;
+    uint32_t names_size;
+} ObjectHeader;
+
+typedef struct {
+    uint32_t name;        // Offset into the string table
+    uint16_t address;     // Module-relative; 0 for imports
+    uint8_t kind;         // ObjectSymbolKind
+    uint8_t reserved;
+} ObjectSymbol;
+
+typedef struct {
+    uint32_t offset;      // Code offset of the operand word
+    uint32_t symbol;      // Index into the module's symbols
+} ObjectRelocation;
+
+// Function declarations
+bool write_object(const Assembler *as, const char *path);
+bool link_objects(const char *output_file, char *const *input_files, int count);
+
+#endif // LINKER_H
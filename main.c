@@ -1,17 +1,66 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "cpu.h"
 #include "assembler.h"
+#include "linker.h"
+#include "batch.h"
+#include "bundle.h"
+#include "symbols.h"
+#include "trace.h"
 
 void print_usage(const char *prog_name) {
     printf("Usage:\n");
     printf("  %s assemble <input.asm> <output.bin>  - Assemble program\n", prog_name);
-    printf("  %s run <program.bin>                  - Run binary program\n", prog_name);
-    printf("  %s demo <fibonacci|hello|timer>       - Run demo program\n", prog_name);
+    printf("  %s assemble <input.asm> <output.obj> --object\n", prog_name);
+    printf("                                        - Assemble a module into a relocatable object\n");
+    printf("                  (either form takes --optimize to run the peephole optimizer)\n");
+    printf("  %s link <output.bin> <input.obj>...   - Link objects into a program, the first at 0\n", prog_name);
+    printf("  %s run <program.bin> [engine] [--fuse] [--lazy-flags] [--max-cycles N]\n", prog_name);
+    printf("                  [--unbuffered] [--output FILE] [--input FILE] [--virtual-timer HZ]\n");
+    printf("                  [--no-idle-skip] [--trace FILE] [--costs FILE]\n");
+    printf("                                        - Run binary program (engine: interp|threaded|jit)\n");
+    printf("  %s trace-dump <trace.bin> [--from ADDR] [--to ADDR]\n", prog_name);
+    printf("                                        - Print a --trace file, optionally for a PC range\n");
+    printf("  %s batch <manifest> <results.jsonl> [engine] [--fuse] [--threads N] [--max-cycles N]\n", prog_name);
+    printf("                  [--virtual-timer HZ]\n");
+    printf("                                        - Run many programs in parallel, one JSON line each\n");
+    printf("  %s profile <program.bin> [engine] [--top N] [--max-cycles N] [--input FILE]\n", prog_name);
+    printf("                  [--virtual-timer HZ] [--no-idle-skip] [--symbols FILE] [--folded FILE]\n");
+    printf("                  [--costs FILE]\n");
+    printf("                                        - Run with execution counts, print hot spots\n");
+    printf("  %s sweep <program.bin> <lanes> [--max-steps N]\n", prog_name);
+    printf("                                        - Run one program in lockstep lanes, A = lane number\n");
+    printf("  %s demo <fibonacci|hello|timer|snapshot>       - Run demo program\n", prog_name);
     printf("\n");
 }
 
+// Parse an engine name for cpu_set_engine
+bool parse_engine(const char *name, CpuEngine *engine) {
+    if (strcmp(name, "interp") == 0) {
+        *engine = CPU_ENGINE_INTERP;
+    } else if (strcmp(name, "threaded") == 0) {
+        *engine = CPU_ENGINE_THREADED;
+    } else if (strcmp(name, "jit") == 0) {
+        *engine = CPU_ENGINE_JIT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Read a program image into a malloc'd buffer
+uint8_t *read_program(const char *path, size_t *size) {
+    const char *error;
+    uint8_t *program = cpu_read_program(path, size, &error);
+    if (!program) {
+        fprintf(stderr, "Error: '%s' %s\n", path, error);
+    }
+    return program;
+}
+
 // Create Fibonacci program in memory
 void create_fibonacci_demo(CPU *cpu) {
     printf("Creating Fibonacci demo program...\n");
@@ -169,6 +218,61 @@ void create_timer_demo(CPU *cpu) {
     return;
 }
 
+// Snapshot regression check: run part of a program that writes data, code
+// and stack pages, snapshot, run to the end, then restore and compare
+// memory, registers and the cycle and instruction counts against the state
+// at the snapshot. Repeats once so the second restore reuses pages saved by
+// the first run. Returns false on any mismatch.
+bool run_snapshot_check(void) {
+    uint8_t program[] = {
+        encode_instruction(OP_LOAD, MODE_IMMEDIATE), 0x00, 0x20,   // 0: A = 0x2000
+        encode_instruction(OP_MOV, MODE_REGISTER), 0x00, 0x01,     // 3: MOV A B (B = pointer)
+        // Loop at 6: fill one word per page from 0x2000 up to 0x6000
+        encode_instruction(OP_LOAD, MODE_REGISTER), 0x01,          // 6: A = B
+        encode_instruction(OP_STORE, MODE_INDIRECT), 0x01,         // 8: [B] = A
+        encode_instruction(OP_STORE, MODE_DIRECT), 0x40, 0x00,     // 10: [0x0040] = A (code page)
+        encode_instruction(OP_PUSH, MODE_REGISTER), 0x00,          // 13: PUSH A
+        encode_instruction(OP_ADD, MODE_IMMEDIATE), 0x00, 0x01,    // 15: A = A + 0x100
+        encode_instruction(OP_MOV, MODE_REGISTER), 0x00, 0x01,     // 18: MOV A B
+        encode_instruction(OP_CMP, MODE_IMMEDIATE), 0x00, 0x60,    // 21: CMP A, 0x6000
+        encode_instruction(OP_JNZ, MODE_IMMEDIATE), 0x06, 0x00,    // 24: JNZ loop
+        encode_instruction(OP_HALT, MODE_IMMEDIATE),               // 27: HALT
+    };
+    static uint8_t memory[MEMORY_SIZE];
+    const CpuEngine engines[] = { CPU_ENGINE_INTERP, CPU_ENGINE_THREADED, CPU_ENGINE_JIT };
+    bool ok = true;
+
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+        CPU cpu;
+        cpu_init(&cpu);
+        cpu.quiet = true;
+        cpu_set_engine(&cpu, engines[e]);
+        cpu_load_program(&cpu, program, sizeof(program), 0);
+        cpu_run_for(&cpu, 100);
+        cpu_sync_flags(&cpu);
+
+        bool passed = cpu_snapshot(&cpu);
+        Registers regs = cpu.regs;
+        uint64_t cycles = cpu.cycles;
+        uint64_t instructions = cpu.instructions;
+        memcpy(memory, cpu.memory, MEMORY_SIZE);
+        for (int round = 0; passed && round < 2; round++) {
+            cpu_run_for(&cpu, 10000);
+            passed = get_flag(&cpu, FLAG_HALT) && cpu_restore(&cpu);
+            cpu_sync_flags(&cpu);
+            passed = passed && memcmp(&cpu.regs, &regs, sizeof(Registers)) == 0 &&
+                     cpu.cycles == cycles && cpu.instructions == instructions &&
+                     memcmp(cpu.memory, memory, MEMORY_SIZE) == 0;
+        }
+        cpu_drop_snapshot(&cpu);
+        cpu_free(&cpu);
+
+        printf("%-9s %s\n", cpu_engine_name(engines[e]), passed ? "PASS" : "FAIL");
+        ok = ok && passed;
+    }
+    return ok;
+}
+
 int main(int argc, char *argv[]) {
     printf("=== Software CPU Emulator ===\n\n");
     
@@ -178,12 +282,24 @@ int main(int argc, char *argv[]) {
     }
     
     if (strcmp(argv[1], "assemble") == 0) {
-        if (argc != 4) {
-            printf("Usage: %s assemble <input.asm> <output.bin>\n", argv[0]);
+        bool object = false;
+        bool optimize = false;
+        bool usage = argc < 4;
+        for (int i = 4; i < argc; i++) {
+            if (strcmp(argv[i], "--object") == 0) {
+                object = true;
+            } else if (strcmp(argv[i], "--optimize") == 0) {
+                optimize = true;
+            } else {
+                usage = true;
+            }
+        }
+        if (usage) {
+            printf("Usage: %s assemble <input.asm> <output.bin> [--object] [--optimize]\n", argv[0]);
             return 1;
         }
         
-        if (assemble_file(argv[2], argv[3])) {
+        if (assemble_file(argv[2], argv[3], object, optimize)) {
             printf("Assembly successful!\n");
             return 0;
         } else {
@@ -191,47 +307,405 @@ int main(int argc, char *argv[]) {
             return 1;
         }
     }
+    else if (strcmp(argv[1], "link") == 0) {
+        if (argc < 4) {
+            printf("Usage: %s link <output.bin> <input.obj>...\n", argv[0]);
+            return 1;
+        }
+
+        if (link_objects(argv[2], argv + 3, argc - 3)) {
+            printf("Link successful!\n");
+            return 0;
+        } else {
+            printf("Link failed!\n");
+            return 1;
+        }
+    }
     else if (strcmp(argv[1], "run") == 0) {
-        if (argc != 3) {
-            printf("Usage: %s run <program.bin>\n", argv[0]);
+        if (argc < 3) {
+            printf("Usage: %s run <program.bin> [interp|threaded|jit] [--fuse] [--lazy-flags] [--max-cycles N] [--unbuffered] [--output FILE] [--input FILE] [--virtual-timer HZ] [--no-idle-skip] [--trace FILE] [--costs FILE]\n", argv[0]);
             return 1;
         }
-        
-        FILE *f = fopen(argv[2], "rb");
-        if (!f) {
-            fprintf(stderr, "Error: Cannot open file '%s'\n", argv[2]);
+
+        CpuEngine engine = CPU_ENGINE_INTERP;
+        bool fuse = false;
+        bool lazy_flags = false;
+        bool idle_skip = true;
+        uint64_t max_cycles = UINT64_MAX;
+        bool unbuffered = false;
+        const char *output_path = NULL;
+        const char *input_path = NULL;
+        const char *trace_path = NULL;
+        const char *costs_path = NULL;
+        uint64_t clock_hz = 0;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--fuse") == 0) {
+                fuse = true;
+            } else if (strcmp(argv[i], "--lazy-flags") == 0) {
+                lazy_flags = true;
+            } else if (strcmp(argv[i], "--unbuffered") == 0) {
+                unbuffered = true;
+            } else if (strcmp(argv[i], "--no-idle-skip") == 0) {
+                idle_skip = false;
+            } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+                output_path = argv[++i];
+            } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+                input_path = argv[++i];
+            } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+                trace_path = argv[++i];
+            } else if (strcmp(argv[i], "--costs") == 0 && i + 1 < argc) {
+                costs_path = argv[++i];
+            } else if (strcmp(argv[i], "--virtual-timer") == 0 && i + 1 < argc) {
+                clock_hz = strtoull(argv[++i], NULL, 0);
+            } else if (strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc) {
+                max_cycles = strtoull(argv[++i], NULL, 0);
+            } else if (!parse_engine(argv[i], &engine)) {
+                printf("Unknown option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        CycleCostModel costs;
+        cycle_costs_default(&costs);
+        if (costs_path && !cycle_costs_load(&costs, costs_path)) {
             return 1;
         }
-        
-        fseek(f, 0, SEEK_END);
-        long size = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        
-        uint8_t *program = malloc(size);
-        fread(program, 1, size, f);
-        fclose(f);
-        
+
+        size_t size;
+        uint8_t *program = read_program(argv[2], &size);
+        if (!program) {
+            return 1;
+        }
+
         CPU cpu;
         cpu_init(&cpu);
+        cpu_set_engine(&cpu, engine);
+        cpu_set_fusion(&cpu, fuse);
+        cpu_set_lazy_flags(&cpu, lazy_flags);
+        cpu_set_idle_skip(&cpu, idle_skip);
+        cpu_set_cycle_costs(&cpu, &costs);
+        if (clock_hz > 0) {
+            cpu_set_timer(&cpu, TIMER_VIRTUAL, clock_hz);
+        }
         cpu_load_program(&cpu, program, size, 0);
+        int output_fd = -1;
+        if (output_path) {
+            output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (output_fd < 0) {
+                fprintf(stderr, "Error: Cannot create file '%s'\n", output_path);
+                cpu_free(&cpu);
+                free(program);
+                return 1;
+            }
+        }
+        ConsoleOutput output;
+        console_output_init(&output, output_fd >= 0 ? output_fd : STDOUT_FILENO, !unbuffered);
+        cpu_map_console_output(&cpu, &output);
+        InputTape tape;
+        input_tape_init(&tape, NULL, 0, true);
+        if (input_path) {
+            if (!input_tape_open_file(&tape, input_path)) {
+                fprintf(stderr, "Error: Cannot open file '%s'\n", input_path);
+                cpu_free(&cpu);
+                if (output_fd >= 0) {
+                    close(output_fd);
+                }
+                free(program);
+                return 1;
+            }
+            cpu_map_input_tape(&cpu, &tape);
+        }
+        if (trace_path && !cpu_trace_start(&cpu, trace_path)) {
+            cpu_free(&cpu);
+            input_tape_free(&tape);
+            if (output_fd >= 0) {
+                close(output_fd);
+            }
+            free(program);
+            return 1;
+        }
         
-        printf("Running program '%s' (%ld bytes)...\n\n", argv[2], size);
-        cpu_run(&cpu);
+        printf("Running program '%s' (%zu bytes, %s engine)...\n\n",
+               argv[2], size, cpu_engine_name(engine));
+        CpuExitReason reason = cpu_run_for(&cpu, max_cycles);
+        if (reason != CPU_EXIT_HALTED) {
+            printf("\n[CPU stopped: %s]\n", cpu_exit_reason_name(reason));
+        }
+        if (trace_path && cpu_trace_stop(&cpu)) {
+            printf("\nTrace written to '%s'\n", trace_path);
+        }
         
         printf("\n");
         cpu_dump_registers(&cpu);
+        if (fuse) {
+            cpu_dump_fusion_stats(&cpu);
+        }
+        if (cpu.idle_skips > 0) {
+            cpu_dump_idle_stats(&cpu);
+        }
+        if (cpu.interrupts > 0 || cpu.wait_cycles > 0) {
+            cpu_dump_interrupt_stats(&cpu);
+        }
         
+        cpu_free(&cpu);
+        input_tape_free(&tape);
+        console_output_free(&output);
+        if (output_fd >= 0) {
+            close(output_fd);
+        }
+        free(program);
+        return 0;
+    }
+    else if (strcmp(argv[1], "batch") == 0) {
+        if (argc < 4) {
+            printf("Usage: %s batch <manifest> <results.jsonl> [interp|threaded|jit] [--fuse] [--threads N] [--max-cycles N] [--virtual-timer HZ]\n", argv[0]);
+            return 1;
+        }
+
+        BatchOptions options;
+        batch_options_init(&options);
+        for (int i = 4; i < argc; i++) {
+            if (strcmp(argv[i], "--fuse") == 0) {
+                options.fusion = true;
+            } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                options.threads = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc) {
+                options.max_cycles = strtoull(argv[++i], NULL, 0);
+            } else if (strcmp(argv[i], "--virtual-timer") == 0 && i + 1 < argc) {
+                options.clock_hz = strtoull(argv[++i], NULL, 0);
+            } else if (!parse_engine(argv[i], &options.engine)) {
+                printf("Unknown option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+
+        BatchJob *jobs;
+        int count;
+        if (!batch_load_manifest(argv[2], &jobs, &count)) {
+            return 1;
+        }
+        FILE *out = fopen(argv[3], "w");
+        if (!out) {
+            fprintf(stderr, "Error: Cannot create file '%s'\n", argv[3]);
+            batch_free_jobs(jobs, count);
+            return 1;
+        }
+
+        BatchResult *results = calloc(count > 0 ? count : 1, sizeof(BatchResult));
+        bool ok = results && batch_run(jobs, count, &options, results);
+        int failed = 0;
+        if (ok) {
+            batch_write_jsonl(out, jobs, results, count);
+            for (int i = 0; i < count; i++) {
+                failed += !results[i].ok;
+            }
+            batch_free_results(results, count);
+        }
+        fclose(out);
+        free(results);
+        batch_free_jobs(jobs, count);
+
+        printf("Batch complete: %d runs (%d failed), results in '%s'\n", count, failed, argv[3]);
+        return ok ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "trace-dump") == 0) {
+        if (argc < 3) {
+            printf("Usage: %s trace-dump <trace.bin> [--from ADDR] [--to ADDR]\n", argv[0]);
+            return 1;
+        }
+
+        uint16_t from = 0;
+        uint16_t to = 0xFFFF;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+                from = strtoul(argv[++i], NULL, 0);
+            } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+                to = strtoul(argv[++i], NULL, 0);
+            } else {
+                printf("Unknown option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        return trace_dump(argv[2], from, to) ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "profile") == 0) {
+        if (argc < 3) {
+            printf("Usage: %s profile <program.bin> [engine] [--top N] [--max-cycles N] [--input FILE] [--virtual-timer HZ] [--no-idle-skip] [--symbols FILE] [--folded FILE] [--costs FILE]\n", argv[0]);
+            return 1;
+        }
+
+        CpuEngine engine = CPU_ENGINE_INTERP;
+        int top = 10;
+        uint64_t max_cycles = UINT64_MAX;
+        const char *input_path = NULL;
+        uint64_t clock_hz = 0;
+        bool idle_skip = true;
+        const char *symbol_path = NULL;
+        const char *folded_path = NULL;
+        const char *costs_path = NULL;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) {
+                symbol_path = argv[++i];
+            } else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc) {
+                folded_path = argv[++i];
+            } else if (strcmp(argv[i], "--costs") == 0 && i + 1 < argc) {
+                costs_path = argv[++i];
+            } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+                top = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc) {
+                max_cycles = strtoull(argv[++i], NULL, 0);
+            } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+                input_path = argv[++i];
+            } else if (strcmp(argv[i], "--virtual-timer") == 0 && i + 1 < argc) {
+                clock_hz = strtoull(argv[++i], NULL, 0);
+            } else if (strcmp(argv[i], "--no-idle-skip") == 0) {
+                idle_skip = false;
+            } else if (!parse_engine(argv[i], &engine)) {
+                printf("Unknown option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        CycleCostModel costs;
+        cycle_costs_default(&costs);
+        if (costs_path && !cycle_costs_load(&costs, costs_path)) {
+            return 1;
+        }
+
+        size_t size;
+        uint8_t *program = read_program(argv[2], &size);
+        if (!program) {
+            return 1;
+        }
+        // Symbols from --symbols, else the assembler's map next to the program
+        SymbolTable symbols;
+        symbols_init(&symbols);
+        char default_symbols[1024];
+        if (!symbol_path) {
+            symbol_map_path(argv[2], default_symbols, sizeof(default_symbols));
+            symbols_load(&symbols, default_symbols);
+        } else if (!symbols_load(&symbols, symbol_path)) {
+            fprintf(stderr, "Error: Cannot open file '%s'\n", symbol_path);
+            free(program);
+            return 1;
+        }
+        CPU cpu;
+        cpu_init(&cpu);
+        cpu_set_engine(&cpu, engine);
+        cpu_set_idle_skip(&cpu, idle_skip);
+        cpu_set_cycle_costs(&cpu, &costs);
+        if (clock_hz > 0) {
+            cpu_set_timer(&cpu, TIMER_VIRTUAL, clock_hz);
+        }
+        InputTape tape;
+        input_tape_init(&tape, NULL, 0, true);
+        if (input_path) {
+            if (!input_tape_open_file(&tape, input_path)) {
+                fprintf(stderr, "Error: Cannot open file '%s'\n", input_path);
+                cpu_free(&cpu);
+                symbols_free(&symbols);
+                free(program);
+                return 1;
+            }
+            cpu_map_input_tape(&cpu, &tape);
+        }
+        if (!cpu_set_profiling(&cpu, true)) {
+            cpu_free(&cpu);
+            input_tape_free(&tape);
+            symbols_free(&symbols);
+            free(program);
+            return 1;
+        }
+        cpu_load_program(&cpu, program, size, 0);
+
+        printf("Profiling program '%s' (%zu bytes, %s engine)...\n\n",
+               argv[2], size, cpu_engine_name(engine));
+        CpuExitReason reason = cpu_run_for(&cpu, max_cycles);
+        if (reason != CPU_EXIT_HALTED) {
+            printf("\n[CPU stopped: %s]\n", cpu_exit_reason_name(reason));
+        }
+        cpu_dump_profile(&cpu, top, symbols.count > 0 ? &symbols : NULL);
+        bool ok = true;
+        if (folded_path) {
+            ok = cpu_write_folded_stacks(&cpu, &symbols, folded_path);
+            if (ok) {
+                printf("\nFolded stacks written to '%s'\n", folded_path);
+            }
+        }
+
+        cpu_free(&cpu);
+        input_tape_free(&tape);
+        symbols_free(&symbols);
+        free(program);
+        return ok ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "sweep") == 0) {
+        if (argc < 4) {
+            printf("Usage: %s sweep <program.bin> <lanes> [--max-steps N]\n", argv[0]);
+            return 1;
+        }
+
+        char *end;
+        long lanes = strtol(argv[3], &end, 10);
+        if (end == argv[3] || *end != '\0' || lanes < 1 || lanes > BUNDLE_MAX_LANES) {
+            fprintf(stderr, "Error: Lanes must be a whole number from 1 to %d\n", BUNDLE_MAX_LANES);
+            return 1;
+        }
+        uint64_t max_steps = UINT64_MAX;
+        for (int i = 4; i < argc; i++) {
+            if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc) {
+                max_steps = strtoull(argv[++i], NULL, 0);
+            } else {
+                printf("Unknown option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+
+        size_t size;
+        uint8_t *program = read_program(argv[2], &size);
+        if (!program) {
+            return 1;
+        }
+
+        CpuBundle bundle;
+        if (!bundle_init(&bundle, lanes)) {
+            free(program);
+            return 1;
+        }
+        bundle_load_program(&bundle, program, size, 0);
+        for (int lane = 0; lane < lanes; lane++) {
+            Registers regs;
+            bundle_get_regs(&bundle, lane, &regs);
+            regs.A = lane;
+            bundle_set_regs(&bundle, lane, &regs);
+        }
+
+        uint64_t steps = bundle_run(&bundle, max_steps);
+        printf("Lane  Exit              A      B      C      D      Cycles\n");
+        for (long lane = 0; lane < lanes; lane++) {
+            Registers regs;
+            bundle_get_regs(&bundle, lane, &regs);
+            const char *exit = bundle.active[lane]
+                                   ? cpu_exit_reason_name(CPU_EXIT_BUDGET)
+                                   : cpu_exit_reason_name(bundle_lane_cpu(&bundle, lane)->exit_reason);
+            printf("%-5ld %-17s 0x%04X 0x%04X 0x%04X 0x%04X %llu\n", lane, exit,
+                   regs.A, regs.B, regs.C, regs.D, (unsigned long long)bundle.cycles[lane]);
+        }
+        printf("\n%llu steps: %llu vector, %llu scalar\n", (unsigned long long)steps,
+               (unsigned long long)bundle.vector_steps, (unsigned long long)bundle.scalar_steps);
+
+        bundle_free(&bundle);
         free(program);
         return 0;
     }
     else if (strcmp(argv[1], "demo") == 0) {
         if (argc != 3) {
-            printf("Usage: %s demo <fibonacci|hello|timer>\n", argv[0]);
+            printf("Usage: %s demo <fibonacci|hello|timer|snapshot>\n", argv[0]);
             return 1;
         }
         
         CPU cpu;
         cpu_init(&cpu);
+        // Guest output is interleaved with the per-step trace
+        console_output_set_buffered(&cpu.console, false);
         
         if (strcmp(argv[2], "fibonacci") == 0) {
             create_fibonacci_demo(&cpu);
@@ -313,9 +787,13 @@ int main(int argc, char *argv[]) {
         else if (strcmp(argv[2], "timer") == 0) {
             create_timer_demo(&cpu);
         }
+        else if (strcmp(argv[2], "snapshot") == 0) {
+            printf("Snapshot, run to HALT, restore and compare (twice per engine)\n");
+            return run_snapshot_check() ? 0 : 1;
+        }
         else {
             printf("Unknown demo: %s\n", argv[2]);
-            printf("Available demos: fibonacci, hello, timer\n");
+            printf("Available demos: fibonacci, hello, timer, snapshot\n");
             return 1;
         }
         
@@ -0,0 +1,489 @@
+#include "cpu.h"
+#include "symbols.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Execution profiler.
+//
+// While cpu->profile is set, every instruction retired goes through
+// profile_retire: one increment into a 64K table indexed by PC, and a second
+// counter only when the instruction moved PC somewhere other than the next
+// instruction (a taken branch, JMP, CALL or RET). The instruction mix,
+// not-taken counts and loops are worked out from those two tables when the
+// report is printed, using the code in memory at that point. Device
+// accesses are counted per device on the MMIO path in cpu.c. With
+// profiling off none of this runs; the threaded core only tests a pointer.
+//
+// The reference engine (and any engine while tracing) runs its slices
+// through cpu_run_profiled below; the threaded core calls profile_retire
+// from its dispatch. The JIT has no counting path, so profiling with it
+// runs the threaded core instead.
+//
+// Fusion is off while profiling so every guest instruction is counted at
+// its own address. Passes skipped by the idle-loop fast-forward are not
+// counted, so the instruction total can be below the cycle count.
+//
+// Cycles are attributed to functions through a shadow call stack kept as a
+// call tree: CALL and taken interrupts enter a child node for the target,
+// RET and IRET return to the parent. Cycles are charged to the node on top
+// only when it changes (and when a slice ends), so the per-instruction cost
+// stays the same. Each node's cycles are its exclusive cost for that call
+// path; the report adds them up per function (inclusive and exclusive),
+// and cpu_write_folded_stacks writes one "root;caller;callee cycles" line
+// per path, the input format of flamegraph tools.
+
+#define PROFILE_MAX_NODES 4096  // Distinct call paths; deeper calls stay with the caller
+
+// Call-tree node: one per distinct path of calls from the root
+typedef struct {
+    uint16_t function;    // Entry address: call target or interrupt handler
+    int parent;           // -1 for the root
+    int first_child;
+    int next_sibling;
+    uint64_t cycles;      // Cycles spent with this node on top
+    uint64_t calls;
+} ProfileNode;
+
+struct CpuProfile {
+    uint64_t pc_hits[MEMORY_SIZE];    // Instructions executed at each address
+    uint64_t transfers[MEMORY_SIZE];  // Executions that did not fall through
+    uint16_t targets[MEMORY_SIZE];    // Where the last of those went
+    uint64_t device_reads[MAX_MMIO_DEVICES];
+    uint64_t device_writes[MAX_MMIO_DEVICES];
+    ProfileNode nodes[PROFILE_MAX_NODES];
+    int node_count;
+    int current;          // Top of the shadow call stack
+    int lost_frames;      // Calls made with the tree full, not yet returned
+    uint64_t charged;     // cycles up to which nodes have been charged
+};
+
+// Per-function totals for the report
+typedef struct {
+    uint64_t inclusive;
+    uint64_t exclusive;
+    uint64_t calls;
+    int last_node;        // Node whose path last counted this function (inclusive)
+} FunctionCost;
+
+// One line of a sorted report
+typedef struct {
+    uint64_t count;  // Sort key, largest first
+    uint64_t extra;
+    uint32_t key;    // Address or (opcode << 2 | mode); ties sort by key
+} ProfileRow;
+
+// Empty tables, with the call tree rooted at the current PC
+static void profile_reset(CPU *cpu) {
+    CpuProfile *profile = cpu->profile;
+    memset(profile, 0, sizeof(CpuProfile));
+    profile->nodes[0] = (ProfileNode){ cpu->regs.PC, -1, -1, -1, 0, 1 };
+    profile->node_count = 1;
+    profile->charged = cpu->cycles;
+}
+
+// Start (counts cleared) or stop profiling; false if the tables cannot be allocated
+bool cpu_set_profiling(CPU *cpu, bool enabled) {
+    if (enabled == (cpu->profile != NULL)) {
+        if (enabled) {
+            profile_reset(cpu);
+        }
+        return true;
+    }
+    if (enabled) {
+        cpu->profile = malloc(sizeof(CpuProfile));
+        if (!cpu->profile) {
+            fprintf(stderr, "Error: Cannot allocate profile\n");
+            return false;
+        }
+        profile_reset(cpu);
+    } else {
+        free(cpu->profile);
+        cpu->profile = NULL;
+    }
+    // Cached entries were fused (or not) for the other setting
+    cpu_invalidate_decode_cache(cpu);
+    return true;
+}
+
+// Charge the cycles since the last change of stack to the node on top
+static void profile_charge(CpuProfile *profile, uint64_t cycles) {
+    if (cycles > profile->charged) {
+        profile->nodes[profile->current].cycles += cycles - profile->charged;
+    }
+    profile->charged = cycles;
+}
+
+// Push a call to function onto the shadow stack
+static void profile_enter(CPU *cpu, uint16_t function) {
+    CpuProfile *profile = cpu->profile;
+    profile_charge(profile, cpu->cycles);
+    ProfileNode *parent = &profile->nodes[profile->current];
+    int child = parent->first_child;
+    while (child >= 0 && profile->nodes[child].function != function) {
+        child = profile->nodes[child].next_sibling;
+    }
+    if (child < 0) {
+        if (profile->node_count == PROFILE_MAX_NODES) {
+            profile->lost_frames++;
+            return;
+        }
+        child = profile->node_count++;
+        profile->nodes[child] = (ProfileNode){ function, profile->current, -1,
+                                               parent->first_child, 0, 0 };
+        parent->first_child = child;
+    }
+    profile->nodes[child].calls++;
+    profile->current = child;
+}
+
+// Pop the shadow stack on RET / IRET; a return with nothing to pop is ignored
+static void profile_leave(CPU *cpu) {
+    CpuProfile *profile = cpu->profile;
+    profile_charge(profile, cpu->cycles);
+    if (profile->lost_frames > 0) {
+        profile->lost_frames--;
+    } else if (profile->nodes[profile->current].parent >= 0) {
+        profile->current = profile->nodes[profile->current].parent;
+    }
+}
+
+// An interrupt was taken: PC is at its handler
+void profile_interrupt(CPU *cpu) {
+    profile_enter(cpu, cpu->regs.PC);
+}
+
+// Count insn, which has just run. Breakpoints and I/O waits that stopped
+// it before it took effect run it again on resume: not counted yet.
+void profile_retire(CPU *cpu, const DecodedInsn *insn) {
+    if (!cpu->running &&
+        (cpu->regs.PC == insn->pc || cpu_io_wait_repeats(cpu, insn))) {
+        return;
+    }
+    CpuProfile *profile = cpu->profile;
+    uint16_t next = insn->pc + insn->length;
+    profile->pc_hits[insn->pc]++;
+    if (cpu->regs.PC != next) {
+        profile->transfers[insn->pc]++;
+        profile->targets[insn->pc] = cpu->regs.PC;
+        if (insn->opcode == OP_CALL) {
+            profile_enter(cpu, cpu->regs.PC);
+        } else if (insn->opcode == OP_RET || insn->opcode == OP_IRET) {
+            profile_leave(cpu);
+        }
+    }
+}
+
+// An engine slice ended: charge its cycles to the function on top
+void profile_end_slice(CPU *cpu) {
+    profile_charge(cpu->profile, cpu->cycles);
+}
+
+// Engine loop for cpu_run_for while profiling on the reference core or
+// tracing: run until cycles reaches run_until
+void cpu_run_profiled(CPU *cpu) {
+    DecodedInsn scratch;
+    while (cpu->cycles < cpu->run_until) {
+        uint16_t pc = cpu->regs.PC;
+        const DecodedInsn *insn = cpu_decode_cached(cpu, pc, &scratch);
+        cpu->regs.PC = pc + insn->length;
+        cpu->cycles += insn->cost;
+        cpu->instructions++;
+        insn->handler(cpu, insn);
+        if (!cpu->running) {
+            cpu_rewind_io_wait(cpu, insn);
+            if (cpu->regs.PC == pc) {
+                break;
+            }
+        }
+        if (cpu->trace) {
+            trace_record(cpu, insn);
+        }
+        profile_retire(cpu, insn);
+    }
+    profile_end_slice(cpu);
+}
+
+void profile_mmio_access(CPU *cpu, const MmioDevice *device, bool write) {
+    int index = device - cpu->devices;
+    if (write) {
+        cpu->profile->device_writes[index]++;
+    } else {
+        cpu->profile->device_reads[index]++;
+    }
+}
+
+static int compare_rows(const void *a, const void *b) {
+    const ProfileRow *x = a;
+    const ProfileRow *y = b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return total > 0 ? 100.0 * part / total : 0.0;
+}
+
+static bool is_jump(uint8_t opcode) {
+    return opcode >= OP_JMP && opcode <= OP_JNC;
+}
+
+static void dump_hot_addresses(const CPU *cpu, const SymbolTable *symbols, ProfileRow *rows,
+                               uint64_t total, int top) {
+    const CpuProfile *profile = cpu->profile;
+    int count = 0;
+    for (uint32_t pc = 0; pc < MEMORY_SIZE; pc++) {
+        if (profile->pc_hits[pc] > 0) {
+            rows[count++] = (ProfileRow){ profile->pc_hits[pc], 0, pc };
+        }
+    }
+    qsort(rows, count, sizeof(ProfileRow), compare_rows);
+
+    printf("\nHot addresses:\n");
+    printf("  %-8s %14s %7s  %-16s %s\n", "Address", "Count", "%", "Instruction",
+           symbols ? "Symbol" : "");
+    for (int i = 0; i < count && i < top; i++) {
+        char text[32];
+        char symbol[SYMBOL_NAME_LENGTH + 8] = "";
+        cpu_disassemble(cpu, rows[i].key, text, sizeof(text));
+        if (symbols) {
+            symbols_format(symbols, rows[i].key, symbol, sizeof(symbol));
+        }
+        printf("  0x%04X   %14llu %6.2f%%  %-16s %s\n", rows[i].key,
+               (unsigned long long)rows[i].count, percent(rows[i].count, total), text, symbol);
+    }
+}
+
+// Counts by opcode and addressing mode, from the instruction at each hit address
+static void dump_instruction_mix(const CPU *cpu, ProfileRow *rows, uint64_t total) {
+    static const char *const mode_names[4] = { "#imm", "addr", "reg", "[reg]" };
+    const CpuProfile *profile = cpu->profile;
+    uint64_t hits[256] = { 0 };
+    bool operandless[256] = { false };
+    for (uint32_t pc = 0; pc < MEMORY_SIZE; pc++) {
+        if (profile->pc_hits[pc] > 0) {
+            // The mode bits of operand-less instructions are ignored: fold them
+            char text[32];
+            uint8_t key = cpu->memory[pc];
+            if (cpu_disassemble(cpu, pc, text, sizeof(text)) == 1) {
+                key &= ~3;
+                operandless[key] = true;
+            }
+            hits[key] += profile->pc_hits[pc];
+        }
+    }
+    int count = 0;
+    for (int key = 0; key < 256; key++) {
+        if (hits[key] > 0) {
+            rows[count++] = (ProfileRow){ hits[key], 0, key };
+        }
+    }
+    qsort(rows, count, sizeof(ProfileRow), compare_rows);
+
+    printf("\nInstruction mix:\n");
+    printf("  %-14s %14s %7s\n", "Instruction", "Count", "%");
+    for (int i = 0; i < count; i++) {
+        char name[32];
+        const char *opcode = get_opcode_name(rows[i].key >> 2);
+        if (operandless[rows[i].key]) {
+            snprintf(name, sizeof(name), "%s", opcode);
+        } else {
+            snprintf(name, sizeof(name), "%s %s", opcode, mode_names[rows[i].key & 3]);
+        }
+        printf("  %-14s %14llu %6.2f%%\n", name, (unsigned long long)rows[i].count,
+               percent(rows[i].count, total));
+    }
+}
+
+// Conditional branch sites by executions
+static void dump_branches(const CPU *cpu, ProfileRow *rows, int top) {
+    const CpuProfile *profile = cpu->profile;
+    int count = 0;
+    for (uint32_t pc = 0; pc < MEMORY_SIZE; pc++) {
+        uint8_t opcode = cpu->memory[pc] >> 2;
+        if (profile->pc_hits[pc] > 0 && is_jump(opcode) && opcode != OP_JMP) {
+            rows[count++] = (ProfileRow){ profile->pc_hits[pc], profile->transfers[pc], pc };
+        }
+    }
+    qsort(rows, count, sizeof(ProfileRow), compare_rows);
+
+    printf("\nBranches:\n");
+    printf("  %-8s %-16s %14s %14s %14s %7s\n", "Address", "Instruction", "Executed",
+           "Taken", "Not taken", "Taken%");
+    for (int i = 0; i < count && i < top; i++) {
+        char text[32];
+        cpu_disassemble(cpu, rows[i].key, text, sizeof(text));
+        printf("  0x%04X   %-16s %14llu %14llu %14llu %6.1f%%\n", rows[i].key, text,
+               (unsigned long long)rows[i].count, (unsigned long long)rows[i].extra,
+               (unsigned long long)(rows[i].count - rows[i].extra),
+               percent(rows[i].extra, rows[i].count));
+    }
+}
+
+// Backward jumps: the loop runs from the target to the jump
+static void dump_loops(const CPU *cpu, ProfileRow *rows, uint64_t total, int top) {
+    const CpuProfile *profile = cpu->profile;
+    int count = 0;
+    for (uint32_t pc = 0; pc < MEMORY_SIZE; pc++) {
+        if (profile->transfers[pc] == 0 || !is_jump(cpu->memory[pc] >> 2) ||
+            profile->targets[pc] > pc) {
+            continue;
+        }
+        uint64_t body = 0;
+        for (uint32_t addr = profile->targets[pc]; addr <= pc; addr++) {
+            body += profile->pc_hits[addr];
+        }
+        rows[count++] = (ProfileRow){ body, profile->transfers[pc], pc };
+    }
+    qsort(rows, count, sizeof(ProfileRow), compare_rows);
+
+    printf("\nLoops:\n");
+    printf("  %-15s %14s %14s %7s\n", "Range", "Iterations", "Instructions", "%");
+    for (int i = 0; i < count && i < top; i++) {
+        printf("  0x%04X-0x%04X %14llu %14llu %6.2f%%\n", profile->targets[rows[i].key],
+               rows[i].key, (unsigned long long)rows[i].extra,
+               (unsigned long long)rows[i].count, percent(rows[i].count, total));
+    }
+}
+
+// Cycles of a call-tree node, including what has not been charged yet
+static uint64_t node_cycles(const CPU *cpu, int node) {
+    const CpuProfile *profile = cpu->profile;
+    uint64_t cycles = profile->nodes[node].cycles;
+    if (node == profile->current && cpu->cycles > profile->charged) {
+        cycles += cpu->cycles - profile->charged;
+    }
+    return cycles;
+}
+
+// Inclusive and exclusive cycles per function address. A function
+// appearing several times on one path (recursion) counts once inclusive.
+static uint64_t function_costs(const CPU *cpu, FunctionCost *costs) {
+    const CpuProfile *profile = cpu->profile;
+    uint64_t total = 0;
+    for (uint32_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        costs[addr] = (FunctionCost){ 0, 0, 0, -1 };
+    }
+    for (int i = 0; i < profile->node_count; i++) {
+        const ProfileNode *node = &profile->nodes[i];
+        uint64_t cycles = node_cycles(cpu, i);
+        costs[node->function].exclusive += cycles;
+        costs[node->function].calls += node->calls;
+        total += cycles;
+        if (cycles == 0) {
+            continue;
+        }
+        for (int n = i; n >= 0; n = profile->nodes[n].parent) {
+            FunctionCost *cost = &costs[profile->nodes[n].function];
+            if (cost->last_node != i) {
+                cost->last_node = i;
+                cost->inclusive += cycles;
+            }
+        }
+    }
+    return total;
+}
+
+static void dump_functions(const CPU *cpu, const SymbolTable *symbols, ProfileRow *rows, int top) {
+    FunctionCost *costs = malloc(MEMORY_SIZE * sizeof(FunctionCost));
+    if (!costs) {
+        return;
+    }
+    uint64_t total = function_costs(cpu, costs);
+    int count = 0;
+    for (uint32_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (costs[addr].calls > 0) {
+            rows[count++] = (ProfileRow){ costs[addr].inclusive, costs[addr].exclusive, addr };
+        }
+    }
+    qsort(rows, count, sizeof(ProfileRow), compare_rows);
+
+    printf("\nFunctions (cycles):\n");
+    printf("  %-24s %10s %14s %7s %14s %7s\n", "Function", "Calls", "Inclusive", "%",
+           "Exclusive", "%");
+    for (int i = 0; i < count && i < top; i++) {
+        char name[SYMBOL_NAME_LENGTH + 8];
+        symbols_format(symbols, rows[i].key, name, sizeof(name));
+        printf("  %-24s %10llu %14llu %6.2f%% %14llu %6.2f%%\n", name,
+               (unsigned long long)costs[rows[i].key].calls,
+               (unsigned long long)rows[i].count, percent(rows[i].count, total),
+               (unsigned long long)rows[i].extra, percent(rows[i].extra, total));
+    }
+    free(costs);
+}
+
+static void dump_devices(const CPU *cpu) {
+    const CpuProfile *profile = cpu->profile;
+    printf("\nDevice accesses:\n");
+    printf("  %-12s %14s %14s\n", "Device", "Reads", "Writes");
+    for (int i = 0; i < cpu->device_count; i++) {
+        if (profile->device_reads[i] > 0 || profile->device_writes[i] > 0) {
+            printf("  %-12s %14llu %14llu\n", cpu->devices[i].name,
+                   (unsigned long long)profile->device_reads[i],
+                   (unsigned long long)profile->device_writes[i]);
+        }
+    }
+}
+
+// Print the top entries of each profile table; symbols may be NULL
+void cpu_dump_profile(const CPU *cpu, int top, const SymbolTable *symbols) {
+    const CpuProfile *profile = cpu->profile;
+    if (!profile) {
+        return;
+    }
+    ProfileRow *rows = malloc(MEMORY_SIZE * sizeof(ProfileRow));
+    if (!rows) {
+        fprintf(stderr, "Error: Cannot allocate profile report\n");
+        return;
+    }
+    uint64_t total = 0;
+    for (uint32_t pc = 0; pc < MEMORY_SIZE; pc++) {
+        total += profile->pc_hits[pc];
+    }
+
+    printf("\n=== Profile ===\n");
+    printf("Instructions: %llu (%llu cycles)\n", (unsigned long long)total,
+           (unsigned long long)cpu->cycles);
+    dump_hot_addresses(cpu, symbols, rows, total, top);
+    dump_instruction_mix(cpu, rows, total);
+    dump_branches(cpu, rows, top);
+    dump_loops(cpu, rows, total, top);
+    dump_functions(cpu, symbols, rows, top);
+    dump_devices(cpu);
+    free(rows);
+}
+
+// Write the call tree as folded stacks: one line per call path with its
+// exclusive cycles, frames named from symbols (addresses when NULL)
+bool cpu_write_folded_stacks(const CPU *cpu, const SymbolTable *symbols, const char *path) {
+    const CpuProfile *profile = cpu->profile;
+    if (!profile) {
+        return false;
+    }
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot create file '%s'\n", path);
+        return false;
+    }
+    int stack[PROFILE_MAX_NODES];
+    for (int i = 0; i < profile->node_count; i++) {
+        uint64_t cycles = node_cycles(cpu, i);
+        if (cycles == 0) {
+            continue;
+        }
+        int depth = 0;
+        for (int n = i; n >= 0; n = profile->nodes[n].parent) {
+            stack[depth++] = n;
+        }
+        while (depth-- > 0) {
+            char name[SYMBOL_NAME_LENGTH + 8];
+            symbols_format(symbols, profile->nodes[stack[depth]].function, name, sizeof(name));
+            fprintf(out, "%s%c", name, depth > 0 ? ';' : ' ');
+        }
+        fprintf(out, "%llu\n", (unsigned long long)cycles);
+    }
+    fclose(out);
+    return true;
+}
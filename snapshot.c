@@ -0,0 +1,106 @@
+#include "cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Copy-on-write snapshots of CPU state.
+//
+// cpu_snapshot saves the registers and clears the CPU's dirty-page bitmap;
+// memory is not copied. The first write to a clean page (track_write in
+// cpu.c) saves that page's contents and marks it dirty, so cpu_restore only
+// copies back the pages touched since the snapshot or the last restore.
+// Saved pages stay valid across restores, so repeated restores to the same
+// snapshot never copy a page out twice. Device state is not captured.
+
+struct CpuSnapshot {
+    Registers regs;
+    uint64_t cycles;
+    uint64_t instructions;
+    bool running;
+    bool waiting;
+    CpuExitReason exit_reason;
+    uint64_t saved_pages[MEMORY_SIZE / 256 / 64];  // Pages whose contents are in memory[]
+    uint8_t memory[MEMORY_SIZE];
+};
+
+static inline bool page_bit(const uint64_t *bitmap, uint8_t page) {
+    return (bitmap[page >> 6] >> (page & 63)) & 1;
+}
+
+// Take a snapshot, replacing any previous one
+bool cpu_snapshot(CPU *cpu) {
+    if (!cpu->snapshot) {
+        cpu->snapshot = malloc(sizeof(CpuSnapshot));
+        if (!cpu->snapshot) {
+            fprintf(stderr, "Error: Cannot allocate snapshot\n");
+            return false;
+        }
+    }
+    CpuSnapshot *snapshot = cpu->snapshot;
+    cpu_sync_flags(cpu);
+    snapshot->regs = cpu->regs;
+    snapshot->cycles = cpu->cycles;
+    snapshot->instructions = cpu->instructions;
+    snapshot->running = cpu->running;
+    snapshot->waiting = cpu->waiting;
+    snapshot->exit_reason = cpu->exit_reason;
+    memset(snapshot->saved_pages, 0, sizeof(snapshot->saved_pages));
+    memset(cpu->dirty_pages, 0, sizeof(cpu->dirty_pages));
+    return true;
+}
+
+// First write to a clean page: keep its snapshot contents
+void snapshot_page_write(CPU *cpu, uint8_t page) {
+    CpuSnapshot *snapshot = cpu->snapshot;
+    cpu->dirty_pages[page >> 6] |= 1ULL << (page & 63);
+    if (!page_bit(snapshot->saved_pages, page)) {
+        memcpy(&snapshot->memory[page << 8], &cpu->memory[page << 8], 256);
+        snapshot->saved_pages[page >> 6] |= 1ULL << (page & 63);
+    }
+}
+
+static void restore_page(CPU *cpu, const CpuSnapshot *snapshot, uint8_t page) {
+    uint8_t *memory = &cpu->memory[page << 8];
+    const uint8_t *saved = &snapshot->memory[page << 8];
+    if (!cpu->code_pages[page]) {
+        memcpy(memory, saved, 256);
+        return;
+    }
+    // Page holds cached code: drop only decodes covering bytes that change
+    for (int i = 0; i < 256; i++) {
+        if (memory[i] != saved[i]) {
+            memory[i] = saved[i];
+            cpu_invalidate_code(cpu, (page << 8) | i);
+        }
+    }
+}
+
+// Return to the last snapshot; false if there is none
+bool cpu_restore(CPU *cpu) {
+    CpuSnapshot *snapshot = cpu->snapshot;
+    if (!snapshot) {
+        return false;
+    }
+    for (int page = 0; page < MEMORY_SIZE / 256; page++) {
+        if (page_bit(cpu->dirty_pages, page)) {
+            restore_page(cpu, snapshot, page);
+        }
+    }
+    memset(cpu->dirty_pages, 0, sizeof(cpu->dirty_pages));
+
+    cpu->regs = snapshot->regs;
+    cpu->flags_pending = 0;
+    cpu->cycles = snapshot->cycles;
+    cpu->instructions = snapshot->instructions;
+    cpu->running = snapshot->running;
+    cpu->waiting = snapshot->waiting;
+    cpu->exit_reason = snapshot->exit_reason;
+    return true;
+}
+
+// Discard the snapshot and stop tracking writes
+void cpu_drop_snapshot(CPU *cpu) {
+    free(cpu->snapshot);
+    cpu->snapshot = NULL;
+    memset(cpu->dirty_pages, 0xFF, sizeof(cpu->dirty_pages));
+}
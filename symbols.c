@@ -0,0 +1,109 @@
+#include "symbols.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Symbol map for a program image: the same path with its extension
+// replaced by .sym (or .sym appended when there is none)
+void symbol_map_path(const char *program_path, char *path, size_t size) {
+    const char *slash = strrchr(program_path, '/');
+    const char *dot = strrchr(program_path, '.');
+    size_t stem = (dot && (!slash || dot > slash)) ? (size_t)(dot - program_path)
+                                                   : strlen(program_path);
+    snprintf(path, size, "%.*s.sym", (int)stem, program_path);
+}
+
+void symbols_init(SymbolTable *table) {
+    table->symbols = NULL;
+    table->count = 0;
+}
+
+static int compare_symbols(const void *a, const void *b) {
+    const Symbol *x = a;
+    const Symbol *y = b;
+    if (x->address != y->address) {
+        return x->address < y->address ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+// Read a symbol map, replacing the table's contents
+bool symbols_load(SymbolTable *table, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    symbols_free(table);
+
+    int capacity = 64;
+    table->symbols = malloc(capacity * sizeof(Symbol));
+    char line[256];
+    while (table->symbols && fgets(line, sizeof(line), f)) {
+        unsigned int address;
+        char name[SYMBOL_NAME_LENGTH];
+        if (line[0] == '#' || sscanf(line, "%x %63s", &address, name) != 2) {
+            continue;
+        }
+        if (table->count == capacity) {
+            capacity *= 2;
+            Symbol *grown = realloc(table->symbols, capacity * sizeof(Symbol));
+            if (!grown) {
+                break;
+            }
+            table->symbols = grown;
+        }
+        Symbol *symbol = &table->symbols[table->count++];
+        symbol->address = address;
+        strcpy(symbol->name, name);
+    }
+    fclose(f);
+    if (!table->symbols) {
+        table->count = 0;
+        return false;
+    }
+    qsort(table->symbols, table->count, sizeof(Symbol), compare_symbols);
+    return true;
+}
+
+void symbols_free(SymbolTable *table) {
+    free(table->symbols);
+    symbols_init(table);
+}
+
+// Symbol covering addr: the last one at or below it (NULL if none)
+const Symbol *symbols_find(const SymbolTable *table, uint16_t addr) {
+    if (!table) {
+        return NULL;
+    }
+    int low = 0;
+    int high = table->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (table->symbols[mid].address <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return NULL;
+    }
+    // Several labels at one address: use the first
+    const Symbol *symbol = &table->symbols[low - 1];
+    while (symbol > table->symbols && symbol[-1].address == symbol->address) {
+        symbol--;
+    }
+    return symbol;
+}
+
+// "label", "label+0x12", or the bare address when no symbol covers it
+void symbols_format(const SymbolTable *table, uint16_t addr, char *text, size_t size) {
+    const Symbol *symbol = symbols_find(table, addr);
+    if (!symbol) {
+        snprintf(text, size, "0x%04X", addr);
+    } else if (symbol->address == addr) {
+        snprintf(text, size, "%s", symbol->name);
+    } else {
+        snprintf(text, size, "%s+0x%X", symbol->name, addr - symbol->address);
+    }
+}
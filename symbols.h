@@ -0,0 +1,30 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SYMBOL_NAME_LENGTH 64
+
+// Symbol map: one "<hex address> <label>" line per label, written by the
+// assembler next to the program image (program.bin -> program.sym)
+typedef struct {
+    uint16_t address;
+    char name[SYMBOL_NAME_LENGTH];
+} Symbol;
+
+typedef struct SymbolTable {
+    Symbol *symbols;      // Sorted by address
+    int count;
+} SymbolTable;
+
+// Function declarations
+void symbol_map_path(const char *program_path, char *path, size_t size);
+void symbols_init(SymbolTable *table);
+bool symbols_load(SymbolTable *table, const char *path);
+void symbols_free(SymbolTable *table);
+const Symbol *symbols_find(const SymbolTable *table, uint16_t addr);
+void symbols_format(const SymbolTable *table, uint16_t addr, char *text, size_t size);
+
+#endif // SYMBOLS_H
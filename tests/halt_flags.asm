@@ -0,0 +1,9 @@
+; Peephole check: HALT keeps the final FLAGS, so the carry from ADD must
+; survive removing CMP #0 (expected FLAGS 0x80, no C)
+
+start:
+    LOAD #0xFFFF
+    ADD #1              ; Sets C
+    LOAD #5
+    CMP #0              ; Clears C
+    HALT
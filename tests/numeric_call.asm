@@ -0,0 +1,13 @@
+; Peephole check: a numeric CALL target must move with the code when the
+; LOAD B after MOV A B is dropped (expected A = 7)
+
+start:
+    LOAD #5             ; 0x0000
+    MOV A B             ; 0x0003
+    LOAD B              ; 0x0006, removed by --optimize
+    CALL #0x000E        ; 0x0008
+    HALT                ; 0x000B
+    NOP
+    NOP
+    LOAD #7             ; 0x000E
+    RET
@@ -0,0 +1,260 @@
+#include "cpu.h"
+#include <stdio.h>
+
+// Direct-threaded interpreter core.
+//
+// Each decode-cache entry carries the address of the handler for its
+// (opcode, mode) pair, and every handler ends by jumping straight to the
+// next instruction's handler. That replaces the opcode switch and the
+// operand-mode switch of cpu_step with a single indirect branch per guest
+// instruction. Decoding, caching and self-modifying-code invalidation are
+// shared with the reference core in cpu.c.
+
+#if defined(__GNUC__)
+
+// Branchless equivalent of update_flags
+static inline void set_zn(CPU *cpu, uint16_t result) {
+    cpu->regs.FLAGS = (cpu->regs.FLAGS & ~(FLAG_ZERO | FLAG_NEGATIVE)) |
+                      (result == 0 ? FLAG_ZERO : 0) |
+                      ((result & 0x8000) ? FLAG_NEGATIVE : 0);
+}
+
+// C from carry, O from bit 15 of sign_bits
+static inline void set_carry_overflow(CPU *cpu, bool carry, uint32_t sign_bits) {
+    cpu->regs.FLAGS = (cpu->regs.FLAGS & ~(FLAG_CARRY | FLAG_OVERFLOW)) |
+                      (carry ? FLAG_CARRY : 0) |
+                      ((sign_bits & 0x8000) ? FLAG_OVERFLOW : 0);
+}
+
+void cpu_run_threaded(CPU *cpu) {
+    // Handler address for every instruction byte (opcode << 2 | mode)
+#define MODES(name) &&name##_imm, &&name##_dir, &&name##_reg, &&name##_ind
+#define ANY_MODE(name) &&name, &&name, &&name, &&name
+    static const void *const dispatch_table[256] = {
+        ANY_MODE(op_nop),   MODES(op_load),  MODES(op_store), MODES(op_mov),
+        MODES(op_push),     ANY_MODE(op_pop), MODES(op_add),  MODES(op_sub),
+        MODES(op_inc),      MODES(op_dec),   MODES(op_mul),   MODES(op_div),
+        MODES(op_and),      MODES(op_or),    MODES(op_xor),   ANY_MODE(op_not),
+        MODES(op_shl),      MODES(op_shr),   MODES(op_cmp),   MODES(op_test),
+        MODES(op_jmp),      MODES(op_jz),    MODES(op_jnz),   MODES(op_jc),
+        MODES(op_jnc),      MODES(op_call),  ANY_MODE(op_ret), ANY_MODE(op_halt),
+        MODES(op_in),       ANY_MODE(op_out),
+        // IRET, EI, DI and WAIT run the reference handler; those that can
+        // take an interrupt shorten run_until through cpu_interrupt_check
+        ANY_MODE(op_reference), ANY_MODE(op_reference), ANY_MODE(op_reference), ANY_MODE(op_reference),
+        [OP_WAIT * 4 + 4 ... 255] = &&op_unknown,
+    };
+#undef MODES
+#undef ANY_MODE
+
+    uint16_t *const reg_file[4] = {
+        &cpu->regs.A, &cpu->regs.B, &cpu->regs.C, &cpu->regs.D
+    };
+    DecodedInsn *const cache = cpu->decode_cache;
+    CpuProfile *const profile = cpu->profile;
+    const DecodedInsn *insn = NULL;
+    DecodedInsn scratch;
+    uint16_t pc;
+
+    if (!cpu->running || (cpu->regs.FLAGS & FLAG_HALT)) {
+        return;
+    }
+
+    // Count the instruction that just ran when profiling, then fetch the
+    // next decoded instruction, advance PC and jump to its handler.
+    // cpu_stop zeroes run_until, so this one compare also catches halts.
+#define DISPATCH() do { \
+        if (profile && insn) profile_retire(cpu, insn); \
+        if (cpu->cycles >= cpu->run_until) goto out; \
+        pc = cpu->regs.PC; \
+        insn = &cache[pc & (DECODE_CACHE_SIZE - 1)]; \
+        if (insn->pc != pc || insn->label == NULL) goto miss; \
+        cpu->regs.PC = pc + insn->length; \
+        cpu->cycles += insn->cost; \
+        cpu->instructions++; \
+        goto *insn->label; \
+    } while (0)
+
+    // Operand sources for each addressing mode
+#define IMM (insn->operand)
+#define DIR mem_read16(cpu, insn->operand)
+#define REG (*reg_file[insn->operand])
+#define IND mem_read16(cpu, *reg_file[insn->operand])
+
+    // One handler per addressing mode; BODY sees the operand as `operand`
+#define HANDLERS(name, BODY) \
+    name##_imm: { uint16_t operand = IMM; BODY; DISPATCH(); } \
+    name##_dir: { uint16_t operand = DIR; BODY; DISPATCH(); } \
+    name##_reg: { uint16_t operand = REG; BODY; DISPATCH(); } \
+    name##_ind: { uint16_t operand = IND; BODY; DISPATCH(); }
+
+    DISPATCH();
+
+miss:
+    {
+        DecodedInsn *entry = &cache[pc & (DECODE_CACHE_SIZE - 1)];
+        if (pc > cpu->mmio_base - MAX_INSN_LENGTH) {
+            // Code overlapping device pages runs uncached through the reference handler
+            insn = cpu_decode_cached(cpu, pc, &scratch);
+            cpu->regs.PC = pc + insn->length;
+            cpu->cycles += insn->cost;
+            cpu->instructions++;
+            insn->handler(cpu, insn);
+            DISPATCH();
+        }
+        cpu_fill_decode_entry(cpu, pc, entry);
+        entry->label = (entry->fusion || entry->breakpoint || entry->timer_poll)
+                           ? &&op_reference
+                           : dispatch_table[(entry->opcode << 2) | entry->mode];
+        insn = NULL;  // Has not run yet
+        DISPATCH();
+    }
+
+op_nop:
+    DISPATCH();
+
+    HANDLERS(op_load, cpu->regs.A = operand; set_zn(cpu, operand))
+
+op_store_imm:
+op_store_reg:
+    DISPATCH();
+op_store_dir:
+    mem_write16(cpu, insn->operand, cpu->regs.A);
+    DISPATCH();
+op_store_ind:
+    mem_write16(cpu, *reg_file[insn->operand], cpu->regs.A);
+    DISPATCH();
+
+op_mov_imm:
+op_mov_dir:
+op_mov_ind:
+    DISPATCH();
+op_mov_reg:
+    {
+        uint16_t value = *reg_file[insn->operand];
+        *reg_file[insn->dest_reg] = value;
+        set_zn(cpu, value);
+    }
+    DISPATCH();
+
+    HANDLERS(op_push, stack_push16(cpu, operand))
+
+op_pop:
+    cpu->regs.A = stack_pop16(cpu);
+    set_zn(cpu, cpu->regs.A);
+    DISPATCH();
+
+    HANDLERS(op_add, {
+        uint32_t result = cpu->regs.A + operand;
+        set_carry_overflow(cpu, result > 0xFFFF, ~(cpu->regs.A ^ operand) & (cpu->regs.A ^ result));
+        cpu->regs.A = result & 0xFFFF;
+        set_zn(cpu, cpu->regs.A);
+    })
+
+    HANDLERS(op_sub, {
+        int32_t result = cpu->regs.A - operand;
+        set_carry_overflow(cpu, result < 0, (cpu->regs.A ^ operand) & (cpu->regs.A ^ result));
+        cpu->regs.A = result & 0xFFFF;
+        set_zn(cpu, cpu->regs.A);
+    })
+
+op_inc_imm:
+op_inc_dir:
+op_inc_ind:
+    cpu->regs.A++;
+    set_zn(cpu, cpu->regs.A);
+    DISPATCH();
+op_inc_reg:
+    set_zn(cpu, ++*reg_file[insn->operand]);
+    DISPATCH();
+
+op_dec_imm:
+op_dec_dir:
+op_dec_ind:
+    cpu->regs.A--;
+    set_zn(cpu, cpu->regs.A);
+    DISPATCH();
+op_dec_reg:
+    set_zn(cpu, --*reg_file[insn->operand]);
+    DISPATCH();
+
+    HANDLERS(op_mul, cpu->regs.A = (cpu->regs.A * operand) & 0xFFFF; set_zn(cpu, cpu->regs.A))
+
+    HANDLERS(op_div, if (operand != 0) { cpu->regs.A = cpu->regs.A / operand; set_zn(cpu, cpu->regs.A); })
+
+    HANDLERS(op_and, cpu->regs.A &= operand; set_zn(cpu, cpu->regs.A))
+    HANDLERS(op_or, cpu->regs.A |= operand; set_zn(cpu, cpu->regs.A))
+    HANDLERS(op_xor, cpu->regs.A ^= operand; set_zn(cpu, cpu->regs.A))
+
+op_not:
+    cpu->regs.A = ~cpu->regs.A;
+    set_zn(cpu, cpu->regs.A);
+    DISPATCH();
+
+    HANDLERS(op_shl, cpu->regs.A <<= operand; set_zn(cpu, cpu->regs.A))
+    HANDLERS(op_shr, cpu->regs.A >>= operand; set_zn(cpu, cpu->regs.A))
+
+    HANDLERS(op_cmp, {
+        int32_t result = cpu->regs.A - operand;
+        set_carry_overflow(cpu, result < 0, (cpu->regs.A ^ operand) & (cpu->regs.A ^ result));
+        set_zn(cpu, result & 0xFFFF);
+    })
+
+    HANDLERS(op_test, set_zn(cpu, cpu->regs.A & operand))
+
+    HANDLERS(op_jmp, cpu->regs.PC = operand)
+    HANDLERS(op_jz, if (cpu->regs.FLAGS & FLAG_ZERO) cpu->regs.PC = operand)
+    HANDLERS(op_jnz, if (!(cpu->regs.FLAGS & FLAG_ZERO)) cpu->regs.PC = operand)
+    HANDLERS(op_jc, if (cpu->regs.FLAGS & FLAG_CARRY) cpu->regs.PC = operand)
+    HANDLERS(op_jnc, if (!(cpu->regs.FLAGS & FLAG_CARRY)) cpu->regs.PC = operand)
+
+    HANDLERS(op_call, stack_push16(cpu, cpu->regs.PC); cpu->regs.PC = operand)
+
+op_ret:
+    cpu->regs.PC = stack_pop16(cpu);
+    DISPATCH();
+
+    HANDLERS(op_in, cpu->regs.A = mem_read8(cpu, IO_START + operand); set_zn(cpu, cpu->regs.A))
+
+op_out:
+    mem_write8(cpu, IO_START + 1, cpu->regs.A & 0xFF);
+    DISPATCH();
+
+op_reference:
+op_halt:
+op_unknown:
+    // Superinstructions, breakpoints, timer polls and stops share the
+    // reference handler, so messages and state match cpu_step
+    insn->handler(cpu, insn);
+    DISPATCH();
+
+out:
+    if (insn) {
+        cpu_rewind_io_wait(cpu, insn);
+    }
+    if (profile) {
+        profile_end_slice(cpu);
+    }
+
+#undef HANDLERS
+#undef IMM
+#undef DIR
+#undef REG
+#undef IND
+#undef DISPATCH
+}
+
+#else
+
+// Without labels-as-values fall back to the reference loop
+void cpu_run_threaded(CPU *cpu) {
+    if (cpu->profile) {
+        cpu_run_profiled(cpu);
+        return;
+    }
+    while (cpu->cycles < cpu->run_until) {
+        cpu_step(cpu);
+    }
+}
+
+#endif
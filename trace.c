@@ -0,0 +1,260 @@
+#define _POSIX_C_SOURCE 200809L
+#include "trace.h"
+#include "cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+// Execution tracing.
+//
+// While cpu->trace is set, cpu_run_for runs its slices through
+// cpu_run_traced (or the profiling loop, which also traces). Each executed
+// instruction becomes a 12-byte TraceRecord pushed into a single-producer,
+// single-consumer ring buffer; a writer thread drains the ring to the trace
+// file, so the CPU thread never formats text or makes system calls. When
+// the ring is full the CPU waits for the writer rather than drop records,
+// since every record after a lost one would decode to wrong registers.
+// trace_dump renders a trace file as the text the demos print per step.
+// Passes skipped by the idle-loop fast-forward leave no records.
+
+struct CpuTrace {
+    _Alignas(64) _Atomic uint64_t head;  // Records pushed (CPU thread)
+    _Alignas(64) _Atomic uint64_t tail;  // Records written out (writer thread)
+    _Alignas(64) uint64_t tail_seen;     // CPU thread's last reading of tail
+    atomic_bool stopping;
+    FILE *file;
+    pthread_t writer;
+    bool write_failed;
+    uint16_t regs[TRACE_REG_COUNT];      // A, B, C, D, SP as of the last record
+    TraceRecord ring[TRACE_RING_RECORDS];
+};
+
+// Writer thread: copy records from the ring to the file until stopped and drained
+static void *trace_writer(void *arg) {
+    CpuTrace *trace = arg;
+    const struct timespec idle = { 0, 200000 };
+    for (;;) {
+        bool stopping = atomic_load_explicit(&trace->stopping, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+        if (head == tail) {
+            if (stopping) {
+                break;
+            }
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        // Up to the end of the ring in one write
+        size_t start = tail & (TRACE_RING_RECORDS - 1);
+        size_t count = head - tail;
+        if (start + count > TRACE_RING_RECORDS) {
+            count = TRACE_RING_RECORDS - start;
+        }
+        if (!trace->write_failed &&
+            fwrite(&trace->ring[start], sizeof(TraceRecord), count, trace->file) != count) {
+            trace->write_failed = true;
+        }
+        atomic_store_explicit(&trace->tail, tail + count, memory_order_release);
+    }
+    return NULL;
+}
+
+static void trace_push(CpuTrace *trace, const TraceRecord *record) {
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    if (head - trace->tail_seen == TRACE_RING_RECORDS) {
+        // Looks full: see how far the writer has got, waiting if it is still full
+        while ((trace->tail_seen = atomic_load_explicit(&trace->tail, memory_order_acquire)) ==
+               head - TRACE_RING_RECORDS) {
+            sched_yield();
+        }
+    }
+    trace->ring[head & (TRACE_RING_RECORDS - 1)] = *record;
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+static void trace_current_regs(const CPU *cpu, uint16_t regs[TRACE_REG_COUNT]) {
+    regs[0] = cpu->regs.A;
+    regs[1] = cpu->regs.B;
+    regs[2] = cpu->regs.C;
+    regs[3] = cpu->regs.D;
+    regs[4] = cpu->regs.SP;
+}
+
+// Start tracing to path, replacing any trace in progress
+bool cpu_trace_start(CPU *cpu, const char *path) {
+    cpu_trace_stop(cpu);
+    CpuTrace *trace = aligned_alloc(64, sizeof(CpuTrace));
+    if (!trace) {
+        fprintf(stderr, "Error: Cannot allocate trace buffer\n");
+        return false;
+    }
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        fprintf(stderr, "Error: Cannot create file '%s'\n", path);
+        free(trace);
+        return false;
+    }
+    atomic_init(&trace->head, 0);
+    atomic_init(&trace->tail, 0);
+    atomic_init(&trace->stopping, false);
+    trace->tail_seen = 0;
+    trace->write_failed = false;
+    trace_current_regs(cpu, trace->regs);
+
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    header.pc = cpu->regs.PC;
+    header.sp = cpu->regs.SP;
+    header.a = cpu->regs.A;
+    header.b = cpu->regs.B;
+    header.c = cpu->regs.C;
+    header.d = cpu->regs.D;
+    header.flags = cpu_flags(cpu);
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1 ||
+        pthread_create(&trace->writer, NULL, trace_writer, trace) != 0) {
+        fprintf(stderr, "Error: Cannot start trace to '%s'\n", path);
+        fclose(trace->file);
+        free(trace);
+        return false;
+    }
+    cpu->trace = trace;
+    return true;
+}
+
+// Drain the ring, close the file and stop tracing; false if writing failed
+bool cpu_trace_stop(CPU *cpu) {
+    CpuTrace *trace = cpu->trace;
+    if (!trace) {
+        return true;
+    }
+    atomic_store_explicit(&trace->stopping, true, memory_order_release);
+    pthread_join(trace->writer, NULL);
+    bool ok = !trace->write_failed;
+    if (fclose(trace->file) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Trace file incomplete\n");
+    }
+    free(trace);
+    cpu->trace = NULL;
+    return ok;
+}
+
+// Record the instruction insn just executed
+void trace_record(CPU *cpu, const DecodedInsn *insn) {
+    CpuTrace *trace = cpu->trace;
+    uint16_t regs[TRACE_REG_COUNT];
+    trace_current_regs(cpu, regs);
+
+    TraceRecord record;
+    record.pc = insn->pc;
+    record.instruction = (insn->opcode << 2) | insn->mode;
+    record.flags = cpu_flags(cpu);
+    record.operand = insn->operand | (insn->dest_reg << 8);
+    record.changed = 0;
+    record.kind = TRACE_INSN;
+    int used = 0;
+    for (int r = 0; r < TRACE_REG_COUNT; r++) {
+        if (regs[r] == trace->regs[r]) {
+            continue;
+        }
+        if (used == 2) {
+            // More than two changed (an interrupt was taken): carry the rest ahead
+            record.kind = TRACE_STATE;
+            trace_push(trace, &record);
+            record.kind = TRACE_INSN;
+            record.changed = 0;
+            used = 0;
+        }
+        record.changed |= 1 << r;
+        record.values[used++] = regs[r];
+        trace->regs[r] = regs[r];
+    }
+    while (used < 2) {
+        record.values[used++] = 0;
+    }
+    trace_push(trace, &record);
+}
+
+// Engine loop for cpu_run_for while tracing: run until cycles reaches run_until
+void cpu_run_traced(CPU *cpu) {
+    DecodedInsn scratch;
+    while (cpu->cycles < cpu->run_until) {
+        uint16_t pc = cpu->regs.PC;
+        const DecodedInsn *insn = cpu_decode_cached(cpu, pc, &scratch);
+        cpu->regs.PC = pc + insn->length;
+        cpu->cycles += insn->cost;
+        cpu->instructions++;
+        insn->handler(cpu, insn);
+        if (!cpu->running) {
+            // Breakpoints and rewound I/O waits run again on resume: not recorded yet
+            cpu_rewind_io_wait(cpu, insn);
+            if (cpu->regs.PC == pc) {
+                break;
+            }
+        }
+        trace_record(cpu, insn);
+    }
+}
+
+// Print the records of a trace file whose PC lies in [from, to], one line
+// per instruction in the demos' format
+bool trace_dump(const char *path, uint16_t from, uint16_t to) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", path);
+        return false;
+    }
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "Error: '%s' is not a trace file\n", path);
+        fclose(f);
+        return false;
+    }
+
+    uint16_t regs[TRACE_REG_COUNT] = { header.a, header.b, header.c, header.d, header.sp };
+    uint64_t executed = 0;
+    uint64_t shown = 0;
+    TraceRecord records[1024];
+    size_t count;
+    while ((count = fread(records, sizeof(TraceRecord), 1024, f)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            const TraceRecord *record = &records[i];
+            int used = 0;
+            for (int r = 0; r < TRACE_REG_COUNT && used < 2; r++) {
+                if (record->changed & (1 << r)) {
+                    regs[r] = record->values[used++];
+                }
+            }
+            if (record->kind != TRACE_INSN) {
+                continue;
+            }
+            executed++;
+            if (record->pc < from || record->pc > to) {
+                continue;
+            }
+            shown++;
+
+            uint8_t zn_flags = 0;
+            if (record->flags & FLAG_ZERO) zn_flags |= 0x10;
+            if (record->flags & FLAG_NEGATIVE) zn_flags |= 0x01;
+            printf("[PC=0x%04X] %-7s | R0=0x%04X R1=0x%04X R2=0x%04X R3=0x%04X SP=0x%04X ZN=%02X\n",
+                   record->pc, get_instruction_name(record->instruction >> 2, record->instruction & 3),
+                   regs[0], regs[1], regs[2], regs[3], regs[4], zn_flags);
+        }
+    }
+    fclose(f);
+    printf("\n%llu instructions traced, %llu shown\n", (unsigned long long)executed,
+           (unsigned long long)shown);
+    return true;
+}
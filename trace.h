@@ -0,0 +1,50 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Binary execution trace file: a TraceHeader with the registers at the
+// start, then one fixed-size TraceRecord per executed instruction. Records
+// carry only the registers the instruction changed; a reader rebuilds the
+// full register file by applying them in order.
+#define TRACE_MAGIC "CPUTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RING_RECORDS 65536  // Ring buffer between CPU and writer; power of two
+
+// TraceRecord.changed bits, also the order of TraceRecord.values
+#define TRACE_REG_A  0x01
+#define TRACE_REG_B  0x02
+#define TRACE_REG_C  0x04
+#define TRACE_REG_D  0x08
+#define TRACE_REG_SP 0x10
+#define TRACE_REG_COUNT 5
+
+typedef enum {
+    TRACE_INSN = 0,   // An instruction executed at pc
+    TRACE_STATE = 1,  // More changed registers for the next TRACE_INSN
+} TraceKind;
+
+typedef struct {
+    char magic[8];
+    uint16_t version;
+    uint16_t record_size;
+    uint16_t pc, sp, a, b, c, d;  // Registers before the first record
+    uint8_t flags;
+    uint8_t reserved[3];
+} TraceHeader;
+
+typedef struct {
+    uint16_t pc;
+    uint8_t instruction;  // Opcode << 2 | mode
+    uint8_t flags;        // FLAGS after the instruction
+    uint16_t operand;     // Decoded operand; MOV reg has the destination in the high byte
+    uint8_t changed;      // TRACE_REG_* bits of the registers in values
+    uint8_t kind;         // TraceKind
+    uint16_t values[2];   // New values of the changed registers, lowest bit first
+} TraceRecord;
+
+// Function declarations
+bool trace_dump(const char *path, uint16_t from, uint16_t to);
+
+#endif // TRACE_H